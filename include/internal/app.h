@@ -18,10 +18,22 @@
 #define VHASH_INTERNAL_APP_H
 
 #include <string>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
 #include <unordered_set>
+#include "spdlog/spdlog.h"
+#include "tqdm.h"
+#include "vhash_app.h"
 #include "vhash_hash.h"
 #include "internal/cache.h"
+#include "internal/hashfile.h"
+#include "internal/journal.h"
+#include "internal/pipeline.h"
 #include "internal/scan.h"
 #include "internal/util.h"
 
@@ -50,43 +62,882 @@ inline std::unordered_set<std::string> app_generate_ext_set(const std::vector<st
     return set;
 }
 
-inline uint64_t app_get_file_hash(std::mutex& db_lock, const db_cache& db, const std::string& path, bool use_cache, FileType ft) {
+constexpr uint64_t APP_SHARD_FNV_BASIS = 0xcbf29ce484222325ULL;
+constexpr uint64_t APP_SHARD_FNV_PRIME = 0x100000001b3ULL;
+
+// shard of path under root by FNV-1a of its relative path, separators are hashed as '/' so that processes
+// and nodes of any platform or mount point agree on the partition without a coordinator
+inline uint32_t app_shard_of(const std::string& root, const std::string& path, uint32_t count) {
+    size_t pos = path.compare(0, root.size(), root) == 0 ? root.size() : 0;
+    while (pos < path.size() && path[pos] == file_seperator())
+        pos++;
+    uint64_t h = APP_SHARD_FNV_BASIS;
+    for (; pos < path.size(); pos++) {
+        char c = path[pos] == file_seperator() ? '/' : path[pos];
+        h = (h ^ static_cast<unsigned char>(c)) * APP_SHARD_FNV_PRIME;
+    }
+    // fold high bits, low bits of FNV-1a alone are weak for power of two counts
+    h ^= h >> 32;
+    return static_cast<uint32_t>(h % count);
+}
+
+// path is selected by shard of conf, all paths are when it is not sharded
+template<typename Config>
+inline bool app_in_shard(const Config& conf, const std::string& root, const std::string& path) {
+    return conf.shard_count <= 1 || app_shard_of(root, path, static_cast<uint32_t>(conf.shard_count)) ==
+                                    static_cast<uint32_t>(conf.shard_index);
+}
+
+/**
+ * Run statistics
+ */
+struct app_stats {
+    std::atomic<int64_t> files{0};      // files found by scanner
+    std::atomic<int64_t> hashed{0};     // files decoded and hashed
+    std::atomic<int64_t> cached{0};     // files hit in cache
+    std::atomic<int64_t> linked{0};     // files sharing inode with a hashed file
+    std::atomic<int64_t> resumed{0};    // files found in journal
+    std::atomic<int64_t> indexed{0};    // unchanged files found in index
+    std::atomic<int64_t> failed{0};     // files failed to hash
+    std::atomic<int64_t> timeout{0};    // files ran out of decode budget or timed out in cache
+    std::vector<stage_metrics> stages;  // pipeline stages
+    uint64_t mem_limit = 0;             // memory budget of decoding
+    uint64_t mem_peak = 0;              // peak reserved memory
+    uint64_t mem_largest = 0;           // largest memory estimate of a single file
+    int64_t mem_waits = 0;              // decodes waited for memory budget
+    uint64_t peak_rss = 0;              // peak resident memory of process
+    int cpus = 0;                       // allowed cpus, 0 if thread budget is disabled
+    int inner_threads = 0;              // threads inside each decode
+};
+
+inline void app_print_stats(const app_stats& stats) {
+    spdlog::info("files: {}, hashed: {}, cached: {}, linked: {}, resumed: {}, failed: {}",
+                 stats.files.load(), stats.hashed.load(), stats.cached.load(),
+                 stats.linked.load(), stats.resumed.load(), stats.failed.load());
+    if (stats.timeout > 0)
+        spdlog::info("timeout: {}", stats.timeout.load());
+    if (stats.indexed > 0)
+        spdlog::info("indexed: {}", stats.indexed.load());
+    for (auto& st : stats.stages) {
+        spdlog::info("stage {}: workers: {}, processed: {}, busy: {:.3f}s, queue peak: {}/{}, queue avg: {:.2f}",
+                     st.name, st.workers, st.processed, st.busy_seconds, st.peak_depth, st.capacity, st.avg_depth);
+    }
+    spdlog::info("threads: cpus: {}, inner threads: {}", stats.cpus, stats.inner_threads);
+    // estimates are too low if peak rss is much higher than reserved peak under a tight budget
+    const double mb = 1024.0 * 1024.0;
+    spdlog::info("memory: budget: {:.1f}MB, reserved peak: {:.1f}MB, largest estimate: {:.1f}MB, waits: {}, peak rss: {:.1f}MB",
+                 stats.mem_limit / mb, stats.mem_peak / mb, stats.mem_largest / mb, stats.mem_waits, stats.peak_rss / mb);
+}
+
+/**
+ * Path found by scanner, seq is its scan order
+ */
+struct app_path {
+    std::string path;
+    uint64_t seq = 0;
+};
+
+/**
+ * File to be hashed, links are the other paths of the same inode, hard links or paths under bind mounts
+ */
+struct app_file {
+    std::string path;
+    uint64_t seq = 0;
+    file_id id{0, 0};
+    bool coalesce = false;              // paths of the same device and inode are hashed once
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool failed = false;                // reading or decoding failed or timed out, its hash is not a hash value
+    bool timeout = false;               // decoding ran out of budget
+    bool indexed = false;               // hash value comes from index of caller
+    std::vector<app_path> links;
+};
+
+/**
+ * Output record of hash cmd
+ */
+struct app_record {
+    std::string path;
+    uint64_t hv = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool failed = false;    // hv is not a hash value
+    bool timeout = false;   // failed as decoding ran out of budget
+};
+
+// records of hash cmd in scan order are buffered up to window size
+constexpr size_t APP_REORDER_WINDOW = 64 * 1024;
+
+// hash value in hex as std::hex does
+inline void app_append_hex(uint64_t hv, std::string& buf) {
+    static const char digits[] = "0123456789abcdef";
+    char hex[16];
+    int n = 0;
+    do {
+        hex[n++] = digits[hv & 0xF];
+        hv >>= 4;
+    } while (hv);
+    buf.append("0x");
+    while (n > 0)
+        buf.push_back(hex[--n]);
+}
+
+// status of a record that failed to hash, empty if it is hashed
+inline const char *app_record_status(const app_record& record) {
+    return record.timeout ? "timeout" : record.failed ? "failed" : "";
+}
+
+// FILE and HASH lines of record, and STATUS line if it failed
+inline void app_format_record(const app_record& record, std::string& buf) {
+    buf.append("FILE: ").append(record.path).append("\nHASH: ");
+    app_append_hex(record.hv, buf);
+    buf.push_back('\n');
+    if (record.failed)
+        buf.append("STATUS: ").append(app_record_status(record)).push_back('\n');
+}
+
+// quoted json string, bytes other than quote, backslash and control characters are kept
+inline void app_append_json(const std::string& str, std::string& buf) {
+    static const char digits[] = "0123456789abcdef";
+    buf.push_back('"');
+    for (char c : str) {
+        auto u = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            buf.push_back('\\');
+            buf.push_back(c);
+        } else if (u < 0x20) {
+            buf.append("\\u00");
+            buf.push_back(digits[u >> 4]);
+            buf.push_back(digits[u & 0xF]);
+        } else {
+            buf.push_back(c);
+        }
+    }
+    buf.push_back('"');
+}
+
+// one json object per line
+inline void app_format_ndjson(const app_record& record, std::string& buf) {
+    buf.append("{\"path\":");
+    app_append_json(record.path, buf);
+    // hash is a string, 64-bit integers are not exact in json numbers
+    buf.append(",\"hash\":\"");
+    app_append_hex(record.hv, buf);
+    buf.append("\",\"size\":").append(std::to_string(record.size));
+    buf.append(",\"mtime\":").append(std::to_string(record.mtime));
+    if (record.failed)
+        buf.append(",\"status\":\"").append(app_record_status(record)).push_back('"');
+    buf.append("}\n");
+}
+
+constexpr const char *APP_CSV_HEADER = "path,hash,size,mtime,status\n";
+
+// csv row, path is quoted if needed
+inline void app_format_csv(const app_record& record, std::string& buf) {
+    if (record.path.find_first_of(",\"\r\n") == std::string::npos) {
+        buf.append(record.path);
+    } else {
+        buf.push_back('"');
+        for (char c : record.path) {
+            if (c == '"') buf.push_back('"');
+            buf.push_back(c);
+        }
+        buf.push_back('"');
+    }
+    buf.push_back(',');
+    app_append_hex(record.hv, buf);
+    buf.append(",").append(std::to_string(record.size));
+    buf.append(",").append(std::to_string(record.mtime));
+    buf.append(",").append(app_record_status(record)).push_back('\n');
+}
+
+/**
+ * Output of hash records in text, ndjson, csv or bin format
+ * Records are written by writer thread, bin format needs an output file
+ */
+class app_output {
+public:
+    app_output(const std::string& file_path, const std::string& format, size_t reorder_window=0) {
+        if (format == "bin") {
+            if (file_path.empty())
+                return;
+            bin.reset(new HashFileWriter(file_path));
+            if (!bin->is_open())
+                return;
+            HashFileWriter *w = bin.get();
+            writer.reset(new AsyncWriter<app_record>([w](const app_record& record) {
+                uint32_t flags = (record.failed ? HASHFILE_FAILED : 0) | (record.timeout ? HASHFILE_TIMEOUT : 0);
+                w->append(record.hv, record.size, record.mtime, record.path, flags);
+            }, reorder_window));
+        } else if (format == "ndjson") {
+            writer.reset(new AsyncWriter<app_record>(file_path, app_format_ndjson, reorder_window));
+        } else if (format == "csv") {
+            writer.reset(new AsyncWriter<app_record>(file_path, app_format_csv, reorder_window, APP_CSV_HEADER));
+        } else {
+            writer.reset(new AsyncWriter<app_record>(file_path, app_format_record, reorder_window));
+        }
+    }
+
+    bool is_open() const {
+        return writer && writer->is_open();
+    }
+
+    void write(uint64_t seq, app_record record) {
+        writer->write(seq, std::move(record));
+    }
+
+    // shard of records is kept in header of bin format
+    void set_shard(int index, int count) {
+        if (bin && count > 1)
+            bin->set_shard(static_cast<uint32_t>(index), static_cast<uint32_t>(count));
+    }
+
+    // dihedral mode of hashes is kept in header of bin format
+    void set_dihedral(bool dihedral) {
+        if (bin)
+            bin->set_dihedral(dihedral);
+    }
+
+    // return error of writing
+    int close() {
+        int rtn = writer ? writer->close() : 0;
+        if (bin) {
+            int bin_rtn = bin->close();
+            if (rtn == 0) rtn = bin_rtn;
+        }
+        return rtn;
+    }
+
+private:
+    std::unique_ptr<HashFileWriter> bin;
+    std::unique_ptr<AsyncWriter<app_record>> writer;
+};
+
+/**
+ * Inode table of scanned files
+ * The first path of an inode owns hashing, other paths share its hash value. Every file is keyed, since a bind
+ * mounted copy shares device and inode with its source while its link count is 1
+ */
+class inode_table {
+public:
+    enum class state {
+        OWNER,      /* caller should hash the file */
+        PENDING,    /* owner is hashing, path will be released by owner */
+        DONE,       /* owner has finished */
+    };
+
+    state acquire(const file_id& id, const app_path& path, uint64_t& hv, bool& cached, bool& failed, bool& timeout) {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        auto it = inodes.find(id);
+        if (it == inodes.end()) {
+            inodes.emplace(id, entry());
+            return state::OWNER;
+        }
+        if (it->second.done) {
+            hv = it->second.hv;
+            cached = it->second.cached;
+            failed = it->second.failed;
+            timeout = it->second.timeout;
+            return state::DONE;
+        }
+        it->second.links.emplace_back(path);
+        return state::PENDING;
+    }
+
+    // return paths linked while owner was hashing
+    std::vector<app_path> release(const file_id& id, uint64_t hv, bool cached, bool failed, bool timeout) {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        auto& e = inodes[id];
+        e.done = true;
+        e.hv = hv;
+        e.cached = cached;
+        e.failed = failed;
+        e.timeout = timeout;
+        std::vector<app_path> links;
+        links.swap(e.links);
+        return links;
+    }
+
+private:
+    struct entry {
+        bool done = false;
+        bool cached = false;
+        bool failed = false;
+        bool timeout = false;
+        uint64_t hv = 0;
+        std::vector<app_path> links;
+    };
+
+    std::unordered_map<file_id, entry, file_id_hash> inodes;
+    std::mutex lock;
+};
+
+// fill file info of path, return true if cache item of unchanged file is found
+inline bool app_find_file_cache(std::mutex& db_lock, const db_cache& db, const std::string& path, cache_item& file_info) {
+    auto v = scanner_path_split(path);
+    file_info.parent = std::get<0>(v);
+    file_info.file = std::get<1>(v);
+    scanner_get_file_info(path, file_info.file_size, file_info.file_update_ts);
+
+    cache_item key {.parent=std::get<0>(v), .file=std::get<1>(v)};
+    std::vector<cache_item> item;
+    {
+        std::lock_guard<std::mutex> lock(db_lock);
+        item = db.get(key);
+    }
+
+    if (!item.empty() &&
+        item[0].file_update_ts == file_info.file_update_ts && item[0].file_size == file_info.file_size) {
+        file_info.file_hash = item[0].file_hash;
+        file_info.cheap_hash = item[0].cheap_hash;
+        file_info.has_cheap = item[0].has_cheap;
+        file_info.cheap_only = item[0].cheap_only;
+        file_info.dihedral = item[0].dihedral;
+        file_info.timeout = item[0].timeout;
+        file_info.rec_update_ts = item[0].rec_update_ts;
+        return true;
+    }
+    return false;
+}
+
+// record holds hashes of both tiers, cheap_hv is only kept if has_cheap, cheap_only records have no file hash yet,
+// dihedral records have the file hash of canonical variants, timeout records have no file hash until they are retried
+inline void app_set_file_cache(std::mutex& db_lock, const db_cache& db, const std::string& path, uint64_t hv,
+                               uint64_t cheap_hv=0, bool has_cheap=false, bool cheap_only=false, bool dihedral=false,
+                               bool timeout=false) {
     auto v = scanner_path_split(path);
     cache_item file_info{.parent=std::get<0>(v), .file=std::get<1>(v)};
     scanner_get_file_info(path, file_info.file_size, file_info.file_update_ts);
+    file_info.file_hash = hv;
+    file_info.cheap_hash = has_cheap ? cheap_hv : 0;
+    file_info.has_cheap = has_cheap;
+    file_info.cheap_only = cheap_only;
+    file_info.dihedral = dihedral;
+    file_info.timeout = timeout;
 
-    if (use_cache) {
-        cache_item key {.parent=std::get<0>(v), .file=std::get<1>(v)};
-        std::vector<cache_item> item;
+    std::lock_guard<std::mutex> lock(db_lock);
+    db.set(file_info);
+}
 
+// hash of a single file with decode budget of conf, failed tells the file has no hash value, timeout that it ran out
+// of budget now or in cache, timeouts are cached and retried as in app_run_pipeline
+template<typename Config>
+inline uint64_t app_get_file_hash(std::mutex& db_lock, const db_cache& db, const Config& conf, Watchdog& watchdog,
+                                  const std::string& path, FileType ft, app_stats& stats, bool& failed, bool& timeout) {
+    failed = false;
+    timeout = false;
+    cache_item file_info{};
+    bool found = conf.use_cache && app_find_file_cache(db_lock, db, path, file_info);
+    if (found && !file_info.cheap_only && file_info.dihedral == conf.dihedral &&
+        (!file_info.timeout || std::time(nullptr) - file_info.rec_update_ts < conf.timeout_retry)) {
+        stats.cached++;
+        if (file_info.timeout) {
+            stats.timeout++;
+            failed = true;
+            timeout = true;
+            return 0;
+        }
+        return file_info.file_hash;
+    }
+
+    hasher h(ft, HashType::TP_WHASH, false, conf.dihedral);
+    int rtn;
+    {
+        std::unique_ptr<DecodeScope> scope(conf.timeout > 0 || conf.max_packets > 0 ?
+                                           new DecodeScope(&watchdog, path, conf.max_packets) : nullptr);
+        rtn = h.load(path);
+    }
+    uint64_t cheap_hv = found ? file_info.cheap_hash : 0;
+    bool has_cheap = found && file_info.has_cheap;
+    if (rtn == VERROR(errors::ERR_TIMEOUT)) {
+        spdlog::error("load file \"{}\" timed out", path);
+        stats.timeout++;
+        failed = true;
+        timeout = true;
+        if (conf.use_cache)
+            app_set_file_cache(db_lock, db, path, 0, cheap_hv, has_cheap, false, conf.dihedral, true);
+        return 0;
+    } else if (rtn < 0) {
+        spdlog::error("load file \"{}\" failed: {}", path, rtn);
+        stats.failed++;
+        failed = true;
+        return 0;
+    }
+    uint64_t hv = h.hash();
+    stats.hashed++;
+
+    if (conf.use_cache)
+        app_set_file_cache(db_lock, db, path, hv, cheap_hv, has_cheap, false, conf.dihedral);
+    return hv;
+}
+
+/**
+ * Hash tier of pipeline
+ * full: hash of hasher, journaled and cached as file hash
+ * cheap: candidate hash of reduced hasher, cached beside file hash
+ */
+enum class app_tier {
+    FULL,
+    CHEAP,
+};
+
+/**
+ * Hash job passing through pipeline stages
+ */
+struct app_job {
+    app_file file;
+    FileType ft = FileType::TP_OTHER;
+    bool owner = false;                 // owns hashing of an inode shared by other paths
+    bool cached = false;                // hash value comes from cache
+    bool resumed = false;               // hash value comes from journal or index
+    bool failed = false;                // reading or decoding failed or timed out, hv is not a hash value
+    uint64_t hv = 0;                    // hash value
+    uint64_t kept = 0;                  // cached hash of the other tier, kept when the record is rewritten
+    bool kept_full = false;             // cheap tier keeps a file hash of full tier
+    bool kept_cheap = false;            // full tier keeps a cheap hash of cheap tier
+    uint64_t cost = 0;                  // estimated hashing cost
+    uint64_t mem = 0;                   // estimated memory of decoding and hashing
+    std::vector<uint8_t> data;          // encoded image data
+    std::unique_ptr<hasher> h;          // decoded file
+};
+
+using app_job_ptr = std::unique_ptr<app_job>;
+
+/**
+ * Stage indices of pipeline
+ * meta: stat, hard link and cache lookup
+ * read: read image, prefetch video
+ * decode: decode image or video thumbs, videos have their own stage when decode jobs are reserved
+ * hash: transform and hash
+ * output: cache write and output
+ */
+struct app_stages {
+    size_t meta = 0;
+    size_t read = 1;
+    size_t decode = 2;
+    size_t decode_video = 2;
+    size_t hash = 3;
+    size_t output = 4;
+    size_t done = 5;
+
+    explicit app_stages(bool reserved) {
+        if (reserved) {
+            decode_video = decode + 1;
+            hash = decode_video + 1;
+            output = hash + 1;
+            done = output + 1;
+        }
+    }
+};
+
+// prefetched head of video, containers keep their index near the beginning
+constexpr size_t APP_VIDEO_PREFETCH = 8 * 1024 * 1024;
+
+// videos are decoded in full and compress much better than images, so a video byte costs more
+constexpr uint64_t APP_VIDEO_COST_WEIGHT = 4;
+
+// estimated hashing cost of file, used by lpt schedule
+inline uint64_t app_estimate_cost(FileType ft, uint64_t size) {
+    return ft == FileType::TP_VIDEO ? size * APP_VIDEO_COST_WEIGHT : size;
+}
+
+// bytes per pixel of image decoding, decoders may expand rows to color before converting to gray
+constexpr uint64_t APP_IMAGE_DECODE_BYTES = 4;
+
+// bytes per pixel of wavelet hash on the power of 2 square, resized pixels and double buffers
+constexpr uint64_t APP_IMAGE_HASH_BYTES = 1 + 3 * sizeof(double);
+
+// pixels per byte of images with unknown header
+constexpr uint64_t APP_IMAGE_UNKNOWN_RATIO = 10;
+
+// decoded frames held by video decoder, reference frames and frame threads
+constexpr uint64_t APP_VIDEO_FRAME_BUFFERS = 16;
+
+// bytes of a video thumb, one thumb is sampled per second
+constexpr uint64_t APP_VIDEO_THUMB_BYTES = 144 * 144 * 3;
+
+// max width of video collage
+constexpr uint64_t APP_VIDEO_COLLAGE_SIDE = 1024;
+
+// estimated peak memory of decoding and hashing an image
+inline uint64_t app_estimate_image_memory(uint64_t size, int rows, int cols) {
+    uint64_t pixels = static_cast<uint64_t>(rows) * cols;
+    if (pixels == 0)
+        pixels = size * APP_IMAGE_UNKNOWN_RATIO;
+    uint64_t side = 8;
+    uint64_t min_side = rows > 0 && cols > 0 ? static_cast<uint64_t>(std::min(rows, cols)) : 0;
+    while (side * 2 <= min_side)
+        side *= 2;
+    return size + pixels * APP_IMAGE_DECODE_BYTES + side * side * APP_IMAGE_HASH_BYTES;
+}
+
+// estimated peak memory of decoding and hashing a video
+inline uint64_t app_estimate_video_memory(int rows, int cols, double seconds) {
+    uint64_t frame = static_cast<uint64_t>(rows) * cols * 3 / 2;
+    auto samples = static_cast<uint64_t>(std::max(1.0, std::ceil(seconds)));
+    uint64_t collage = APP_VIDEO_COLLAGE_SIDE * APP_VIDEO_COLLAGE_SIDE * (3 + APP_IMAGE_HASH_BYTES);
+    // thumbs are kept until hashed and copied into collage
+    return frame * APP_VIDEO_FRAME_BUFFERS + samples * APP_VIDEO_THUMB_BYTES * 2 + collage;
+}
+
+// hash jobs of produce(submit) through the stage pipeline, emit is called once per file with its links, files that
+// failed or timed out are emitted with failed set and no hash value
+// fifo schedule starts hashing as soon as the first job is submitted, lpt schedule takes all jobs first and
+// starts the most expensive ones first so that small files backfill the idle workers at the end
+// hashed files are appended to journal if set, resumed run takes unchanged files from journal
+// known(file, hv) looks up unchanged files in an index of caller, they skip hashing, cache and journal
+// cheap tier skips journal and known, its hash is cached beside the file hash
+template<typename Config, typename F, typename K, typename P>
+inline int app_run_pipeline(const Config& conf, const db_cache& db, app_stats& stats, app_tier tier, F emit, K known, P produce) {
+    std::unique_ptr<Journal> journal;
+    if (!conf.journal.empty() && tier == app_tier::FULL) {
+        uint32_t mode = conf.dihedral ? JOURNAL_DIHEDRAL : 0;
+        journal.reset(new Journal(conf.journal, conf.resume, mode));
+        if (journal->mode() != mode) {
+            spdlog::error("journal file \"{}\" is hashed {} dihedral mode, it is not resumed", conf.journal,
+                          journal->mode() & JOURNAL_DIHEDRAL ? "in" : "without");
+            return VERROR(errors::ERR_PARAM_INVALID);
+        }
+        if (!journal->is_open()) {
+            spdlog::error("open journal file \"{}\" failed", conf.journal);
+            return VERROR(errors::ERR_OPEN_FILE);
+        }
+    }
+
+    int decode_jobs, hash_jobs;
+    if (conf.no_thread_budget) {
+        decode_jobs = conf.jobs > 0 ? conf.jobs : static_cast<int>(std::thread::hardware_concurrency());
+        if (decode_jobs <= 0) decode_jobs = 8;
+        hash_jobs = conf.hash_jobs > 0 ? conf.hash_jobs : std::max(1, decode_jobs / 2);
+    } else {
+        // workers and threads inside decodes share the allowed cpus
+        thread_budget threads = thread_budget_make(thread_budget_cpus(), conf.jobs, conf.hash_jobs);
+        thread_budget_apply(threads);
+        decode_jobs = threads.decode_jobs;
+        hash_jobs = threads.hash_jobs;
+        stats.cpus = threads.cpus;
+        stats.inner_threads = threads.inner_threads;
+    }
+    int io_jobs = conf.io_jobs > 0 ? conf.io_jobs : 4;
+    size_t queue_size = conf.queue_size;
+
+    // reserved decode jobs, the other type takes the rest of decode jobs
+    bool reserved = conf.image_jobs > 0 || conf.video_jobs > 0;
+    int image_jobs = conf.image_jobs > 0 ? conf.image_jobs : std::max(1, decode_jobs - conf.video_jobs);
+    int video_jobs = conf.video_jobs > 0 ? conf.video_jobs : std::max(1, decode_jobs - conf.image_jobs);
+    const app_stages stage(reserved);
+
+    // decodes wait for budget, memory is released after hashing
+    MemoryBudget budget(static_cast<uint64_t>(std::max<int64_t>(conf.max_memory, 0)));
+
+    // decoding of each file is bounded by time and packets per frame, broken files fail fast
+    Watchdog watchdog(conf.timeout);
+    bool decode_budget = conf.timeout > 0 || conf.max_packets > 0;
+    auto decode_scope = [&](const std::string& path) {
+        return std::unique_ptr<DecodeScope>(decode_budget ? new DecodeScope(&watchdog, path, conf.max_packets) : nullptr);
+    };
+
+    bool has_progress = !conf.no_progress && !conf.output.empty();
+    tqdm bar;
+    int completed = 0;
+    std::mutex bar_lock;
+    std::mutex db_lock;
+    inode_table inodes;
+
+    auto done = [&]() {
+        if (!has_progress) return;
+        // total is refined as the scan proceeds
+        std::lock_guard<std::mutex> lock(bar_lock);
+        bar.progress(++completed, static_cast<int>(stats.files.load()));
+    };
+
+    auto meta = [&](app_job_ptr& job) -> size_t {
+        auto& file = job->file;
+        if (tier == app_tier::FULL && known(file, job->hv)) {
+            stats.indexed++;
+            job->resumed = true;
+            file.indexed = true;
+            return stage.output;
+        }
+        if (journal && journal->find(file.path, file.size, file.mtime, job->hv)) {
+            stats.resumed++;
+            job->resumed = true;
+            return stage.output;
+        }
+
+        if (file.coalesce) {
+            switch (inodes.acquire(file.id, app_path{file.path, file.seq}, job->hv, job->cached, job->failed,
+                                   file.timeout)) {
+                case inode_table::state::PENDING:
+                    stats.linked++;
+                    done();
+                    return stage.done;
+                case inode_table::state::DONE:
+                    stats.linked++;
+                    return stage.output;
+                default:
+                    job->owner = true;
+                    break;
+            }
+        }
+
+        cache_item file_info;
+        if (conf.use_cache && app_find_file_cache(db_lock, db, file.path, file_info)) {
+            if (tier == app_tier::CHEAP) {
+                // cheap records are written without dihedral flag, so a dihedral file hash is not kept
+                job->kept_full = !file_info.cheap_only && !file_info.dihedral && !file_info.timeout;
+                job->kept = job->kept_full ? file_info.file_hash : 0;
+                if (!file_info.has_cheap)
+                    return stage.read;
+                stats.cached++;
+                job->hv = file_info.cheap_hash;
+                job->cached = true;
+                return stage.output;
+            }
+            job->kept = file_info.cheap_hash;
+            job->kept_cheap = file_info.has_cheap;
+            if (file_info.cheap_only || file_info.dihedral != conf.dihedral)
+                return stage.read;
+            // a timeout is retried once the record is old enough
+            if (file_info.timeout && std::time(nullptr) - file_info.rec_update_ts >= conf.timeout_retry)
+                return stage.read;
+            stats.cached++;
+            job->cached = true;
+            if (file_info.timeout) {
+                stats.timeout++;
+                file.timeout = true;
+                job->failed = true;
+                return stage.output;
+            }
+            job->hv = file_info.file_hash;
+            return stage.output;
+        }
+        return stage.read;
+    };
+
+    auto read = [&](app_job_ptr& job) -> size_t {
+        int rows = 0, cols = 0;
+        if (job->ft == FileType::TP_VIDEO) {
+            file_prefetch(job->file.path, APP_VIDEO_PREFETCH);
+            if (budget.limit() > 0) {
+                double seconds = 0;
+                auto scope = decode_scope(job->file.path);
+                video_probe(job->file.path, rows, cols, seconds);
+                job->mem = app_estimate_video_memory(rows, cols, seconds);
+            }
+            return stage.decode_video;
+        }
+        FileLoader loader(job->file.path, "rb");
+        if (!loader.is_open() || loader.read(job->data) < 0) {
+            spdlog::error("read file \"{}\" failed", job->file.path);
+            stats.failed++;
+            job->failed = true;
+            return stage.output;
+        }
+        if (budget.limit() > 0) {
+            image_probe(job->data, rows, cols);
+            job->mem = app_estimate_image_memory(job->data.size(), rows, cols);
+        }
+        return stage.decode;
+    };
+
+    auto decode = [&](app_job_ptr& job) -> size_t {
+        budget.acquire(job->mem);
+        job->h.reset(tier == app_tier::CHEAP ? new hasher(job->ft, HashType::TP_DHASH, true) :
+                     new hasher(job->ft, HashType::TP_WHASH, false, conf.dihedral));
+        int rtn;
         {
-            std::lock_guard<std::mutex> lock(db_lock);
-            item = db.get(key);
+            auto scope = decode_scope(job->file.path);
+            if (job->ft == FileType::TP_VIDEO) {
+                rtn = job->h->load(job->file.path);
+            } else {
+                rtn = job->h->load(job->data);
+                std::vector<uint8_t>().swap(job->data);
+            }
+        }
+        if (rtn == VERROR(errors::ERR_TIMEOUT)) {
+            spdlog::error("load file \"{}\" timed out", job->file.path);
+            stats.timeout++;
+            job->file.timeout = true;
+            job->failed = true;
+            job->h.reset();
+            budget.release(job->mem);
+            return stage.output;
+        } else if (rtn < 0) {
+            spdlog::error("load file \"{}\" failed: {}", job->file.path, rtn);
+            stats.failed++;
+            job->failed = true;
+            job->h.reset();
+            budget.release(job->mem);
+            return stage.output;
         }
+        return stage.hash;
+    };
 
-        time_t now;
-        time(&now);
-        if (!item.empty() &&
-            item[0].file_update_ts == file_info.file_update_ts && item[0].file_size == file_info.file_size) {
-            return item[0].file_hash;
+    auto hash = [&](app_job_ptr& job) -> size_t {
+        job->hv = job->h->hash();
+        job->h.reset();
+        budget.release(job->mem);
+        stats.hashed++;
+        return stage.output;
+    };
+
+    // output stage has one worker, journal is appended without lock
+    int journal_error = 0;
+    auto output = [&](app_job_ptr& job) -> size_t {
+        auto& file = job->file;
+        if (job->owner)
+            file.links = inodes.release(file.id, job->hv, job->cached, job->failed, file.timeout);
+        // timeouts are cached with timeout flag so that later runs skip them until retry, other failures are not
+        // cached, nor are cheap tier timeouts
+        bool full = tier == app_tier::FULL;
+        if (conf.use_cache && !job->cached && !job->resumed && (!job->failed || (file.timeout && full))) {
+            uint64_t hv = full ? job->hv : job->kept;
+            uint64_t cheap_hv = full ? job->kept : job->hv;
+            bool has_cheap = !full || job->kept_cheap;
+            bool cheap_only = !full && !job->kept_full;
+            bool dihedral = full && conf.dihedral;
+            bool timeout = full && file.timeout;
+            app_set_file_cache(db_lock, db, file.path, hv, cheap_hv, has_cheap, cheap_only, dihedral, timeout);
+            for (auto& link : file.links)
+                app_set_file_cache(db_lock, db, link.path, hv, cheap_hv, has_cheap, cheap_only, dihedral, timeout);
+        }
+        if (journal && !job->resumed && !job->failed && journal_error == 0) {
+            journal_error = journal->append(job->hv, file.size, file.mtime, file.path);
+            for (auto& link : file.links) {
+                if (journal_error == 0)
+                    journal_error = journal->append(job->hv, file.size, file.mtime, link.path);
+            }
         }
+        file.failed = job->failed;
+        emit(file, job->hv);
+        done();
+        return stage.done;
+    };
+
+    Pipeline<app_job_ptr> pipeline;
+    pipeline.add_stage("meta", io_jobs, queue_size, meta);
+    pipeline.add_stage("read", io_jobs, queue_size, read);
+    if (reserved) {
+        pipeline.add_stage("decode_image", image_jobs, queue_size, decode);
+        pipeline.add_stage("decode_video", video_jobs, queue_size, decode);
+    } else {
+        pipeline.add_stage("decode", decode_jobs, queue_size, decode);
     }
+    pipeline.add_stage("hash", hash_jobs, queue_size, hash);
+    pipeline.add_stage("output", 1, queue_size, output);
+    pipeline.start();
 
-    hasher h(ft);
-    int rtn = h.load(path);
-    if (rtn < 0) {
-        spdlog::error("load file \"{}\" failed: {}", path, rtn);
-        return 0;
+    // memory is bounded by queue sizes in fifo schedule
+    bool lpt = conf.schedule == "lpt";
+    std::vector<app_job_ptr> jobs;
+    produce([&](app_job_ptr job) {
+        stats.files++;
+        if (lpt)
+            jobs.emplace_back(std::move(job));
+        else
+            pipeline.push(std::move(job));
+    });
+
+    if (lpt) {
+        // longest processing time first, directory order among equal costs
+        std::stable_sort(jobs.begin(), jobs.end(), [](const app_job_ptr& a, const app_job_ptr& b) {
+            return a->cost > b->cost;
+        });
+        for (auto& job : jobs)
+            pipeline.push(std::move(job));
+        std::vector<app_job_ptr>().swap(jobs);
     }
-    file_info.file_hash = h.hash();
 
-    if (use_cache) {
-        std::lock_guard<std::mutex> lock(db_lock);
-        db.set(file_info);
+    pipeline.finish();
+    stats.stages = pipeline.metrics();
+    stats.mem_limit = budget.limit();
+    stats.mem_peak = budget.peak();
+    stats.mem_largest = budget.largest();
+    stats.mem_waits = budget.waits();
+    stats.peak_rss = memory_peak_rss();
+    if (has_progress) bar.finish();
+
+    if (journal) {
+        int rtn = journal->close();
+        if (journal_error == 0) journal_error = rtn;
+        if (journal_error < 0) {
+            spdlog::error("write journal file \"{}\" failed", conf.journal);
+            return journal_error;
+        }
     }
-    return file_info.file_hash;
+    return 0;
 }
 
+// scan and hash files of conf through the stage pipeline, see app_run_pipeline
+// files out of shard of conf are skipped before they are queued
+template<typename Config, typename F, typename K>
+inline int app_hash_files(const Config& conf, const db_cache& db, app_stats& stats, F emit, K known,
+                          app_tier tier=app_tier::FULL) {
+    return app_run_pipeline(conf, db, stats, tier, emit, known, [&conf, &stats](auto submit) {
+        // scanner is the producer
+        set_t black_set;
+        set_t white_set = app_generate_ext_set(conf.ext);
+        std::string root = scanner_abs_path(conf.path);
+        scanner scan(conf.path);
+        scan.for_each_stat([&](const char *parent, const char *file, const struct stat& st) -> bool {
+            if (!scanner_ext_filter(black_set, white_set, file))
+                return false;
+            FileType ft = app_check_file_type(file);
+            if (ft == FileType::TP_OTHER)
+                return false;
+
+            std::string path = parent;
+            path += file_seperator();
+            path += file;
+            if (!app_in_shard(conf, root, path))
+                return false;
+
+            app_job_ptr job(new app_job());
+            job->file.path = std::move(path);
+            job->file.seq = static_cast<uint64_t>(stats.files.load());
+            job->file.id = scanner_file_id(st);
+            // links are known by inode, a file without stat has none
+            job->file.coalesce = st.st_ino != 0;
+            job->file.size = static_cast<uint64_t>(st.st_size);
+            job->file.mtime = static_cast<int64_t>(st.st_mtime);
+            job->ft = ft;
+            job->cost = app_estimate_cost(ft, st.st_size);
+            submit(std::move(job));
+
+            return false; // file has been processed, not add to results
+        }, conf.recursive);
+    });
+}
+
+// hash listed files of an earlier run, such as candidates of cheap tier, their links are kept as they are
+template<typename Config, typename F>
+inline int app_hash_listed(const Config& conf, const db_cache& db, app_stats& stats, std::vector<app_file>& files, F emit) {
+    return app_run_pipeline(conf, db, stats, app_tier::FULL, emit, [](const app_file&, uint64_t&) {
+        return false;
+    }, [&files](auto submit) {
+        for (auto& file : files) {
+            app_job_ptr job(new app_job());
+            job->file = std::move(file);
+            // links are resolved already
+            job->file.coalesce = false;
+            job->file.failed = false;
+            job->file.timeout = false;
+            job->ft = app_check_file_type(job->file.path);
+            job->cost = app_estimate_cost(job->ft, job->file.size);
+            submit(std::move(job));
+        }
+    });
+}
+
+template<typename Config, typename F>
+inline int app_hash_files(const Config& conf, const db_cache& db, app_stats& stats, F emit) {
+    return app_hash_files(conf, db, stats, emit, [](const app_file&, uint64_t&) { return false; });
+}
+
+// group files of binary hash files into duplicate groups of conf, see dup.cpp
+int dup_hashfiles(const dup_config& conf, const std::vector<std::string>& files);
+
 }
 
 #endif //VHASH_INTERNAL_APP_H
@@ -31,6 +31,11 @@ struct cache_item {
     int64_t rec_update_ts;
 
     uint64_t file_hash;
+    uint64_t cheap_hash;    // hash of cheap tier, valid if has_cheap
+    bool has_cheap;         // cheap tier is computed, its hash may be 0
+    bool cheap_only;        // only cheap tier is computed, file hash is not set
+    bool dihedral;          // file hash is of the canonical variant of flips and rotations
+    bool timeout;           // decoding ran out of budget at rec_update_ts, file hash is not set
 };
 
 class cache {
@@ -57,6 +62,11 @@ inline auto init_storage(const std::string& db_file) {
                                    make_column("file_update_ts", &cache_item::file_update_ts),
                                    make_column("rec_update_ts", &cache_item::rec_update_ts),
                                    make_column("file_hash", &cache_item::file_hash),
+                                   make_column("cheap_hash", &cache_item::cheap_hash, default_value(0)),
+                                   make_column("has_cheap", &cache_item::has_cheap, default_value(false)),
+                                   make_column("cheap_only", &cache_item::cheap_only, default_value(false)),
+                                   make_column("dihedral", &cache_item::dihedral, default_value(false)),
+                                   make_column("timeout", &cache_item::timeout, default_value(false)),
                                    primary_key(&cache_item::parent, &cache_item::file))
     );
 }
@@ -75,6 +85,8 @@ public:
     int del(const cache_item& key) const override;
     int clear() const override;
     int pure(int64_t period) const override;
+    // copy rows of other cache, rows updated later win, merged rows num is returned
+    int64_t merge(const db_cache& other) const;
 
 private:
     using db_storage = decltype(init_storage(""));
@@ -0,0 +1,136 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VHASH_INTERNAL_EXTERNAL_H
+#define VHASH_INTERNAL_EXTERNAL_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "internal/util.h"
+
+namespace vhash {
+
+/**
+ * Record of external groups, path packs the offset of path in path file above its length
+ */
+struct external_record {
+    uint64_t hash;
+    uint64_t path;
+};
+
+// low bits of path in record holding the length of path
+constexpr int EXTERNAL_PATH_LEN_BITS = 16;
+
+// bytes of each sequential read or write of runs and paths
+constexpr size_t EXTERNAL_BLOCK_SIZE = 4 << 20;
+
+// smallest block, tiny memory caps merge in more passes instead of reading smaller blocks
+constexpr size_t EXTERNAL_MIN_BLOCK = 64 << 10;
+
+// smallest memory cap
+constexpr uint64_t EXTERNAL_MIN_MEMORY = 256 << 10;
+
+/**
+ * Exact and banded near groups of more files than fit in memory
+ * Paths are appended to a path file, records of (hash, path) are buffered up to half the memory cap, the other half
+ * is scratch of their radix sort, and written as sorted runs. Runs are k-way merged with one block of each in
+ * memory, so reads and writes are sequential blocks. More runs than the memory holds blocks of are merged in passes.
+ * Near groups split hashes into distance + 1 bands, by pigeonhole any pair within distance has one equal band.
+ * Runs are sorted by each band in turn and records of equal band value are grouped in memory, a pair is linked in
+ * its first equal band only. Groups are not merged across bands, a file is reported at most once per band.
+ */
+class ExternalGroups {
+public:
+    using group_fn = std::function<void(uint64_t hv, const std::vector<std::string>& paths)>;
+    using path_fn = std::function<void(uint64_t hv, const std::string& path, bool first)>;
+    using record_fn = std::function<int(const external_record& record)>;
+
+    // temp files are created in a new folder under dir and removed with groups
+    ExternalGroups(const std::string& dir, uint64_t memory);
+    ExternalGroups(const ExternalGroups& other) = delete;
+    ~ExternalGroups();
+
+    bool is_open() const;
+    int add(uint64_t hv, const char *path, size_t len);
+
+    int add(uint64_t hv, const std::string& path) {
+        return add(hv, path.c_str(), path.size());
+    }
+
+    uint64_t size() const {
+        return count;
+    }
+
+    // call f(hv, paths) for each group of two or more files linked by pairs within distance, paths are sorted by
+    // hash and hv is the smallest hash of group, diameter bounds the distance within a group, 0 is unbounded
+    // distance 0 groups files of equal hash in hash order
+    int for_each_group(int distance, int diameter, const group_fn& f);
+
+    // call f(hv, path, first) for each file of a hash shared by two or more files, in hash order, first starts a
+    // group, runs of equal hash are streamed from the merge so a group may be larger than memory
+    int for_each_exact(const path_fn& f);
+
+    // runs written, merge passes of last grouping and bytes written to temp files
+    uint64_t runs() const { return runs_num; }
+    uint64_t passes() const { return passes_num; }
+    uint64_t spilled() const { return spilled_bytes; }
+
+private:
+    struct band {
+        int shift;
+        int bits;
+        uint64_t mask;
+
+        uint64_t key(uint64_t hv) const {
+            return (hv >> shift) & mask;
+        }
+    };
+
+    int flush_paths();
+    int flush_all(const band& full);
+    int flush_records(const band& b, std::vector<std::string>& out);
+    int write_run(const std::vector<external_record>& run, std::vector<std::string>& out);
+    int sort_runs(const band& b, std::vector<std::string>& out);
+    int merge(const band& b, std::vector<std::string> in, const record_fn& f);
+    int merge_runs(const band& b, const std::vector<std::string>& in, size_t first, size_t last, const record_fn& f);
+    int group_bucket(const std::vector<band>& bands, size_t b, std::vector<external_record>& bucket,
+                     int distance, int diameter, const group_fn& f);
+    int read_path(uint64_t path, std::string& out) const;
+
+    std::string dir;
+    ThreadPool pool;
+    size_t block;                           // bytes of sequential reads and writes
+    size_t fan_in;                          // runs merged at once
+    size_t capacity;                        // records buffered before a run is written
+    std::vector<external_record> records;
+    std::vector<external_record> scratch;
+    std::vector<std::string> base;          // runs of added records sorted by hash
+    std::string paths;                      // buffered paths
+    int paths_fd = -1;
+    uint64_t paths_size = 0;
+    uint64_t count = 0;
+    uint64_t run_seq = 0;
+    uint64_t runs_num = 0;
+    uint64_t passes_num = 0;
+    uint64_t spilled_bytes = 0;
+    int error = 0;
+};
+
+}
+
+#endif //VHASH_INTERNAL_EXTERNAL_H
@@ -0,0 +1,157 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VHASH_INTERNAL_HASHFILE_H
+#define VHASH_INTERNAL_HASHFILE_H
+
+#include <cstdint>
+#include <string>
+
+namespace vhash {
+
+/**
+ * Binary hash file
+ * A header, fixed-width records and a string table of NUL terminated paths. Records refer to their
+ * path by offset in the string table, so the file can be mapped and scanned without parsing.
+ * Integers are stored in the byte order of the writer, readers refuse files whose byte order marker
+ * does not read back as HASHFILE_BYTE_ORDER. Hashes of a file are taken in one dihedral mode, flagged by
+ * HASHFILE_DIHEDRAL, files of different modes must not be compared. Records of files that failed to hash are
+ * flagged by HASHFILE_FAILED, their hash is not a hash value.
+ */
+constexpr char HASHFILE_MAGIC[8] = {'V', 'H', 'A', 'S', 'H', 'B', 'I', 'N'};
+constexpr uint32_t HASHFILE_VERSION = 2;
+constexpr uint32_t HASHFILE_BYTE_ORDER = 0x01020304;
+// flags of header
+constexpr uint32_t HASHFILE_DIHEDRAL = 1;
+// flags of record, a timed out file is failed too
+constexpr uint32_t HASHFILE_FAILED = 1;
+constexpr uint32_t HASHFILE_TIMEOUT = 2;
+
+struct hashfile_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;             // records num
+    uint64_t records_offset;    // offset of first record
+    uint64_t strings_offset;    // offset of string table
+    uint64_t strings_size;      // bytes of string table
+    uint32_t shard_index;       // shard of files, see app_shard_of
+    uint32_t shard_count;       // shards num, 0 is not sharded
+    uint32_t byte_order;        // HASHFILE_BYTE_ORDER in native order of writer
+    uint32_t flags;             // HASHFILE_DIHEDRAL
+};
+
+struct hashfile_record {
+    uint64_t hash;      // hash value
+    uint64_t size;      // file size
+    int64_t mtime;      // file modification time in seconds
+    uint64_t path;      // path offset in string table
+    uint32_t flags;     // HASHFILE_FAILED, HASHFILE_TIMEOUT
+    uint32_t reserved;
+};
+
+static_assert(sizeof(hashfile_header) == 64, "hash file header should be 64 bytes");
+static_assert(sizeof(hashfile_record) == 40, "hash file record should be 40 bytes");
+
+// check magic of binary hash file
+bool hashfile_check(const std::string& file_path);
+
+/**
+ * Binary hash file writer
+ * Records are written after the header as they come, paths go to a temporary file that is appended
+ * as string table on close.
+ */
+class HashFileWriter {
+public:
+    explicit HashFileWriter(const std::string& file_path);
+    HashFileWriter(const HashFileWriter& other) = delete;
+    ~HashFileWriter();
+
+    bool is_open() const;
+    int append(uint64_t hash, uint64_t size, int64_t mtime, const std::string& path, uint32_t flags=0);
+    // shard of written files, saved in header on close
+    void set_shard(uint32_t index, uint32_t count);
+    // dihedral mode of hashes, saved in header on close
+    void set_dihedral(bool dihedral);
+    // write string table and header
+    int close();
+
+private:
+    int flush();
+
+    std::string file_path;
+    std::string strings_path;
+    int fd;
+    int strings_fd;
+    std::string records;
+    std::string strings;
+    uint64_t count;
+    uint64_t strings_size;
+    uint32_t shard_index;
+    uint32_t shard_count;
+    uint32_t flags;
+    int error;
+};
+
+/**
+ * Binary hash file reader
+ * The file is mapped read only, records and paths are valid while the reader is alive.
+ */
+class HashFileReader {
+public:
+    explicit HashFileReader(const std::string& file_path);
+    HashFileReader(const HashFileReader& other) = delete;
+    ~HashFileReader();
+
+    bool is_open() const;
+    uint64_t size() const;
+    uint32_t shard_index() const;
+    uint32_t shard_count() const;
+    // hashes are taken in dihedral mode
+    bool dihedral() const;
+
+    const hashfile_record& operator[](size_t index) const {
+        return records[index];
+    }
+
+    // empty if offset is out of string table
+    const char *path(const hashfile_record& record) const {
+        return record.path < strings_size ? strings + record.path : "";
+    }
+
+    const hashfile_record *begin() const {
+        return records;
+    }
+
+    const hashfile_record *end() const {
+        return records + count;
+    }
+
+private:
+    void *data;
+    size_t length;
+    const hashfile_record *records;
+    const char *strings;
+    uint64_t strings_size;
+    uint64_t count;
+    uint32_t shard;
+    uint32_t shards;
+    uint32_t flags;
+};
+
+}
+
+#endif //VHASH_INTERNAL_HASHFILE_H
@@ -19,9 +19,11 @@
 
 #include <string>
 #include <array>
+#include <cmath>
 #include <utility>
 #include <vector>
 #include <iostream>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 #include <fftw3.h> // for fft
 #include <wavelib.h> // for wavelet
@@ -221,7 +223,7 @@ public:
     imagehash(const imagehash& other) = delete;
     virtual ~imagehash() = default;
 
-    int load(const std::string& file_path){
+    int load(const std::string& file_path, int flags=cv::IMREAD_GRAYSCALE){
         FileLoader loader(file_path, "rb");
         if (!loader.is_open()) {
             spdlog::error("open file {} failed", file_path);
@@ -230,14 +232,25 @@ public:
 
         std::vector<uint8_t> data;
         loader.read(data);
+        return load(data, flags);
+    }
+
+    // reduced flags such as IMREAD_REDUCED_GRAYSCALE_8 let jpeg decoders skip most of the work
+    int load(const std::vector<uint8_t>& data, int flags=cv::IMREAD_GRAYSCALE){
         try {
-            void *img_data = &data[0];
+            void *img_data = const_cast<uint8_t*>(data.data());
             int img_len = data.size();
-            image = cv::imdecode(cv::Mat(1, img_len, CV_8UC1, img_data), cv::IMREAD_GRAYSCALE);
+            image = cv::imdecode(cv::Mat(1, img_len, CV_8UC1, img_data), flags);
         } catch (cv::Exception &e) {
             spdlog::error("decode image file with exception: {}", e.what());
             return VERROR(errors::ERR_DECODE_IMAGE);
         }
+        // decoding can not be interrupted, image decoded past its budget is dropped as timed out
+        DecodeBudget *budget = DecodeBudget::current();
+        if (budget && budget->expired()) {
+            image.release();
+            return VERROR(errors::ERR_TIMEOUT);
+        }
         return data.size();
     }
 
@@ -290,6 +303,98 @@ public:
     }
 };
 
+// FFTW planner is shared by all threads and not thread safe
+inline std::mutex& fftw_planner_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+// bits of values above their median
+template<size_t N>
+inline hashval<N> median_bits(const std::array<double, N * N>& values) {
+    std::array<double, N * N> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    size_t len = sorted.size();
+    double med = (sorted[(len+1)/2 - 1] + sorted[len / 2]) / 2.0;
+
+    hashval<N> hv;
+    for (int i=0; i<values.size(); ++i) {
+        hv.set(i, values[i] > med);
+    }
+    return hv;
+}
+
+// dihedral variants of a square image, bit 0 of a variant flips columns, bit 1 flips rows and bit 2 transposes
+constexpr int DIHEDRAL_VARIANTS = 8;
+
+// block of N x N values of the variant of an image, spatial values move with their pixels while a flip
+// negates the odd frequencies of its axis in a block of DCT coefficients
+template<size_t N>
+inline void dihedral_block(const std::array<double, N * N>& block, int variant, bool frequency,
+                           std::array<double, N * N>& out) {
+    for (int r = 0; r < N; ++r) {
+        for (int c = 0; c < N; ++c) {
+            int fr = r, fc = c;
+            double sign = 1.0;
+            if (variant & 1) {
+                if (frequency) sign = (c & 1) ? -sign : sign;
+                else fc = N - 1 - c;
+            }
+            if (variant & 2) {
+                if (frequency) sign = (r & 1) ? -sign : sign;
+                else fr = N - 1 - r;
+            }
+            out[r * N + c] = sign * ((variant & 4) ? block[fc * N + fr] : block[fr * N + fc]);
+        }
+    }
+}
+
+// column and row moments of a block, a flip negates the moment of its axis and a transpose swaps them,
+// the lowest horizontal and vertical frequencies are the moments of a frequency block
+template<size_t N>
+inline void dihedral_moments(const std::array<double, N * N>& block, bool frequency, double& mx, double& my) {
+    if (frequency) {
+        mx = block[1];
+        my = block[N];
+        return;
+    }
+    mx = 0;
+    my = 0;
+    for (int r = 0; r < N; ++r) {
+        for (int c = 0; c < N; ++c) {
+            mx += (2 * c - static_cast<int>(N - 1)) * block[r * N + c];
+            my += (2 * r - static_cast<int>(N - 1)) * block[r * N + c];
+        }
+    }
+}
+
+// hash of the canonical variant of an image from its block of N x N values, so flipped and rotated copies
+// share it. A variant is canonical when both moments are non negative and the column one is the larger,
+// ties of symmetric images are broken by the smaller hash. bits(values) hashes the block of a variant
+template<size_t N, typename B>
+inline hashval<N> dihedral_canonical(const std::array<double, N * N>& block, bool frequency, B bits) {
+    double mx, my;
+    dihedral_moments<N>(block, frequency, mx, my);
+    double eps = 1e-9 * (std::fabs(mx) + std::fabs(my)) + 1e-12;
+
+    hashval<N> best;
+    bool found = false;
+    std::array<double, N * N> variant;
+    for (int v = 0; v < DIHEDRAL_VARIANTS; ++v) {
+        dihedral_block<N>(block, v, frequency, variant);
+        double vx, vy;
+        dihedral_moments<N>(variant, frequency, vx, vy);
+        if (vx < -eps || vy < -eps || vx < vy - eps)
+            continue;
+        hashval<N> hv = bits(variant);
+        if (!found || hv < best) {
+            best = hv;
+            found = true;
+        }
+    }
+    return best;
+}
+
 /**
  * Perceptual Hash computation
  * Implementation follows http://www.hackerfactor.com/blog/index.php?/archives/432-Looks-Like-It.html
@@ -298,7 +403,9 @@ template<size_t N=8>
 class phash : public imagehash<N> {
 public:
     using imagehash<N>::imagehash;
-    explicit phash(int high_freq_factor=4): imagehash<N>::imagehash(),high_freq_factor(high_freq_factor) {}
+    // dihedral hashes the canonical variant of flips and rotations, derived from signs and transposes of the DCT
+    explicit phash(int high_freq_factor=4, bool dihedral=false):
+        imagehash<N>::imagehash(), high_freq_factor(high_freq_factor), dihedral(dihedral) {}
 
     static_assert(N >= 2, "Hash size must be greater than or equal to 2");
 
@@ -322,46 +429,44 @@ public:
         }
 
         Array<double> dct(img_size * img_size);
-        fftw_plan plan = fftw_plan_r2r_2d(
-                img_size, img_size,
-                pixels.data(), dct.data(),
-                FFTW_REDFT10, FFTW_REDFT10, // DCT-II
-                FFTW_ESTIMATE
-        );
+        fftw_plan plan;
+        {
+            // planner is not thread safe, plan executes in this thread
+            std::lock_guard<std::mutex> lock(fftw_planner_lock());
+            plan = fftw_plan_r2r_2d(
+                    img_size, img_size,
+                    pixels.data(), dct.data(),
+                    FFTW_REDFT10, FFTW_REDFT10, // DCT-II
+                    FFTW_ESTIMATE
+            );
+        }
         fftw_execute(plan);
-        fftw_destroy_plan(plan);
+        {
+            std::lock_guard<std::mutex> lock(fftw_planner_lock());
+            fftw_destroy_plan(plan);
+        }
 
         std::array<double, N * N> dct_lowfreq;
-        std::array<double, N * N> dct_tosort;
 
         int index_low = 0;
         int index = 0;
         for (int i = 0; i < N; ++i) {
             for (int j = 0; j < N; ++j) {
                 dct_lowfreq[index_low] = dct[index];
-                dct_tosort[index_low] = dct[index];
                 index_low += 1;
                 index += 1;
             }
             index += (img_size - N);
         }
 
-        auto median = [](std::array<double, N * N>& arr) -> double {
-            std::sort(arr.begin(), arr.end());
-            size_t len = arr.size();
-            return (arr[(len+1)/2 - 1] + arr[len / 2]) / 2.0;
-        };
-
-        double med = median(dct_tosort);
-        for (int i=0; i<dct_lowfreq.size(); ++i) {
-            hv.set(i, dct_lowfreq[i] > med);
-        }
-
-        return hv;
+        if (dihedral)
+            return dihedral_canonical<N>(dct_lowfreq, true, median_bits<N>);
+        return median_bits<N>(dct_lowfreq);
     }
 
 private:
     int high_freq_factor;
+    bool dihedral;
 };
 
 /**
@@ -406,9 +511,10 @@ template<size_t N=8>
 class whash : public imagehash<N> {
 public:
     using imagehash<N>::imagehash;
-    explicit whash(std::string mode="haar", int img_scale=0, bool remove_max_haar_ll=true):
+    // dihedral hashes the canonical variant of flips and rotations, the haar LL band moves with pixels
+    explicit whash(std::string mode="haar", int img_scale=0, bool remove_max_haar_ll=true, bool dihedral=false):
         imagehash<N>::imagehash(),
-        mode(std::move(mode)), img_scale(img_scale), remove_max_haar_ll(remove_max_haar_ll)  {}
+        mode(std::move(mode)), img_scale(img_scale), remove_max_haar_ll(remove_max_haar_ll), dihedral(dihedral)  {}
 
     static_assert(N >= 2, "Hash size must be greater than or equal to 2");
     static_assert((N & (N-1)) == 0, "Hash size should be power of 2");
@@ -479,19 +585,9 @@ public:
         wt2_object wt = wt2_init(w, "dwt", img_scale, img_scale, dwt_level);
         double *coeffs = dwt2(wt, pixels.data());
 
-        std::array<double, N * N> coeffs_tosort;
-        for (int i=0; i<N * N; i++) coeffs_tosort[i] = coeffs[i];
-
-        auto median = [](std::array<double, N * N>& arr) -> double {
-            std::sort(arr.begin(), arr.end());
-            size_t len = arr.size();
-            return (arr[(len+1)/2 - 1] + arr[len / 2]) / 2.0;
-        };
-
-        double med = median(coeffs_tosort);
-        for (int i=0; i<coeffs_tosort.size(); ++i) {
-            hv.set(i, coeffs[i] > med);
-        }
+        std::array<double, N * N> coeffs_ll;
+        for (int i=0; i<N * N; i++) coeffs_ll[i] = coeffs[i];
+        hv = dihedral ? dihedral_canonical<N>(coeffs_ll, false, median_bits<N>) : median_bits<N>(coeffs_ll);
 
         wt2_free(wt);
         wave_free(w);
@@ -504,6 +600,7 @@ private:
     std::string mode;
     int img_scale;
     bool remove_max_haar_ll;
+    bool dihedral;
 };
 
 }
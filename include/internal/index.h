@@ -0,0 +1,725 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VHASH_INTERNAL_INDEX_H
+#define VHASH_INTERNAL_INDEX_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "internal/util.h"
+
+namespace vhash {
+
+// bits differing between two hashes
+inline int hamming_distance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+// hashes below a node are kept in a flat leaf when there are at most this many of them
+constexpr size_t BKTREE_LEAF_SIZE = 128;
+
+/**
+ * BK-tree of 64-bit hashes under Hamming distance
+ * Built in bulk, children of a node are laid out contiguously and sorted by their distance to the node,
+ * so radius search scans a narrow slice of children. Small subtrees are flat leaves scanned with popcount.
+ * Copies of a node's hash are kept in its duplicate list instead of a chain of children. Ids are positions in
+ * the built hashes.
+ */
+class BKTree {
+public:
+    BKTree() = default;
+    explicit BKTree(const std::vector<uint64_t>& hashes) {
+        build(hashes);
+    }
+
+    void build(const std::vector<uint64_t>& hashes);
+
+    size_t size() const {
+        return nodes.size() + leaf_ids.size() + dup_ids.size();
+    }
+
+    // call f(id, distance) for every hash within radius of hv
+    template<typename F>
+    void radius(uint64_t hv, int r, F f) const {
+        if (nodes.empty())
+            return;
+        // stack of nodes to visit is reused by queries of the thread
+        static thread_local std::vector<uint32_t> stack;
+        stack.clear();
+        stack.push_back(0);
+        while (!stack.empty()) {
+            const node& n = nodes[stack.back()];
+            stack.pop_back();
+            int d = hamming_distance(hv, n.hash);
+            if (d <= r) {
+                f(n.id, d);
+                for (uint32_t i = n.dup_begin; i < n.dup_begin + n.dup_count; i++)
+                    f(dup_ids[i], d);
+            }
+            // children in [d - r, d + r] may hold hashes within radius
+            for (uint32_t i = n.leaf_begin; i < n.leaf_begin + n.leaf_count; i++) {
+                int ld = hamming_distance(hv, leaf_hashes[i]);
+                if (ld <= r)
+                    f(leaf_ids[i], ld);
+            }
+            const node *child = &nodes[n.child_begin];
+            const node *child_end = child + n.child_count;
+            for (; child != child_end && child->dist + r < d; ++child) {}
+            for (; child != child_end && child->dist <= d + r; ++child)
+                stack.push_back(static_cast<uint32_t>(child - nodes.data()));
+        }
+    }
+
+private:
+    struct node {
+        uint64_t hash;
+        uint32_t id;
+        uint32_t child_begin;
+        uint32_t leaf_begin;
+        uint32_t dup_begin;
+        uint32_t dup_count;     // hashes equal to node's
+        uint8_t leaf_count;
+        uint8_t child_count;
+        uint8_t dist;           // distance to parent
+    };
+
+    std::vector<node> nodes;
+    std::vector<uint64_t> leaf_hashes;
+    std::vector<uint32_t> leaf_ids;
+    std::vector<uint32_t> dup_ids;
+};
+
+// substring tables up to this many bits are addressed directly instead of binary searched
+constexpr int MIH_DIRECT_BITS = 24;
+
+/**
+ * Multi-index hashing of 64-bit hashes
+ * Hashes are split into m disjoint substrings, each indexed in its own table. A hash within radius r
+ * matches at least one substring within r / m, so candidates come from probing substrings near the
+ * query's and are verified with popcount. m is chosen from the number of hashes and the expected radius.
+ * Ids are positions in the built hashes.
+ */
+class MIHIndex {
+public:
+    MIHIndex() = default;
+    MIHIndex(const std::vector<uint64_t>& hashes, int radius) {
+        build(hashes, radius);
+    }
+
+    void build(const std::vector<uint64_t>& hashes, int radius);
+
+    size_t size() const {
+        return hashes.size();
+    }
+
+    // substrings num
+    int substrings() const {
+        return static_cast<int>(tables.size());
+    }
+
+    // call f(id, distance) for every hash within radius of hv
+    template<typename F>
+    void radius(uint64_t hv, int r, F f) const {
+        if (hashes.empty() || r < 0)
+            return;
+        int sub_r = r / static_cast<int>(tables.size());
+        for (size_t t = 0; t < tables.size(); t++) {
+            const table& tb = tables[t];
+            uint64_t key = (hv >> tb.shift) & tb.mask;
+            auto candidate = [&](uint32_t id) {
+                uint64_t x = hv ^ hashes[id];
+                // a hash is found once, by the first table whose substring is near enough
+                for (size_t p = 0; p < t; p++) {
+                    if (__builtin_popcountll((x >> tables[p].shift) & tables[p].mask) <= sub_r)
+                        return;
+                }
+                int d = __builtin_popcountll(x);
+                if (d <= r)
+                    f(id, d);
+            };
+            probe(tb, key, 0, sub_r, candidate);
+        }
+    }
+
+    // choose substrings num of n hashes for radius by estimated probes and candidates
+    static int choose_substrings(size_t n, int radius);
+
+private:
+    struct table {
+        int shift;
+        int bits;
+        uint64_t mask;
+        bool direct;
+        std::vector<uint32_t> offsets;  // bucket offsets of direct table
+        std::vector<uint64_t> keys;     // sorted keys of searched table
+        std::vector<uint32_t> ids;      // ids sorted by key
+    };
+
+    // visit keys within sub_r of key by flipping bits from bit upward
+    template<typename F>
+    void probe(const table& tb, uint64_t key, int bit, int sub_r, F& f) const {
+        lookup(tb, key, f);
+        if (sub_r == 0)
+            return;
+        for (int b = bit; b < tb.bits; b++)
+            probe(tb, key ^ (1ULL << b), b + 1, sub_r - 1, f);
+    }
+
+    template<typename F>
+    void lookup(const table& tb, uint64_t key, F& f) const {
+        if (tb.direct) {
+            for (uint32_t i = tb.offsets[key]; i < tb.offsets[key + 1]; i++)
+                f(tb.ids[i]);
+        } else {
+            auto it = std::lower_bound(tb.keys.begin(), tb.keys.end(), key);
+            for (auto i = static_cast<size_t>(it - tb.keys.begin()); i < tb.keys.size() && tb.keys[i] == key; i++)
+                f(tb.ids[i]);
+        }
+    }
+
+    std::vector<uint64_t> hashes;
+    std::vector<table> tables;
+};
+
+/**
+ * Disjoint set of ids, safe to unite and find from many threads
+ * Lock free, a node packs its parent and the radius of its set as one atomic word. The smaller root id stays root,
+ * so the root of a set is its first member. Radius bounds the distance of members to the hash of root.
+ */
+class DisjointSet {
+public:
+    explicit DisjointSet(size_t n): nodes(new std::atomic<uint64_t>[n]) {
+        for (size_t i = 0; i < n; i++)
+            nodes[i].store(pack(static_cast<uint32_t>(i), 0), std::memory_order_relaxed);
+    }
+
+    uint32_t find(uint32_t x) {
+        while (true) {
+            uint64_t node = nodes[x].load();
+            uint32_t p = parent(node);
+            if (p == x)
+                return x;
+            uint32_t gp = parent(nodes[p].load());
+            // path halving, non root nodes only change here
+            if (gp != p)
+                nodes[x].compare_exchange_weak(node, pack(gp, radius(node)));
+            x = gp;
+        }
+    }
+
+    // returns true when a and b are in one set
+    bool unite(uint32_t a, uint32_t b) {
+        return unite_within(a, b, nullptr, 0);
+    }
+
+    // unite sets of a and b unless their members may be farther apart than diameter, hashes are hash of each id,
+    // returns true when a and b are in one set
+    bool unite_within(uint32_t a, uint32_t b, const uint64_t *hashes, int diameter) {
+        while (true) {
+            a = find(a);
+            b = find(b);
+            if (a == b)
+                return true;
+            if (a > b)
+                std::swap(a, b);
+            uint64_t na = nodes[a].load(), nb = nodes[b].load();
+            if (parent(na) != a || parent(nb) != b)
+                continue;
+            if (hashes) {
+                int d = hamming_distance(hashes[a], hashes[b]);
+                if (radius(na) + d + radius(nb) > diameter)
+                    return false;
+                // widen radius of a first, a stale wider radius only rejects more
+                int r = std::max(radius(na), d + radius(nb));
+                if (r != radius(na) && !nodes[a].compare_exchange_strong(na, pack(a, r)))
+                    continue;
+            }
+            if (nodes[b].compare_exchange_strong(nb, pack(a, radius(nb))))
+                return true;
+        }
+    }
+
+private:
+    static uint64_t pack(uint32_t parent, int radius) {
+        return static_cast<uint64_t>(parent) << 32 | static_cast<uint32_t>(radius);
+    }
+    static uint32_t parent(uint64_t node) { return static_cast<uint32_t>(node >> 32); }
+    static int radius(uint64_t node) { return static_cast<int>(node & 0xffffffff); }
+
+    std::unique_ptr<std::atomic<uint64_t>[]> nodes;
+};
+
+/**
+ * Groups of hashes linked by pairs of a self join, handed out as soon as they are complete
+ * Pairs come from join workers. Once all ids below end are queried, a group of them is complete when none of its
+ * members was paired with an id from end on, as the query of a member finds all its pairs.
+ * Memory is O(ids) however many pairs are linked.
+ */
+class NearGroups {
+public:
+    // diameter bounds the distance of members of a group, 0 is unbounded
+    NearGroups(const std::vector<uint64_t>& hashes, int diameter)
+        : hashes(hashes), diameter(diameter), set(hashes.size()), far(new std::atomic<uint32_t>[hashes.size()]) {
+        for (size_t i = 0; i < hashes.size(); i++)
+            far[i].store(0, std::memory_order_relaxed);
+    }
+
+    // link pair i < j, called from many threads
+    void link(uint32_t i, uint32_t j) {
+        bool linked = diameter > 0 ? set.unite_within(i, j, hashes.data(), diameter) : set.unite(i, j);
+        if (!linked)
+            return;
+        uint32_t f = far[i].load(std::memory_order_relaxed);
+        while (f < j && !far[i].compare_exchange_weak(f, j, std::memory_order_relaxed)) {}
+    }
+
+    // ids below end are queried, f(members) is called for each complete group with members sorted,
+    // groups are rescanned once new ids outnumber pending ones
+    template<typename F>
+    void flush(size_t end, F f) {
+        if (end < hashes.size() && end - next < pending.size())
+            return;
+        for (auto i = static_cast<uint32_t>(next); i < end; i++)
+            pending.emplace_back(0, i);
+        next = end;
+        for (auto& p : pending)
+            p.first = set.find(p.second);
+        std::sort(pending.begin(), pending.end());
+
+        std::vector<std::pair<uint32_t, uint32_t>> rest;
+        std::vector<uint32_t> members;
+        for (size_t g = 0, k; g < pending.size(); g = k) {
+            bool complete = true;
+            for (k = g; k < pending.size() && pending[k].first == pending[g].first; k++)
+                complete = complete && far[pending[k].second].load(std::memory_order_relaxed) < end;
+            if (!complete) {
+                rest.insert(rest.end(), pending.begin() + g, pending.begin() + k);
+                continue;
+            }
+            members.clear();
+            for (size_t m = g; m < k; m++)
+                members.push_back(pending[m].second);
+            f(members);
+        }
+        pending.swap(rest);
+    }
+
+private:
+    const std::vector<uint64_t>& hashes;
+    int diameter;
+    DisjointSet set;
+    std::unique_ptr<std::atomic<uint32_t>[]> far;         // largest id linked with each id
+    std::vector<std::pair<uint32_t, uint32_t>> pending;   // root and id of incomplete groups
+    size_t next = 0;                                      // ids below are pending or handed out
+};
+
+/**
+ * Completion of join tasks in order, the calling thread waits for the next unfinished one
+ */
+class JoinProgress {
+public:
+    explicit JoinProgress(size_t units): done(units, false) {}
+
+    void finish(size_t unit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[unit] = true;
+        cond.notify_one();
+    }
+
+    // wait until the next unit is finished, returns number of leading finished units
+    size_t wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return done[next]; });
+        while (next < done.size() && done[next])
+            next++;
+        return next;
+    }
+
+    bool finished() const { return next == done.size(); }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<bool> done;
+    size_t next = 0;
+};
+
+// queries of each chunk in self join
+constexpr size_t INDEX_QUERY_CHUNK = 4096;
+
+// query every hash against index in parallel, emit(i, j) is called by workers for pairs i < j within radius,
+// done(end) is called by the calling thread whenever all ids below end are queried
+template<typename Index, typename F, typename D>
+inline void index_self_join(const Index& index, const std::vector<uint64_t>& hashes, int r, ThreadPool& pool,
+                            F emit, D done) {
+    size_t chunks = (hashes.size() + INDEX_QUERY_CHUNK - 1) / INDEX_QUERY_CHUNK;
+    JoinProgress progress(chunks);
+    pool.post_batch(chunks, [&](size_t c) {
+        return [&, c] {
+            size_t end = std::min(hashes.size(), (c + 1) * INDEX_QUERY_CHUNK);
+            for (size_t i = c * INDEX_QUERY_CHUNK; i < end; i++) {
+                auto id = static_cast<uint32_t>(i);
+                index.radius(hashes[i], r, [&](uint32_t j, int) {
+                    if (id < j)
+                        emit(id, j);
+                });
+            }
+            progress.finish(c);
+        };
+    });
+    while (!progress.finished())
+        done(std::min(hashes.size(), progress.wait() * INDEX_QUERY_CHUNK));
+}
+
+template<typename Index, typename F>
+inline void index_self_join(const Index& index, const std::vector<uint64_t>& hashes, int r, ThreadPool& pool, F emit) {
+    index_self_join(index, hashes, r, pool, emit, [](size_t) {});
+}
+
+// hashes of a block in brute force join, a 16KB block stays in L1 while rows of another block scan it
+constexpr size_t JOIN_BLOCK_SIZE = 2048;
+// block pairs of each task in brute force join
+constexpr size_t JOIN_TASK_BLOCKS = 16;
+
+// write offsets of b[0..n) within r of x to out, returns number of offsets
+size_t join_match(uint64_t x, const uint64_t *b, size_t n, int r, uint32_t *out);
+// name of match kernel picked for the running cpu, avx512, avx2 or scalar
+const char *join_kernel();
+
+// multi-index hashing wins over trees for small radius, trees degrade less as radius grows
+constexpr int MIH_AUTO_RADIUS = 8;
+// largest set joined by brute force, its quadratic cost outgrows any index above it
+constexpr size_t JOIN_AUTO_MAX = 2 << 20;
+
+// largest set of radius r joined by brute force with the avx512 kernel, indexes prune well at small radius
+inline size_t join_auto_size(int r) {
+    static const size_t sizes[] = {16384, 16384, 16384, 16384, 16384, 131072, 262144, 524288, 1048576};
+    return r < 0 ? sizes[0] : r < 9 ? sizes[r] : JOIN_AUTO_MAX;
+}
+
+// strategy of self join of n hashes within radius r, auto picks by set size, radius and join kernel
+inline std::string index_choose_strategy(const std::string& strategy, size_t n, int r) {
+    if (strategy != "auto")
+        return strategy;
+    // narrower kernels compare pairs 3x slower or worse
+    size_t join_size = join_auto_size(r) >> (std::string(join_kernel()) == "avx512" ? 0 : 1);
+    if (n <= join_size)
+        return "join";
+    return r <= MIH_AUTO_RADIUS ? "mih" : "bktree";
+}
+
+// compare all pairs block by block in parallel, emit(i, j) is called by workers for pairs i < j within radius,
+// done(end) is called by the calling thread whenever all pairs of ids below end are compared
+template<typename F, typename D>
+inline void index_block_join(const std::vector<uint64_t>& hashes, int r, ThreadPool& pool, F emit, D done) {
+    size_t n = hashes.size();
+    size_t blocks = (n + JOIN_BLOCK_SIZE - 1) / JOIN_BLOCK_SIZE;
+    // block pairs bi <= bj are numbered row by row, a row is finished with its last block pair
+    size_t tiles = blocks * (blocks + 1) / 2;
+    size_t tasks = (tiles + JOIN_TASK_BLOCKS - 1) / JOIN_TASK_BLOCKS;
+    std::unique_ptr<std::atomic<size_t>[]> rows(new std::atomic<size_t>[blocks]);
+    for (size_t b = 0; b < blocks; b++)
+        rows[b].store(blocks - b, std::memory_order_relaxed);
+    JoinProgress progress(blocks);
+    pool.post_batch(tasks, [&](size_t t) {
+        return [&, t] {
+            size_t first = t * JOIN_TASK_BLOCKS;
+            size_t count = std::min(tiles - first, JOIN_TASK_BLOCKS);
+            size_t bi = 0;
+            for (size_t row = blocks; first >= row; row--, bi++)
+                first -= row;
+            size_t bj = bi + first;
+            std::vector<uint32_t> out(JOIN_BLOCK_SIZE);
+            for (size_t k = 0; k < count; k++) {
+                size_t i_end = std::min(n, (bi + 1) * JOIN_BLOCK_SIZE);
+                size_t j_end = std::min(n, (bj + 1) * JOIN_BLOCK_SIZE);
+                for (size_t i = bi * JOIN_BLOCK_SIZE; i < i_end; i++) {
+                    size_t begin = bi == bj ? i + 1 : bj * JOIN_BLOCK_SIZE;
+                    size_t m = join_match(hashes[i], hashes.data() + begin, j_end - begin, r, out.data());
+                    for (size_t x = 0; x < m; x++)
+                        emit(static_cast<uint32_t>(i), static_cast<uint32_t>(begin + out[x]));
+                }
+                // advance before finishing the row, the calling thread may return once all rows are finished
+                size_t row = bi;
+                if (++bj == blocks)
+                    bj = ++bi;
+                if (rows[row].fetch_sub(1) == 1)
+                    progress.finish(row);
+            }
+        };
+    });
+    while (!progress.finished())
+        done(std::min(n, progress.wait() * JOIN_BLOCK_SIZE));
+}
+
+template<typename F>
+inline void index_block_join(const std::vector<uint64_t>& hashes, int r, ThreadPool& pool, F emit) {
+    index_block_join(hashes, r, pool, emit, [](size_t) {});
+}
+
+// run f(t) for each t below n on pool and wait until all are finished
+template<typename F>
+inline void index_parallel_for(ThreadPool& pool, size_t n, F f) {
+    JoinProgress progress(n);
+    pool.post_batch(n, [&](size_t t) {
+        return [&, t] {
+            f(t);
+            progress.finish(t);
+        };
+    });
+    while (!progress.finished())
+        progress.wait();
+}
+
+// bits of key sorted by each radix sort pass, 6 passes cover 64 bits with buckets fitting in l1 cache
+constexpr int RADIX_PASS_BITS = 11;
+
+// min items sorted by each task
+constexpr size_t RADIX_TASK_MIN = 1 << 16;
+
+// stable lsd radix sort of items by the low bits of key(item) in parallel, buffer is scratch space
+// every pass counts digits of each part of items, then each part scatters its items after the same digits of
+// earlier parts. Passes where all items share a digit are skipped
+template<typename T, typename K>
+inline void index_radix_sort(std::vector<T>& items, std::vector<T>& buffer, int bits, K key, ThreadPool& pool) {
+    size_t n = items.size();
+    if (n < 2)
+        return;
+    constexpr size_t buckets = size_t(1) << RADIX_PASS_BITS;
+    size_t tasks = std::max<size_t>(1, std::min<size_t>(pool.pool_size(), n / RADIX_TASK_MIN));
+    size_t part = (n + tasks - 1) / tasks;
+    buffer.resize(n);
+    std::vector<T> *src = &items, *dst = &buffer;
+    std::vector<size_t> counts(tasks * buckets);
+    for (int shift = 0; shift < bits; shift += RADIX_PASS_BITS) {
+        std::fill(counts.begin(), counts.end(), 0);
+        index_parallel_for(pool, tasks, [&](size_t t) {
+            size_t *count = counts.data() + t * buckets;
+            const T *in = src->data();
+            for (size_t i = t * part, end = std::min(n, (t + 1) * part); i < end; i++)
+                count[(key(in[i]) >> shift) & (buckets - 1)]++;
+        });
+
+        // offsets of each digit and part in digit major order
+        size_t offset = 0;
+        bool skip = false;
+        for (size_t d = 0; d < buckets; d++) {
+            size_t total = 0;
+            for (size_t t = 0; t < tasks; t++) {
+                size_t c = counts[t * buckets + d];
+                counts[t * buckets + d] = offset + total;
+                total += c;
+            }
+            skip = skip || total == n;
+            offset += total;
+        }
+        if (skip)
+            continue;
+
+        index_parallel_for(pool, tasks, [&](size_t t) {
+            size_t *next = counts.data() + t * buckets;
+            const T *in = src->data();
+            T *out = dst->data();
+            for (size_t i = t * part, end = std::min(n, (t + 1) * part); i < end; i++)
+                out[next[(key(in[i]) >> shift) & (buckets - 1)]++] = in[i];
+        });
+        std::swap(src, dst);
+    }
+    if (src != &items)
+        items.swap(buffer);
+}
+
+// bytes of each arena block of interned paths
+constexpr size_t GROUP_ARENA_BLOCK = 1 << 20;
+
+/**
+ * Paths grouped by hash value for exact duplicates, compact in place of a map of path strings
+ * Each slot appends (hash, path) entries of 16 bytes and interns paths in its own arena of NUL terminated strings,
+ * so slots fill without locks as long as each is used by one thread at a time. sort() merges slots and orders
+ * entries by hash with index_radix_sort, then every group is a run of equal hashes.
+ * Paths of a group keep the order they are added in by slot.
+ */
+class HashGroups {
+public:
+    struct entry {
+        uint64_t hash;
+        const char *path;
+    };
+
+    explicit HashGroups(size_t n=1): slots(n) {}
+    HashGroups(const HashGroups& other) = delete;
+
+    void add(size_t slot, uint64_t hv, const char *path, size_t len);
+
+    void add(size_t slot, uint64_t hv, const std::string& path) {
+        add(slot, hv, path.c_str(), path.size());
+    }
+
+    // entries of all slots
+    size_t size() const;
+
+    // merge slots and sort entries by hash, entries may be added again and sorted once more
+    void sort(ThreadPool& pool);
+
+    // sorted entries
+    const std::vector<entry>& entries() const {
+        return sorted;
+    }
+
+    // call f(hv, begin, end) for every run of equal hashes in sorted entries
+    template<typename F>
+    void for_each_run(F f) const {
+        for (size_t i = 0, j; i < sorted.size(); i = j) {
+            for (j = i + 1; j < sorted.size() && sorted[j].hash == sorted[i].hash; j++) {}
+            f(sorted[i].hash, sorted.data() + i, sorted.data() + j);
+        }
+    }
+
+private:
+    struct slot {
+        std::vector<entry> entries;
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t used = GROUP_ARENA_BLOCK;    // bytes used of last block
+        char pad[64];                       // slots of threads are not in one cache line
+    };
+
+    const char *intern(slot& s, const char *path, size_t len);
+
+    std::vector<slot> slots;
+    std::vector<entry> sorted;
+};
+
+// files under a directory before it takes part in directory groups
+constexpr uint32_t DIR_MIN_FILES = 2;
+// minhash slots of a directory, banded by rows for candidate pairs of similar directories
+constexpr size_t DIR_MINHASH_SLOTS = 64;
+constexpr size_t DIR_MINHASH_ROWS = 4;
+// band buckets larger than this are skipped, their directories hold a few common files
+constexpr size_t DIR_BUCKET_LIMIT = 256;
+
+/**
+ * Directories grouped by the files under them
+ * Signatures are aggregated bottom-up from hashes of files: sums of two mixes of file hashes are an order
+ * independent multiset hash for exact copies, and per slot minimums of mixed hashes are a MinHash whose equal
+ * slots estimate Jaccard similarity of file sets. A directory with no files of its own and one sub directory only
+ * wraps it and is not grouped. A group whose members sit in copies of one duplicated directory is implied by it
+ * and not reported, files under duplicated directories are covered.
+ */
+class DirGroups {
+public:
+    static constexpr uint32_t DIR_NONE = UINT32_MAX;
+
+    struct exact_group {
+        uint64_t sig;
+        std::vector<uint32_t> dirs;     // sorted by path
+    };
+
+    struct similar_pair {
+        double similarity;              // estimated jaccard similarity of file hashes
+        uint32_t a;
+        uint32_t b;
+    };
+
+    // similarity is min jaccard of similar pairs, 0 finds exact groups only
+    explicit DirGroups(double similarity=0): similarity(similarity) {}
+    DirGroups(const DirGroups& other) = delete;
+
+    // add file hash under its path, files are numbered in order of adding
+    void add(uint64_t hv, const char *path);
+    // add file that failed to hash under its path, its name stands for its hash so that its directory only matches
+    // copies with the same failed file, it is not numbered
+    void add_failed(const char *path);
+
+    // directories num
+    size_t size() const {
+        return nodes.size();
+    }
+
+    // aggregate signatures and find groups, once all files are added
+    void build();
+
+    // exact groups, larger directories first
+    const std::vector<exact_group>& exact() const {
+        return groups;
+    }
+
+    // pairs of similar directories, more similar first
+    const std::vector<similar_pair>& similar() const {
+        return pairs;
+    }
+
+    const std::string& path(uint32_t dir) const {
+        return *paths[dir];
+    }
+
+    uint32_t files(uint32_t dir) const {
+        return nodes[dir].files;
+    }
+
+    // file of index is under a duplicated directory
+    bool covered(size_t file) const {
+        return owner(file) != DIR_NONE;
+    }
+
+    // exact group of the duplicated directory a file of index is under, DIR_NONE if it is not covered
+    uint32_t owner(size_t file) const {
+        return nodes[file_dirs[file]].owner;
+    }
+
+private:
+
+    struct node {
+        uint64_t sum[2] = {0, 0};
+        uint32_t parent = DIR_NONE;
+        uint32_t depth = 0;
+        uint32_t children = 0;      // sub directories
+        uint32_t direct = 0;        // files of its own
+        uint32_t files = 0;         // files under it
+        uint32_t group = DIR_NONE;  // exact group of raw runs
+        uint32_t owner = DIR_NONE;  // exact group of nearest grouped ancestor or itself
+    };
+
+    uint32_t node_of(const std::string& dir);
+    // fold file hash into signatures of directory n
+    void aggregate(uint32_t n, uint64_t hv);
+    bool wrapper(uint32_t n) const {
+        return nodes[n].direct == 0 && nodes[n].children == 1;
+    }
+    bool ancestor(uint32_t a, uint32_t b) const;
+    void find_exact();
+    void find_similar();
+
+    double similarity;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<const std::string *> paths;
+    std::vector<node> nodes;
+    std::vector<uint32_t> minhash;
+    std::vector<uint32_t> file_dirs;
+    std::vector<exact_group> groups;
+    std::vector<similar_pair> pairs;
+};
+
+}
+
+#endif //VHASH_INTERNAL_INDEX_H
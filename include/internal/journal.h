@@ -0,0 +1,85 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VHASH_INTERNAL_JOURNAL_H
+#define VHASH_INTERNAL_JOURNAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace vhash {
+
+// hashes of journal are taken in dihedral mode
+constexpr uint32_t JOURNAL_DIHEDRAL = 1;
+
+struct journal_entry {
+    uint64_t hash;      // hash value
+    uint64_t size;      // file size
+    int64_t mtime;      // file modification time in seconds
+};
+
+/**
+ * Append-only journal of hashed files
+ * A header line of the mode hashes are taken in, then one line of hash, size, mtime and path per file. Lines are
+ * buffered and written and synced to disk by a flusher thread at least once per sync interval, whether appending
+ * goes on or not, a torn line left by a crash is cut off when the journal is resumed.
+ * A journal of another mode is not resumed, its hashes would not match. A journal without header is of mode 0.
+ * Appending is safe from one thread at a time, finding is safe once the journal is opened.
+ */
+class Journal {
+public:
+    // existing entries are loaded if resume is true, otherwise journal is truncated
+    Journal(const std::string& file_path, bool resume, uint32_t mode=0);
+    Journal(const Journal& other) = delete;
+    ~Journal();
+
+    bool is_open() const;
+    // entries loaded from existing journal
+    size_t size() const;
+    // mode of journal file, it differs from the given mode if resuming is refused
+    uint32_t mode() const;
+    // find entry of path, it is valid only if size and mtime are unchanged
+    bool find(const std::string& path, uint64_t size, int64_t mtime, uint64_t& hash) const;
+    int append(uint64_t hash, uint64_t size, int64_t mtime, const std::string& path);
+    // write and sync buffered lines
+    int close();
+
+private:
+    int load();
+    // write and sync buffered lines each interval or once buffer is full, until stop
+    void run();
+
+    std::string file_path;
+    int fd;
+    int error;
+    uint32_t file_mode;
+    std::string buffer;     // lines not written yet
+    std::string writing;    // lines being written by flusher
+    bool stop;
+    mutable std::mutex lock;
+    std::condition_variable cond;
+    std::thread th;
+    std::unordered_map<std::string, journal_entry> entries;
+};
+
+}
+
+#endif //VHASH_INTERNAL_JOURNAL_H
@@ -0,0 +1,154 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VHASH_INTERNAL_PIPELINE_H
+#define VHASH_INTERNAL_PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "internal/util.h"
+
+namespace vhash {
+
+/**
+ * Stage metrics
+ */
+struct stage_metrics {
+    std::string name;           // stage name
+    int workers;                // worker threads num
+    size_t capacity;            // input queue capacity
+    size_t peak_depth;          // peak input queue depth
+    double avg_depth;           // input queue depth averaged over pushes
+    int64_t processed;          // items processed
+    double busy_seconds;        // time spent in stage function by all workers
+};
+
+/**
+ * Pipeline of stages
+ * Each stage owns its worker threads and a bounded input queue. A stage function returns the index
+ * of the next stage of the item, stages can be skipped but items only move forward. Returning an
+ * index out of range finishes the item.
+ */
+template<typename T>
+class Pipeline {
+public:
+    using stage_fn = std::function<size_t(T& item)>;
+
+    Pipeline() = default;
+    Pipeline(const Pipeline& other) = delete;
+    ~Pipeline() {
+        finish();
+    }
+
+    // add a stage before start, queue size is 2 * workers if zero
+    size_t add_stage(const std::string& name, int workers, size_t queue_size, stage_fn fn) {
+        if (workers <= 0) workers = 1;
+        if (queue_size == 0) queue_size = 2 * workers;
+        stages.emplace_back(new stage(name, workers, queue_size, std::move(fn)));
+        return stages.size() - 1;
+    }
+
+    void start() {
+        for (size_t i = 0; i < stages.size(); i++) {
+            auto& st = *stages[i];
+            for (int j = 0; j < st.workers; j++) {
+                st.threads.emplace_back([this, i] {
+                    run(i);
+                });
+            }
+        }
+        running = true;
+    }
+
+    // push an item into the first stage, block while its queue is full
+    bool push(T item) {
+        if (!running || stages.empty())
+            return false;
+        return stages[0]->queue.push(std::move(item));
+    }
+
+    // no more items, wait all stages drained
+    void finish() {
+        if (!running)
+            return;
+        // items only move forward, so closing stages in order drains the pipeline
+        for (auto& st : stages) {
+            st->queue.close();
+            for (auto& th : st->threads) {
+                if (th.joinable())
+                    th.join();
+            }
+        }
+        running = false;
+    }
+
+    // current input queue depth of stage
+    size_t depth(size_t index) const {
+        return stages[index]->queue.size();
+    }
+
+    std::vector<stage_metrics> metrics() const {
+        std::vector<stage_metrics> v;
+        for (auto& st : stages) {
+            v.emplace_back(stage_metrics{
+                st->name, st->workers, st->queue.capacity(), st->queue.peak_size(), st->queue.average_size(),
+                st->processed.load(), static_cast<double>(st->busy_ns.load()) / 1e9,
+            });
+        }
+        return v;
+    }
+
+private:
+    struct stage {
+        stage(std::string name, int workers, size_t queue_size, stage_fn fn):
+            name(std::move(name)), workers(workers), queue(queue_size), fn(std::move(fn)) {}
+
+        std::string name;                   // stage name
+        int workers;                        // worker threads num
+        BlockingQueue<T> queue;             // input queue
+        stage_fn fn;                        // stage function
+        std::vector<std::thread> threads;   // worker threads
+        std::atomic<int64_t> processed{0};  // items processed
+        std::atomic<int64_t> busy_ns{0};    // time spent in stage function
+    };
+
+    void run(size_t index) {
+        auto& st = *stages[index];
+        T item;
+        while (st.queue.pop(item)) {
+            auto start = std::chrono::steady_clock::now();
+            size_t next = st.fn(item);
+            auto end = std::chrono::steady_clock::now();
+            st.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            st.processed++;
+
+            if (next > index && next < stages.size())
+                stages[next]->queue.push(std::move(item));
+        }
+    }
+
+    std::vector<std::unique_ptr<stage>> stages;
+    bool running = false;
+};
+
+}
+
+#endif //VHASH_INTERNAL_PIPELINE_H
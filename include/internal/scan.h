@@ -18,6 +18,7 @@
 #define VHASH_INTERNAL_SCAN_H
 
 #include <string>
+#include <functional>
 #include <tuple>
 #include <unordered_set>
 #include <thread>
@@ -31,6 +32,7 @@
 namespace vhash {
 
 using file_filter_t = std::function<bool(const char *parent, const char *file)>;
+using file_stat_filter_t = std::function<bool(const char *parent, const char *file, const struct stat& st)>;
 using pairs_t = std::vector<std::tuple<std::string, std::string>>;
 using set_t = std::unordered_set<std::string>;
 
@@ -45,6 +47,7 @@ public:
     ~scanner();
 
     pairs_t for_each(const file_filter_t& filter, bool include_subdir=true);
+    pairs_t for_each_stat(const file_stat_filter_t& filter, bool include_subdir=true);
 
     void for_each_bg(const file_filter_t& filter, bool include_subdir=true);
     void block_wait();
@@ -56,6 +59,28 @@ private:
     bool run_background;
 };
 
+/**
+ * File identity, paths with same device and inode share the same content
+ */
+struct file_id {
+    uint64_t dev;
+    uint64_t ino;
+
+    bool operator==(const file_id& other) const noexcept {
+        return dev == other.dev && ino == other.ino;
+    }
+};
+
+struct file_id_hash {
+    size_t operator()(const file_id& id) const noexcept {
+        return std::hash<uint64_t>()(id.ino ^ (id.dev * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+inline file_id scanner_file_id(const struct stat& st) {
+    return file_id{static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino)};
+}
+
 // Windows
 #ifdef _WIN32
 #include <windows.h>
@@ -0,0 +1,399 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#ifndef VHASH_INTERNAL_STORE_H
+#define VHASH_INTERNAL_STORE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "internal/index.h"
+
+namespace vhash {
+
+/**
+ * Segment file of persistent hash index
+ * Records are sorted by hash and path, each unique hash has a posting list of its records. Record ids sorted by
+ * path find the record of a path by binary search. The file is mapped and searched without parsing.
+ * A delta segment holds the files added, changed or removed since the segments before it, removed files are
+ * records flagged STORE_REMOVED. A base segment also has substring tables of its unique hashes for queries, each
+ * table is 2^bits + 2 bucket offsets, the last one padding, and unique hashes by bucket, so candidates of a bucket
+ * are verified from contiguous memory. Integers are stored in the byte order of the writer, segments whose byte
+ * order marker does not read back as STORE_BYTE_ORDER are refused.
+ */
+constexpr char STORE_MAGIC[8] = {'V', 'H', 'A', 'S', 'H', 'I', 'D', 'X'};
+constexpr uint32_t STORE_VERSION = 1;
+constexpr uint64_t STORE_BYTE_ORDER = 0x0102030405060708ULL;
+constexpr uint32_t STORE_REMOVED = 1;
+// hash of record is of the canonical variant of flips and rotations
+constexpr uint32_t STORE_DIHEDRAL = 2;
+
+struct store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t seq;               // sequence of newest delta merged into segment
+    uint64_t count;             // records num
+    uint64_t unique;            // unique hashes num
+    uint64_t records_offset;    // records sorted by hash and path
+    uint64_t hashes_offset;     // unique hashes sorted
+    uint64_t postings_offset;   // unique + 1 offsets of first record of each hash
+    uint64_t paths_offset;      // 32-bit record ids sorted by path, after tables
+    uint64_t strings_offset;    // string table of NUL terminated paths
+    uint64_t strings_size;      // bytes of string table
+    uint64_t tables_offset;     // substring tables, after postings
+    uint64_t tables_num;        // substring tables num, 0 if segment has no tables
+    uint64_t byte_order;        // STORE_BYTE_ORDER in native order of writer
+    uint64_t reserved[2];
+};
+
+struct store_record {
+    uint64_t hash;      // hash value
+    uint64_t size;      // file size
+    int64_t mtime;      // file modification time in seconds
+    uint64_t path;      // path offset in string table
+    uint32_t flags;     // STORE_REMOVED
+    uint32_t reserved;
+};
+
+static_assert(sizeof(store_header) == 128, "index segment header should be 128 bytes");
+static_assert(sizeof(store_record) == 40, "index segment record should be 40 bytes");
+
+// hamming radius substring tables of a base segment are laid out for
+constexpr int STORE_QUERY_RADIUS = 4;
+// a candidate probed from substring tables costs about as much as scanning this many hashes
+constexpr double STORE_SCAN_RATIO = 64;
+
+// substring tables num of a segment of unique hashes, tables are small enough to be addressed directly
+inline int store_tables_num(uint64_t unique) {
+    auto direct = [unique](int m) {
+        int bits = 64 / m + (64 % m ? 1 : 0);
+        return bits <= MIH_DIRECT_BITS && (1ULL << bits) <= 4 * std::max<uint64_t>(unique, 1);
+    };
+    int m = MIHIndex::choose_substrings(static_cast<size_t>(unique), STORE_QUERY_RADIUS);
+    while (m < 64 && !direct(m))
+        m++;
+    return m;
+}
+
+// bits of t-th of m substring tables, the first 64 % m substrings take one more bit
+inline int store_table_bits(int m, int t) {
+    return 64 / m + (t < 64 % m ? 1 : 0);
+}
+
+// bytes of substring tables of a segment
+inline uint64_t store_tables_size(int m, uint64_t unique) {
+    uint64_t size = 0;
+    for (int t = 0; t < m; t++)
+        size += ((1ULL << store_table_bits(m, t)) + 2) * sizeof(uint32_t) + unique * sizeof(uint64_t);
+    return size;
+}
+
+/**
+ * Index segment writer
+ * Records must be appended in hash and path order. Records go to the segment as they come, unique hashes, postings
+ * and paths go to temporary files named after the segment with .tmp suffix, they are appended on close. Substring tables are built on close if asked for.
+ */
+class IndexSegmentWriter {
+public:
+    IndexSegmentWriter(const std::string& file_path, uint64_t seq, bool tables=false);
+    IndexSegmentWriter(const IndexSegmentWriter& other) = delete;
+    ~IndexSegmentWriter();
+
+    bool is_open() const;
+    int append(uint64_t hash, uint64_t size, int64_t mtime, const char *path, uint32_t flags);
+    // write sections and header, sync to disk
+    int close();
+
+private:
+    struct spill;
+
+    int flush();
+    int write_tables(uint64_t tables_num);
+
+    std::string file_path;
+    int fd;
+    std::unique_ptr<spill> hashes;
+    std::unique_ptr<spill> postings;
+    std::unique_ptr<spill> strings;
+    std::string records;
+    uint64_t seq;
+    uint64_t count;
+    uint64_t unique;
+    uint64_t last_hash;
+    bool tables;
+    int error;
+};
+
+/**
+ * Index segment reader
+ * The file is mapped read only, records and paths are valid while the segment is alive.
+ */
+class IndexSegment {
+public:
+    explicit IndexSegment(const std::string& file_path);
+    IndexSegment(const IndexSegment& other) = delete;
+    ~IndexSegment();
+
+    bool is_open() const;
+    uint64_t seq() const { return header ? header->seq : 0; }
+    uint64_t size() const { return count; }
+    uint64_t unique() const { return unique_num; }
+
+    const store_record& operator[](size_t index) const {
+        return records[index];
+    }
+
+    uint64_t hash(size_t u) const {
+        return hashes[u];
+    }
+
+    // records of u-th unique hash
+    const store_record *postings_begin(size_t u) const {
+        return records + postings[u];
+    }
+
+    const store_record *postings_end(size_t u) const {
+        return records + postings[u + 1];
+    }
+
+    // empty if offset is out of string table
+    const char *path(const store_record& record) const {
+        return record.path < strings_size ? strings + record.path : "";
+    }
+
+    // record of path, nullptr if not found
+    const store_record *find(const char *path) const;
+    // read unique hashes and substring tables ahead, queries touch them at random
+    void prefetch() const;
+
+    int tables_num() const {
+        return static_cast<int>(tables.size());
+    }
+
+    // estimated cost of a radius search by substring tables is below a scan of unique hashes
+    bool probes_cheaper(int r) const;
+
+    // call f(u, distance) for each unique hash within radius r of hv
+    template<typename F>
+    void radius(uint64_t hv, int r, F f) const {
+        if (unique_num == 0 || r < 0)
+            return;
+        if (!probes_cheaper(r)) {
+            scan(hv, r, f);
+            return;
+        }
+        int sub_r = r / static_cast<int>(tables.size());
+        for (size_t t = 0; t < tables.size(); t++) {
+            const table& tb = tables[t];
+            auto candidate = [&](uint64_t h) {
+                uint64_t x = hv ^ h;
+                // a hash is found once, by the first table whose substring is near enough
+                for (size_t p = 0; p < t; p++) {
+                    if (__builtin_popcountll((x >> tables[p].shift) & tables[p].mask) <= sub_r)
+                        return;
+                }
+                int d = __builtin_popcountll(x);
+                if (d <= r)
+                    f(static_cast<uint64_t>(std::lower_bound(hashes, hashes + unique_num, h) - hashes), d);
+            };
+            probe(tb, (hv >> tb.shift) & tb.mask, 0, sub_r, candidate);
+        }
+    }
+
+    // call f(u, distance) for each unique hash within radius r of hv by comparing all of them,
+    // f may lower r to narrow the rest of the scan
+    template<typename F>
+    void scan(uint64_t hv, const int& r, F f) const {
+        uint32_t ids[JOIN_BLOCK_SIZE];
+        for (uint64_t i = 0; i < unique_num && r >= 0; i += JOIN_BLOCK_SIZE) {
+            auto len = static_cast<size_t>(std::min<uint64_t>(JOIN_BLOCK_SIZE, unique_num - i));
+            size_t n = join_match(hv, hashes + i, len, r, ids);
+            for (size_t j = 0; j < n; j++)
+                f(i + ids[j], hamming_distance(hv, hashes[i + ids[j]]));
+        }
+    }
+
+private:
+    struct table {
+        int shift;
+        int bits;
+        uint64_t mask;
+        const uint32_t *offsets;    // 2^bits + 1 bucket offsets
+        const uint64_t *hashes;     // unique hashes by bucket
+    };
+
+    // visit keys within sub_r of key by flipping bits from bit upward
+    template<typename F>
+    void probe(const table& tb, uint64_t key, int bit, int sub_r, F& f) const {
+        for (uint32_t i = tb.offsets[key]; i < tb.offsets[key + 1]; i++)
+            f(tb.hashes[i]);
+        if (sub_r == 0)
+            return;
+        for (int b = bit; b < tb.bits; b++)
+            probe(tb, key ^ (1ULL << b), b + 1, sub_r - 1, f);
+    }
+
+    void *data;
+    size_t length;
+    const store_header *header;
+    const store_record *records;
+    const uint64_t *hashes;
+    const uint64_t *postings;
+    const uint32_t *paths;
+    const char *strings;
+    uint64_t strings_size;
+    uint64_t count;
+    uint64_t unique_num;
+    std::vector<table> tables;
+};
+
+/**
+ * Record of a file to be added to or removed from index
+ */
+struct store_entry {
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime;
+    std::string path;
+    uint32_t flags;
+};
+
+/**
+ * Live record matched by a query, valid while the store is open
+ */
+struct store_match {
+    const char *path;
+    const store_record *record;
+    int distance;
+};
+
+// delta segments merged in the background once there are this many
+constexpr size_t STORE_MAX_DELTAS = 4;
+// delta segments merged once their records reach this fraction of base records
+constexpr uint64_t STORE_DELTA_RATIO = 8;
+
+/**
+ * Persistent hash index in a directory, a base segment and delta segments newer than it
+ * Newer segments override records of a path in older ones. Position of a record is its index among the records
+ * of all segments, base first. The directory is locked while the store is open, unless it is opened read only
+ * for queries, which neither lock nor modify it.
+ */
+class IndexStore {
+public:
+    explicit IndexStore(const std::string& dir_path, bool read_only=false);
+    IndexStore(const IndexStore& other) = delete;
+    ~IndexStore();
+
+    bool is_open() const;
+    // records num of all segments
+    uint64_t size() const;
+
+    // newest record of path and its position, nullptr if not found or removed
+    const store_record *find(const char *path, uint64_t *pos=nullptr) const;
+
+    // f(pos, path, record) for each record not removed and not overridden by a newer segment
+    template<typename F>
+    void for_each_live(F f) const {
+        uint64_t pos = 0;
+        for (size_t s = 0; s < segments.size(); s++) {
+            const IndexSegment& seg = *segments[s];
+            for (size_t i = 0; i < seg.size(); i++, pos++) {
+                const char *path = seg.path(seg[i]);
+                if (!(seg[i].flags & STORE_REMOVED) && live(s, path))
+                    f(pos, path, seg[i]);
+            }
+        }
+    }
+
+    // f(hash, paths) for each hash of live records in hash order, paths are sorted
+    template<typename F>
+    void for_each_group(F f) const {
+        std::vector<size_t> next(segments.size(), 0);
+        std::vector<const char *> paths;
+        while (true) {
+            bool found = false;
+            uint64_t hv = 0;
+            for (size_t s = 0; s < segments.size(); s++) {
+                if (next[s] < segments[s]->unique() && (!found || segments[s]->hash(next[s]) < hv)) {
+                    hv = segments[s]->hash(next[s]);
+                    found = true;
+                }
+            }
+            if (!found)
+                break;
+            paths.clear();
+            for (size_t s = 0; s < segments.size(); s++) {
+                const IndexSegment& seg = *segments[s];
+                if (next[s] >= seg.unique() || seg.hash(next[s]) != hv)
+                    continue;
+                for (auto r = seg.postings_begin(next[s]); r != seg.postings_end(next[s]); r++) {
+                    if (!(r->flags & STORE_REMOVED) && live(s, seg.path(*r)))
+                        paths.push_back(seg.path(*r));
+                }
+                next[s]++;
+            }
+            if (!paths.empty()) {
+                std::sort(paths.begin(), paths.end(), [](const char *a, const char *b) {
+                    return strcmp(a, b) < 0;
+                });
+                f(hv, paths);
+            }
+        }
+    }
+
+    // live records within radius r of hv, sorted by distance and path, records of the other dihedral mode than
+    // mode are skipped
+    void radius(uint64_t hv, int r, std::vector<store_match>& out, uint32_t mode=0) const;
+    // k nearest live records within radius r of hv, sorted by distance and path, mode as of radius
+    void nearest(uint64_t hv, size_t k, int r, std::vector<store_match>& out, uint32_t mode=0) const;
+
+    // write entries as a new delta segment and open it, entries are sorted in place
+    int append(std::vector<store_entry>& entries);
+    bool needs_compaction() const;
+    // merge all segments into a new base and remove merged deltas, readers of this store are not disturbed
+    int compact() const;
+
+private:
+    // open base and deltas, false if a segment is missing or broken
+    bool load();
+    // path is not in any segment newer than s
+    bool live(size_t s, const char *path) const;
+    // append live records of u-th unique hash of s-th segment hashed in dihedral mode of mode
+    void collect(size_t s, uint64_t u, int distance, uint32_t mode, std::vector<store_match>& out) const;
+    std::string segment_path(uint64_t seq) const;
+
+    std::string dir_path;
+    int lock_fd;
+    bool read_only;
+    bool opened;
+    bool has_base;      // first segment is base
+    std::vector<std::unique_ptr<IndexSegment>> segments;
+    uint64_t last_seq;
+};
+
+// directory holds an index store, its lock file is created when the store is first opened
+bool store_check(const std::string& dir_path);
+// remove lock file and segments of an index store, then its directory if nothing else is left
+int store_remove(const std::string& dir_path);
+
+}
+
+#endif //VHASH_INTERNAL_STORE_H
@@ -23,13 +23,23 @@
 #include <vector>
 #include <exception>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <cstddef>
 #include <atomic>
 #include <future>
 #include <condition_variable>
 #include <thread>
 #include <functional>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unistd.h>
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -67,6 +77,18 @@ private:
     bool error;
 };
 
+// hint kernel to read ahead the first length bytes of file
+int file_prefetch(const std::string& file_path, size_t length);
+
+// open output file for writing, empty path is stdout, return fd or error
+int file_open_output(const std::string& file_path);
+
+// write all data to fd, retry on partial writes and interrupts
+int file_write_all(int fd, const char *data, size_t length);
+
+// read image dimensions from PNG, JPEG, GIF, BMP or WEBP header without decoding
+int image_probe(const std::vector<uint8_t>& data, int& rows, int& cols);
+
 /**
  * File writer
  * Write to stdout if file_path is empty
@@ -158,25 +180,68 @@ private:
     size_t size;
 };
 
+/**
+ * Thread budget
+ * Allowed CPUs are split between pipeline workers and threads inside each decode (OpenCV parallel
+ * loops and FFmpeg codec threads), so runnable threads match the CPUs. Hash workers take one CPU each
+ * and decode workers share the rest with their inner threads. FFTW plans run in the calling thread,
+ * and meta and read workers mostly wait on disk, so neither takes a share.
+ */
+struct thread_budget {
+    int cpus = 1;           // allowed cpus
+    int decode_jobs = 1;    // decode workers
+    int hash_jobs = 1;      // hash workers
+    int inner_threads = 1;  // threads inside each decode
+};
+
+// allowed cpus from affinity mask and cgroup v1/v2 cpu quota, at least 1
+int thread_budget_cpus();
+
+// split cpus between workers and inner threads, positive decode_jobs and hash_jobs are kept
+thread_budget thread_budget_make(int cpus, int decode_jobs=0, int hash_jobs=0);
+
+// set OpenCV and FFmpeg threads
+void thread_budget_apply(const thread_budget& budget);
+
 /**
  * Thread pool
+ * Work stealing pool, each worker owns a Chase-Lev deque. Tasks submitted by workers go to their own
+ * deque, tasks submitted by other threads go to a shared injection queue. Idle workers steal from
+ * the top of other deques. Callables up to THREADPOOL_TASK_STORAGE bytes are stored inline in
+ * recycled task nodes, so submitting does not allocate.
  */
 #ifndef THREADPOOL_MAX_NUM
 #define THREADPOOL_MAX_NUM  256
 #endif
 
+#ifndef THREADPOOL_TASK_STORAGE
+#define THREADPOOL_TASK_STORAGE  48
+#endif
+
+#ifndef THREADPOOL_TASK_NODES
+#define THREADPOOL_TASK_NODES  1024     // recycled task nodes per thread
+#endif
+
 class ThreadPool {
 public:
-    using Task = std::function<void()>;     // task type
-
     explicit ThreadPool(size_t size=0) {
-        if (size == 0) size = std::thread::hardware_concurrency();
-        if (size == 0) size = 8;
+        if (size == 0) size = thread_budget_cpus();
+        if (size > THREADPOOL_MAX_NUM) size = THREADPOOL_MAX_NUM;
+        node_num = static_cast<uint32_t>(size * THREADPOOL_TASK_NODES);
+        nodes.reset(new TaskNode[node_num]);
+        for (uint32_t i = 0; i < node_num; i++) {
+            nodes[i].index = i;
+            nodes[i].next.store(i + 1 < node_num ? i + 1 : NIL, std::memory_order_relaxed);
+        }
+        free_head.store(0, std::memory_order_relaxed);
         add_threads(size);
     }
 
     ~ThreadPool() {
-        is_run = false;
+        {
+            std::lock_guard<std::mutex> lock_gd{lock};
+            is_run = false;
+        }
         cond.notify_all();
         for (std::thread& thread: pool) {
             if (thread.joinable())
@@ -188,30 +253,43 @@ public:
     // call .get() to wait and get return value
     template<class F, class... Args>
     auto commit(F&& f, Args&& ... args) -> std::future<decltype(f(args...))> {
-        if (!is_run)
-            throw std::runtime_error("commit on a stopped thread pool");
-
         // bind function and arguments
         using rtn_type = decltype(f(args...));
-        auto task = std::make_shared<std::packaged_task<rtn_type()>> (
-                std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
+        std::packaged_task<rtn_type()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
         // generate future
-        std::future<rtn_type> future = task->get_future();
-        {
-            std::lock_guard<std::mutex> lock_gd{lock};
-            // add task to queue
-            tasks.emplace([task]() {
-                (*task)();
-            });
-        }
-
-        // notify one thread
-        cond.notify_one();
+        std::future<rtn_type> future = task.get_future();
+        post(std::move(task));
         return future;
     }
 
+    // post a task without return value
+    template<class F>
+    void post(F&& f) {
+        if (!is_run && worker_pool() != this)
+            throw std::runtime_error("commit on a stopped thread pool");
+        TaskNode *node = alloc_node();
+        node->set(std::forward<F>(f));
+        push_nodes(&node, 1);
+    }
+
+    // post tasks in batch, make(i) returns i-th task
+    template<class F>
+    void post_batch(size_t n, F make) {
+        if (!is_run && worker_pool() != this)
+            throw std::runtime_error("commit on a stopped thread pool");
+        TaskNode *batch[64];
+        for (size_t start = 0; start < n; ) {
+            size_t m = std::min(n - start, sizeof(batch) / sizeof(batch[0]));
+            for (size_t i = 0; i < m; i++) {
+                batch[i] = alloc_node();
+                batch[i]->set(make(start + i));
+            }
+            push_nodes(batch, m);
+            start += m;
+        }
+    }
+
     // idle threads num
     int idle_count() const { return idle_num.load(); }
 
@@ -219,43 +297,829 @@ public:
     int pool_size() const { return static_cast<int>(pool.size()); }
 
 private:
-    void add_threads(unsigned short size) {
-        for (; pool.size() < THREADPOOL_MAX_NUM && size > 0; --size) {
+    static constexpr uint32_t NIL = 0xffffffff;
+
+    /**
+     * Task node with inline storage of callable, 64 bytes with default storage size
+     */
+    struct TaskNode {
+        using invoke_t = void (*)(TaskNode *node);
+
+        template<class F>
+        void set(F&& f) {
+            using Fn = typename std::decay<F>::type;
+            set_internal<Fn>(std::forward<F>(f), std::integral_constant<bool,
+                    sizeof(Fn) <= sizeof(storage) && alignof(Fn) <= alignof(std::max_align_t)>());
+        }
+
+        template<class Fn, class F>
+        void set_internal(F&& f, std::true_type) {
+            new (storage) Fn(std::forward<F>(f));
+            invoke = [](TaskNode *node) {
+                Fn *fn = reinterpret_cast<Fn*>(node->storage);
+                (*fn)();
+                fn->~Fn();
+            };
+        }
+
+        template<class Fn, class F>
+        void set_internal(F&& f, std::false_type) {
+            // too large to be stored inline
+            *reinterpret_cast<Fn**>(storage) = new Fn(std::forward<F>(f));
+            invoke = [](TaskNode *node) {
+                std::unique_ptr<Fn> fn(*reinterpret_cast<Fn**>(node->storage));
+                (*fn)();
+            };
+        }
+
+        alignas(std::max_align_t) unsigned char storage[THREADPOOL_TASK_STORAGE];
+        invoke_t invoke = nullptr;
+        std::atomic<uint32_t> next{NIL};    // next free node
+        uint32_t index = NIL;               // index in node array, NIL if allocated from heap
+    };
+
+    /**
+     * Chase-Lev deque, owner pushes and pops at bottom, thieves steal at top
+     * Implementation follows "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013)
+     */
+    class TaskDeque {
+    public:
+        TaskDeque(): array(new Array(256)) {}
+        ~TaskDeque() { delete array.load(std::memory_order_relaxed); }
+
+        // owner only
+        void push(TaskNode *node) {
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            int64_t t = top.load(std::memory_order_acquire);
+            Array *a = array.load(std::memory_order_relaxed);
+            if (b - t > a->capacity - 1) {
+                Array *bigger = a->grow(b, t);
+                retired.emplace_back(a);    // thieves may still read old array
+                array.store(bigger, std::memory_order_release);
+                a = bigger;
+            }
+            a->put(b, node);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // owner only
+        TaskNode *pop() {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Array *a = array.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_relaxed);
+            if (t > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            TaskNode *node = a->get(b);
+            if (t == b) {
+                // last item, race with thieves
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    node = nullptr;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return node;
+        }
+
+        // any thread
+        TaskNode *steal() {
+            int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b)
+                return nullptr;
+            Array *a = array.load(std::memory_order_acquire);
+            TaskNode *node = a->get(t);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;
+            return node;
+        }
+
+    private:
+        struct Array {
+            explicit Array(int64_t capacity): capacity(capacity), mask(capacity - 1),
+                                              items(new std::atomic<TaskNode*>[capacity]) {}
+
+            TaskNode *get(int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+            void put(int64_t i, TaskNode *node) { items[i & mask].store(node, std::memory_order_relaxed); }
+
+            Array *grow(int64_t b, int64_t t) const {
+                auto *a = new Array(capacity * 2);
+                for (int64_t i = t; i < b; i++)
+                    a->put(i, get(i));
+                return a;
+            }
+
+            int64_t capacity;
+            int64_t mask;
+            std::unique_ptr<std::atomic<TaskNode*>[]> items;
+        };
+
+        std::atomic<int64_t> top{0};
+        char pad[64];   // keep top and bottom in different cache lines
+        std::atomic<int64_t> bottom{0};
+        std::atomic<Array*> array;
+        std::vector<std::unique_ptr<Array>> retired;
+    };
+
+    // pop a node from free list, tag in high 32 bits avoids ABA
+    TaskNode *alloc_node() {
+        uint64_t head = free_head.load(std::memory_order_acquire);
+        while (static_cast<uint32_t>(head) != NIL) {
+            TaskNode *node = &nodes[static_cast<uint32_t>(head)];
+            uint64_t next = ((head >> 32) + 1) << 32 | node->next.load(std::memory_order_relaxed);
+            if (free_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+                return node;
+        }
+        return new TaskNode();  // all nodes are in use
+    }
+
+    void free_node(TaskNode *node) {
+        if (node->index == NIL) {
+            delete node;
+            return;
+        }
+        uint64_t head = free_head.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            node->next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | node->index;
+        } while (!free_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void push_nodes(TaskNode **batch, size_t n) {
+        if (worker_pool() == this) {
+            for (size_t i = 0; i < n; i++)
+                deques[worker_index()]->push(batch[i]);
+        } else {
+            std::lock_guard<std::mutex> lock_gd{inject_lock};
+            for (size_t i = 0; i < n; i++)
+                injected.push_back(batch[i]);
+        }
+
+        queued.fetch_add(static_cast<int64_t>(n));
+        if (sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock_gd{lock};
+            if (n > 1)
+                cond.notify_all();
+            else
+                cond.notify_one();
+        }
+    }
+
+    TaskNode *find_task(size_t index) {
+        TaskNode *node = deques[index]->pop();
+        if (!node && queued.load(std::memory_order_relaxed) > 0) {
+            {
+                std::lock_guard<std::mutex> lock_gd{inject_lock};
+                if (!injected.empty()) {
+                    node = injected.front();
+                    injected.pop_front();
+                }
+            }
+            // steal from other workers, start from the next one
+            for (size_t i = 1; !node && i < deques.size(); i++) {
+                node = deques[(index + i) % deques.size()]->steal();
+            }
+        }
+        if (node)
+            queued--;
+        return node;
+    }
+
+    void run_task(TaskNode *node) {
+        idle_num--;
+        node->invoke(node);
+        idle_num++;
+        free_node(node);
+    }
+
+    static ThreadPool *&worker_pool() {
+        static thread_local ThreadPool *p = nullptr;
+        return p;
+    }
+
+    static size_t& worker_index() {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    void add_threads(size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            deques.emplace_back(new TaskDeque());
+        }
+        for (size_t index = 0; index < size; index++) {
             // thread routine
-            pool.emplace_back([this] {
-                while (is_run.load()) {
-                    Task task;
-                    {
-                        std::unique_lock <std::mutex> uni_lock{lock};
-                        // wait new task
-                        cond.wait(uni_lock, [this] {
-                            return !is_run.load() || !tasks.empty();
-                        });
-                        if (!is_run.load() && tasks.empty())
-                            return;
-                        // pop a task
-                        task = move(tasks.front());
-                        tasks.pop();
+            pool.emplace_back([this, index] {
+                worker_pool() = this;
+                worker_index() = index;
+                while (true) {
+                    TaskNode *node = find_task(index);
+                    for (int spin = 0; !node && spin < 64; spin++) {
+                        std::this_thread::yield();
+                        node = find_task(index);
+                    }
+                    if (node) {
+                        run_task(node);
+                        continue;
                     }
 
-                    // run task
-                    idle_num--;
-                    task();
-                    idle_num++;
+                    // wait new task
+                    std::unique_lock<std::mutex> uni_lock{lock};
+                    sleeping++;
+                    cond.wait(uni_lock, [this] {
+                        return !is_run.load() || queued.load() > 0;
+                    });
+                    sleeping--;
+                    if (!is_run.load() && queued.load() == 0)
+                        return;
                 }
             });
             idle_num++;
         }
     }
 
-    std::vector<std::thread> pool;          // thread pool
-    std::queue<Task> tasks;                 // task queue
-    std::mutex lock;                        // lock
-    std::condition_variable cond;           // condition variable
-    std::atomic<bool> is_run{true};      // thread pool is running
-    std::atomic<int> idle_num{0};        // idle threads num
+    std::vector<std::thread> pool;                      // thread pool
+    std::vector<std::unique_ptr<TaskDeque>> deques;     // task deque of each worker
+    std::deque<TaskNode*> injected;                     // tasks from other threads
+    std::mutex inject_lock;                             // lock of injected tasks
+    std::unique_ptr<TaskNode[]> nodes;                  // recycled task nodes
+    uint32_t node_num = 0;                              // task nodes num
+    std::atomic<uint64_t> free_head{NIL};               // free task nodes
+    std::atomic<int64_t> queued{0};                     // tasks not taken yet
+    std::atomic<int> sleeping{0};                       // sleeping threads num
+    std::mutex lock;                                    // lock of sleeping threads
+    std::condition_variable cond;                       // condition variable
+    std::atomic<bool> is_run{true};                     // thread pool is running
+    std::atomic<int> idle_num{0};                       // idle threads num
+};
+
+/**
+ * Latch, wait until counted down to zero
+ */
+class Latch {
+public:
+    explicit Latch(int64_t count): count(count) {}
+    Latch(const Latch& other) = delete;
+
+    void count_down(int64_t n=1) {
+        if (count.fetch_sub(n) - n <= 0) {
+            std::lock_guard<std::mutex> lock_gd{lock};
+            cond.notify_all();
+        }
+    }
+
+    void wait() {
+        if (count.load() <= 0)
+            return;
+        std::unique_lock<std::mutex> uni_lock{lock};
+        cond.wait(uni_lock, [this] {
+            return count.load() <= 0;
+        });
+    }
+
+private:
+    std::atomic<int64_t> count;
+    std::mutex lock;
+    std::condition_variable cond;
+};
+
+/**
+ * Bounded blocking queue
+ * push blocks while the queue is full, pop blocks while the queue is empty
+ */
+template<typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity=1024): cap(capacity == 0 ? 1 : capacity) {}
+    BlockingQueue(const BlockingQueue& other) = delete;
+
+    // return false if queue has been closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> uni_lock{lock};
+        not_full.wait(uni_lock, [this] {
+            return closed || items.size() < cap;
+        });
+        if (closed)
+            return false;
+        items.emplace(std::move(item));
+        peak = std::max(peak, items.size());
+        depth_sum += items.size();
+        pushed++;
+        uni_lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    // return false if queue has been closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> uni_lock{lock};
+        not_empty.wait(uni_lock, [this] {
+            return closed || !items.empty();
+        });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop();
+        uni_lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    // no more items, wake up all waiting threads
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock_gd{lock};
+            closed = true;
+        }
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return items.size();
+    }
+
+    size_t capacity() const { return cap; }
+
+    // peak queue size
+    size_t peak_size() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return peak;
+    }
+
+    // queue size averaged over pushes
+    double average_size() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return pushed == 0 ? 0 : static_cast<double>(depth_sum) / static_cast<double>(pushed);
+    }
+
+private:
+    std::queue<T> items;                    // items
+    size_t cap;                             // max items num
+    size_t peak = 0;                        // peak items num
+    uint64_t depth_sum = 0;                 // sum of items num after each push
+    uint64_t pushed = 0;                    // pushed items num
+    bool closed = false;                    // queue has been closed
+    mutable std::mutex lock;                // lock
+    std::condition_variable not_full;       // wait for space
+    std::condition_variable not_empty;      // wait for items
+};
+
+/**
+ * Memory budget
+ * acquire blocks until the requested bytes fit in the budget. A request larger than the whole
+ * budget is admitted when nothing else is reserved, so it runs alone instead of waiting forever.
+ * Requests are admitted in arrival order, smaller requests arriving later wait behind a large one
+ * instead of keeping it out. Zero limit means unlimited.
+ */
+class MemoryBudget {
+public:
+    explicit MemoryBudget(uint64_t limit=0): max_bytes(limit) {}
+    MemoryBudget(const MemoryBudget& other) = delete;
+
+    void acquire(uint64_t bytes) {
+        std::unique_lock<std::mutex> uni_lock{lock};
+        uint64_t ticket = next_ticket++;
+        if (max_bytes > 0 && (ticket != serving || !fits(bytes))) {
+            wait_num++;
+            cond.wait(uni_lock, [this, ticket, bytes] {
+                return ticket == serving && fits(bytes);
+            });
+        }
+        serving++;
+        used_bytes += bytes;
+        peak_bytes = std::max(peak_bytes, used_bytes);
+        largest_bytes = std::max(largest_bytes, bytes);
+        uni_lock.unlock();
+        // next ticket may fit as well
+        cond.notify_all();
+    }
+
+    void release(uint64_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock_gd{lock};
+            used_bytes -= std::min(bytes, used_bytes);
+        }
+        cond.notify_all();
+    }
+
+    uint64_t limit() const { return max_bytes; }
+
+    uint64_t used() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return used_bytes;
+    }
+
+    // peak reserved bytes
+    uint64_t peak() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return peak_bytes;
+    }
+
+    // largest single request
+    uint64_t largest() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return largest_bytes;
+    }
+
+    // times of acquire waited for budget
+    int64_t waits() const {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        return wait_num;
+    }
+
+private:
+    bool fits(uint64_t bytes) const {
+        return used_bytes == 0 || used_bytes + bytes <= max_bytes;
+    }
+
+    uint64_t max_bytes;
+    uint64_t used_bytes = 0;
+    uint64_t peak_bytes = 0;
+    uint64_t largest_bytes = 0;
+    int64_t wait_num = 0;
+    uint64_t next_ticket = 0;   // ticket of next acquire
+    uint64_t serving = 0;       // ticket admitted next
+    mutable std::mutex lock;
+    std::condition_variable cond;
 };
 
+/**
+ * Decode budget of a single file
+ * Decoders poll the budget of their thread between packets, FFmpeg polls it through interrupt callback while
+ * blocking in demuxing, and both give up once it is spent. Steps bound packets read for one frame.
+ */
+class DecodeBudget {
+public:
+    explicit DecodeBudget(int64_t max_steps=0): max_steps(max_steps) {}
+    DecodeBudget(const DecodeBudget& other) = delete;
+
+    bool expired() const {
+        return flag.load(std::memory_order_relaxed);
+    }
+
+    void expire() {
+        flag.store(true, std::memory_order_relaxed);
+    }
+
+    // check budget after steps of current frame, too many steps expire the budget
+    bool spent(int64_t steps) {
+        if (max_steps > 0 && steps > max_steps)
+            expire();
+        return expired();
+    }
+
+    // budget of calling thread, null if file is decoded without budget
+    static DecodeBudget *current();
+
+private:
+    friend class DecodeScope;
+    static void set_current(DecodeBudget *budget);
+
+    std::atomic<bool> flag{false};
+    int64_t max_steps;
+};
+
+/**
+ * Watchdog of decode budgets
+ * A thread expires watched budgets once they pass the deadline. Zero timeout disables the watchdog.
+ */
+class Watchdog {
+public:
+    explicit Watchdog(double timeout=0);
+    Watchdog(const Watchdog& other) = delete;
+    ~Watchdog();
+
+    void watch(DecodeBudget *budget, const std::string& name);
+    void unwatch(DecodeBudget *budget);
+
+    // budgets expired by watchdog
+    int64_t expired() const;
+
+private:
+    struct entry {
+        std::chrono::steady_clock::time_point deadline;
+        std::string name;
+    };
+
+    void run();
+
+    std::chrono::duration<double> timeout;
+    std::map<DecodeBudget *, entry> entries;
+    int64_t expired_num;
+    bool stop;
+    mutable std::mutex lock;
+    std::condition_variable cond;
+    std::thread th;
+};
+
+/**
+ * Decoding scope of a file
+ * The budget is set for the calling thread and watched by watchdog until the scope ends.
+ */
+class DecodeScope {
+public:
+    DecodeScope(Watchdog *watchdog, const std::string& name, int64_t max_steps);
+    DecodeScope(const DecodeScope& other) = delete;
+    ~DecodeScope();
+
+    bool expired() const {
+        return budget.expired();
+    }
+
+private:
+    Watchdog *watchdog;
+    DecodeBudget budget;
+    DecodeBudget *prev;
+};
+
+/**
+ * Bounded lock free queue
+ * Multi-producer multi-consumer ring of Dmitry Vyukov, each cell has a sequence number telling whether
+ * it is ready to be written or read. Capacity is rounded up to power of 2.
+ */
+template<typename T>
+class LockFreeQueue {
+public:
+    explicit LockFreeQueue(size_t capacity=1024) {
+        size_t cap = 2;
+        while (cap < capacity) cap *= 2;
+        mask = cap - 1;
+        cells.reset(new cell[cap]);
+        for (size_t i = 0; i < cap; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    LockFreeQueue(const LockFreeQueue& other) = delete;
+
+    // return false if queue is full
+    bool try_push(T& item) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        cell *c;
+        while (true) {
+            c = &cells[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        c->item = std::move(item);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // return false if queue is empty
+    bool try_pop(T& item) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        cell *c;
+        while (true) {
+            c = &cells[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(c->item);
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // true if the next cell has no item, exact only for the single consumer
+    bool empty() const {
+        size_t pos = head.load(std::memory_order_relaxed);
+        return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask = 0;
+    std::atomic<size_t> head{0};
+    char pad[64];   // keep head and tail in different cache lines
+    std::atomic<size_t> tail{0};
+};
+
+/**
+ * Asynchronous writer
+ * Records are formatted by a dedicated thread into a large buffer that is flushed with write(2), or
+ * handed to a consumer on that thread. With a reorder window, records are written in seq order.
+ * When the window is full the lowest record is written anyway, so a slow record never blocks the
+ * producers. The idle writer and producers facing a full queue sleep on condition variables, the
+ * flags are only looked at after a fence so the fast path takes no lock.
+ */
+template<typename T>
+class AsyncWriter {
+public:
+    using format_fn = std::function<void(const T& item, std::string& buf)>;
+    using consume_fn = std::function<void(const T& item)>;
+
+    // prefix is written before records
+    AsyncWriter(const std::string& file_path, format_fn fn, size_t reorder_window=0, const std::string& prefix="",
+                size_t buffer_size=1024*1024): format(std::move(fn)), window(reorder_window),
+                                               buffer_size(buffer_size), queue(4096) {
+        fd = file_open_output(file_path);
+        if (fd < 0)
+            return;
+        buf.reserve(buffer_size + 4096);
+        buf += prefix;
+        start();
+    }
+
+    AsyncWriter(consume_fn fn, size_t reorder_window=0): consume(std::move(fn)), window(reorder_window),
+                                                         buffer_size(0), queue(4096) {
+        start();
+    }
+    AsyncWriter(const AsyncWriter& other) = delete;
+
+    ~AsyncWriter() {
+        close();
+    }
+
+    bool is_open() const { return opened; }
+
+    // write record, block while the queue is full
+    void write(uint64_t seq, T item) {
+        entry e{seq, std::move(item)};
+        push(e);
+    }
+
+    // write remaining records and wait writer thread, return error of write or 0
+    int close() {
+        if (thread.joinable()) {
+            closed.store(true, std::memory_order_seq_cst);
+            {
+                std::lock_guard<std::mutex> lock(park_lock);
+                writer_ready.notify_one();
+            }
+            thread.join();
+        }
+        if (fd > STDERR_FILENO) {
+            ::close(fd);
+            fd = -1;
+        }
+        return error;
+    }
+
+private:
+    struct entry {
+        uint64_t seq;
+        T item;
+    };
+
+    void start() {
+        opened = true;
+        thread = std::thread([this] {
+            run();
+        });
+    }
+
+    void push(entry& e) {
+        if (!queue.try_push(e)) {
+            std::unique_lock<std::mutex> lock(park_lock);
+            producers_parked.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // the writer looks at producers_parked after each pop
+            space.wait(lock, [&] { return queue.try_push(e); });
+            producers_parked.fetch_sub(1, std::memory_order_relaxed);
+        }
+        // pairs with the fence of park(), either the writer sees the item or we see it parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (writer_parked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(park_lock);
+            writer_ready.notify_one();
+        }
+    }
+
+    // sleep until a record is pushed or the writer is closed
+    void park() {
+        std::unique_lock<std::mutex> lock(park_lock);
+        writer_parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        writer_ready.wait(lock, [this] {
+            return !queue.empty() || closed.load(std::memory_order_seq_cst);
+        });
+        writer_parked.store(false, std::memory_order_relaxed);
+    }
+
+    void run() {
+        entry e;
+        while (true) {
+            if (queue.try_pop(e)) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (producers_parked.load(std::memory_order_relaxed) > 0) {
+                    std::lock_guard<std::mutex> lock(park_lock);
+                    space.notify_all();
+                }
+                receive(e);
+                continue;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // producers have finished before close
+                while (queue.try_pop(e))
+                    receive(e);
+                break;
+            }
+            // no item, write out what we have before sleeping
+            flush();
+            park();
+        }
+        for (auto& kv : pending)
+            emit(kv.second);
+        pending.clear();
+        flush();
+    }
+
+    void receive(entry& e) {
+        if (window == 0) {
+            emit(e);
+            return;
+        }
+        if (e.seq < next_seq) {
+            // arrived after window overflowed
+            emit(e);
+            return;
+        }
+        pending.emplace(e.seq, std::move(e));
+        while (!pending.empty() && (pending.begin()->first == next_seq || pending.size() > window)) {
+            auto it = pending.begin();
+            next_seq = it->first + 1;
+            emit(it->second);
+            pending.erase(it);
+        }
+    }
+
+    void emit(const entry& e) {
+        if (consume) {
+            consume(e.item);
+            return;
+        }
+        format(e.item, buf);
+        if (buf.size() >= buffer_size)
+            flush();
+    }
+
+    void flush() {
+        if (buf.empty() || fd < 0)
+            return;
+        if (error == 0)
+            error = file_write_all(fd, buf.data(), buf.size());
+        buf.clear();
+    }
+
+    format_fn format;
+    consume_fn consume;
+    size_t window;
+    size_t buffer_size;
+    LockFreeQueue<entry> queue;
+    std::map<uint64_t, entry> pending;      // reorder buffer
+    uint64_t next_seq = 0;                  // next seq in order
+    std::string buf;                        // formatted records
+    int fd = -1;
+    int error = 0;
+    bool opened = false;
+    std::atomic<bool> closed{false};
+    std::mutex park_lock;
+    std::condition_variable writer_ready;   // writer waits for a record
+    std::condition_variable space;          // producers wait for a free cell
+    std::atomic<bool> writer_parked{false};
+    std::atomic<int> producers_parked{0};
+    std::thread thread;
+};
+
+// peak resident set size of process in bytes
+inline uint64_t memory_peak_rss() {
+    struct rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
 /**
  * Video decoder
  */
@@ -294,6 +1158,7 @@ private:
     int peek_frame_idx;         // index of peeking video frame
     int64_t video_duration;     // video duration in AV_TIME_BASE
     bool end_of_stream;         // indicates end of input stream
+    DecodeBudget *budget;       // decode budget of the thread opening video
 };
 
 /**
@@ -321,6 +1186,14 @@ private:
 
 std::vector<cv::Mat> video_make_thumb(const std::string& file, double rate=1.0, int scaled_rows=144, int scaled_cols=144);
 cv::Mat video_make_collage(const std::vector<cv::Mat>& images, int max_image_width=1024);
+
+// read video resolution and duration in seconds without opening decoder
+int video_probe(const std::string& file, int& rows, int& cols, double& seconds);
+
+// threads of each video decoder, 0 keeps FFmpeg default
+void video_set_codec_threads(int threads);
+int video_codec_threads();
+
 ColorType video_get_dominant_color(const cv::Mat& image, int resize=16, int min_percent_diff_of_rgb=10);
 
 }
@@ -17,6 +17,7 @@
 #ifndef VHASH_APP_H
 #define VHASH_APP_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -44,12 +45,46 @@ struct dup_config {
     std::vector<std::string> ext;
     std::string cache_url;
     std::string output;
-    int jobs;
+    std::string schedule;   // schedule policy, fifo or lpt
+    std::string journal;    // journal of hashed files
+    std::string strategy;   // near duplicate strategy, auto, join, bktree or mih
+    std::string index;      // persistent hash index directory
+    std::string temp_dir;   // directory of temp files in external mode
+    std::string reference;  // reference folder, index or binary hash file, only matches against it are reported
+    std::string reference_index;    // index directory a reference folder or binary hash file is kept in
+    int jobs;           // decode jobs
+    int image_jobs;     // decode jobs reserved for images
+    int video_jobs;     // decode jobs reserved for videos
+    int io_jobs;        // metadata and read jobs
+    int hash_jobs;      // hash jobs
+    int queue_size;     // queue size of each stage
+    int64_t max_memory; // memory budget of decoding in bytes, 0 is unlimited
+    int64_t external_memory;    // memory cap of grouping in external mode
+    int distance;       // max hamming distance of duplicate hashes
+    int max_diameter;   // max hamming distance within a near duplicate group, 0 is unbounded
+    int tier_distance;  // max hamming distance of cheap hashes to verify by full hash
+    int shard_index;    // shard of files processed, see shard_count
+    int shard_count;    // shards num of files by stable hash of relative path, 1 is not sharded
+    int64_t max_packets;    // max packets read for a video frame, 0 is unlimited
+    int64_t timeout_retry;  // seconds before cached timeouts are retried
+    double timeout;         // decode time budget of a file in seconds, 0 is unlimited
+    double dir_similarity;  // min jaccard similarity of files of similar directories, 0 is exact only
     bool use_cache;
     bool recursive;
     bool no_progress;
+    bool stats;
+    bool no_thread_budget;  // not limit threads to allowed cpus
+    bool resume;            // skip files in journal
+    bool tiered;            // full hash only files with near cheap hashes
+    bool external;          // group files in sorted runs on disk
+    bool dirs;              // group duplicated directories before files
+    bool dihedral;          // flipped and rotated copies of images share a hash
 
-    dup_config(): jobs(0), use_cache(false), recursive(false), no_progress(false) {}
+    dup_config(): schedule("fifo"), strategy("auto"), jobs(0), image_jobs(0), video_jobs(0), io_jobs(0), hash_jobs(0), queue_size(0), max_memory(0),
+                  external_memory(1LL << 30), distance(0), max_diameter(0), tier_distance(10), shard_index(0),
+                  shard_count(1), max_packets(0), timeout_retry(24 * 60 * 60), timeout(0), dir_similarity(0),
+                  use_cache(false), recursive(false), no_progress(false), stats(false), no_thread_budget(false), resume(false), tiered(false),
+                  external(false), dirs(false), dihedral(false) {}
 };
 
 /**
@@ -60,17 +95,99 @@ struct hash_config {
     std::vector<std::string> ext;
     std::string cache_url;
     std::string output;
-    int jobs;
+    std::string format;     // output format, text, ndjson, csv or bin
+    std::string schedule;   // schedule policy, fifo or lpt
+    std::string journal;    // journal of hashed files
+    int jobs;           // decode jobs
+    int image_jobs;     // decode jobs reserved for images
+    int video_jobs;     // decode jobs reserved for videos
+    int io_jobs;        // metadata and read jobs
+    int hash_jobs;      // hash jobs
+    int queue_size;     // queue size of each stage
+    int64_t max_memory; // memory budget of decoding in bytes, 0 is unlimited
+    int shard_index;    // shard of files processed, see shard_count
+    int shard_count;    // shards num of files by stable hash of relative path, 1 is not sharded
+    int64_t max_packets;    // max packets read for a video frame, 0 is unlimited
+    int64_t timeout_retry;  // seconds before cached timeouts are retried
+    double timeout;         // decode time budget of a file in seconds, 0 is unlimited
     bool use_cache;
     bool recursive;
     bool no_progress;
+    bool stats;
+    bool no_thread_budget;  // not limit threads to allowed cpus
+    bool resume;            // skip files in journal
+    bool ordered;           // write in scan order
+    bool dihedral;          // flipped and rotated copies of images share a hash
 
-    hash_config(): jobs(0), use_cache(false), recursive(false), no_progress(false) {}
+    hash_config(): format("text"), schedule("fifo"), jobs(0), image_jobs(0), video_jobs(0), io_jobs(0), hash_jobs(0), queue_size(0), max_memory(0),
+                   shard_index(0), shard_count(1), max_packets(0), timeout_retry(24 * 60 * 60), timeout(0),
+                   use_cache(false), recursive(false), no_progress(false), stats(false), no_thread_budget(false), resume(false), ordered(false),
+                   dihedral(false) {}
+};
+
+/**
+ * config for convert cmd
+ */
+struct convert_config {
+    std::string input;
+    std::string output;
+    std::string format;     // output format, text, ndjson, csv or bin
+
+    convert_config(): format("text") {}
+};
+
+/**
+ * config for merge cmd
+ */
+struct merge_config {
+    std::vector<std::string> inputs;    // binary hash files of shards
+    std::vector<std::string> caches;    // caches of shards merged into cache_url
+    std::string cache_url;
+    std::string output;
+    std::string hash_output;    // merged binary hash file
+    std::string strategy;       // near duplicate strategy, auto, join, bktree or mih
+    std::string temp_dir;       // directory of temp files in external mode
+    int64_t external_memory;    // memory cap of grouping in external mode
+    int distance;       // max hamming distance of duplicate hashes
+    int max_diameter;   // max hamming distance within a near duplicate group, 0 is unbounded
+    double dir_similarity;  // min jaccard similarity of files of similar directories, 0 is exact only
+    bool external;      // group files in sorted runs on disk
+    bool dirs;          // group duplicated directories before files
+    bool stats;
+
+    merge_config(): strategy("auto"), external_memory(1LL << 30), distance(0), max_diameter(0), dir_similarity(0),
+                    external(false), dirs(false), stats(false) {}
+};
+
+/**
+ * config for query cmd
+ */
+struct query_config {
+    std::vector<std::string> inputs;    // files or 0x prefixed hash values
+    std::string input_list;             // file of inputs one per line, - is stdin
+    std::string index;                  // persistent hash index directory
+    std::string cache_url;
+    std::string output;
+    std::string format;     // output format, text or ndjson
+    int k;              // nearest files num, 0 is all files within radius
+    int radius;         // max hamming distance of matches, -1 is unbounded
+    int jobs;           // parallel hash and query jobs
+    int64_t max_packets;    // max packets read for a video frame, 0 is unlimited
+    int64_t timeout_retry;  // seconds before cached timeouts are retried
+    double timeout;         // decode time budget of a file in seconds, 0 is unlimited
+    bool use_cache;
+    bool dihedral;      // flipped and rotated copies of images share a hash
+
+    query_config(): format("text"), k(0), radius(-1), jobs(0), max_packets(0), timeout_retry(24 * 60 * 60), timeout(0),
+                    use_cache(false), dihedral(false) {}
 };
 
 int cache_cmd(const cache_config& conf);
+int convert_cmd(const convert_config& conf);
 int dup_cmd(const dup_config& conf);
 int hash_cmd(const hash_config& conf);
+int merge_cmd(const merge_config& conf);
+int query_cmd(const query_config& conf);
 int app_run(int argc, char *argv[]);
 
 }
@@ -38,6 +38,9 @@ enum class errors {
     ERR_UNKNOWN_TYPE,
     ERR_PARAM_INVALID,
     ERR_MAKE_THUMB,
+    ERR_WRITE_FILE,
+    ERR_TIMEOUT,
+    ERR_OUT_OF_MEMORY,
 };
 
 }
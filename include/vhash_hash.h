@@ -17,6 +17,7 @@
 #ifndef VHASH_HASH_H
 #define VHASH_HASH_H
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -44,10 +45,14 @@ enum class FileType {
 
 /**
  * Hasher
+ * reduced hasher decodes images at 1/8 scale and samples few small video thumbs, it is a cheap candidate hash
+ * dihedral hasher gives flipped and rotated copies of an image the same hash, it applies to phash and whash of
+ * images, video collages are hashed as they are
  */
 class hasher {
 public:
-    explicit hasher(FileType ft=FileType::TP_IMAGE, HashType ht=HashType::TP_WHASH);
+    explicit hasher(FileType ft=FileType::TP_IMAGE, HashType ht=HashType::TP_WHASH, bool reduced=false,
+                    bool dihedral=false);
     hasher(const hasher& other) = delete;
     hasher(hasher&& other) noexcept;
     ~hasher();
@@ -56,6 +61,8 @@ public:
     hasher& operator=(hasher&& other) noexcept;
 
     int load(const std::string& file_path);
+    int load(const std::vector<uint8_t>& data); // encoded image data
+
 
     uint64_t hash();
 
@@ -65,6 +72,8 @@ private:
 
     HashType ht;
     FileType ft;
+    bool reduced;
+    bool dihedral;
 };
 
 }
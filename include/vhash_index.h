@@ -0,0 +1,71 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VHASH_INDEX_H
+#define VHASH_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vhash {
+
+/**
+ * File matched by an index query
+ */
+struct index_match {
+    std::string path;
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime;
+    int distance;   // hamming distance to queried hash
+};
+
+/**
+ * Read only view of a persistent hash index, as written by dup --index
+ * Segments are mapped and queried in place, base by its substring tables and newer deltas by a scan. The index is
+ * neither locked nor modified, dup runs may update it meanwhile. Queries are safe from many threads.
+ * Files are hashed with hasher before querying, in the dihedral mode the index is opened for, files of the index
+ * hashed in the other mode are not matched.
+ */
+class hash_index {
+public:
+    explicit hash_index(const std::string& dir_path, bool dihedral=false);
+    hash_index(const hash_index& other) = delete;
+    hash_index(hash_index&& other) noexcept;
+    ~hash_index();
+
+    hash_index& operator=(const hash_index& other) = delete;
+    hash_index& operator=(hash_index&& other) noexcept;
+
+    bool is_open() const;
+    // files num, including removed and replaced ones not yet compacted
+    uint64_t size() const;
+
+    // k nearest files within radius of hv, nearest first and ties in path order, all files within radius if k is 0
+    int query(uint64_t hv, size_t k, int radius, std::vector<index_match>& matches) const;
+    // query each of hvs, spread over jobs threads
+    int query(const std::vector<uint64_t>& hvs, size_t k, int radius, std::vector<std::vector<index_match>>& matches,
+              int jobs=0) const;
+
+private:
+    class indeximpl;
+    indeximpl *impl;
+};
+
+}
+
+#endif //VHASH_INDEX_H
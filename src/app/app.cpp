@@ -14,12 +14,19 @@
 // WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
 // THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
+#include <cstdio>
 #include "spdlog/spdlog.h"
 #include "CLI11.hpp"
 #include "vhash_app.h"
 
 namespace vhash {
 
+// shard of "i/N" form with 0 <= i < N
+static bool app_parse_shard(const std::string& s, int& index, int& count) {
+    char tail = 0;
+    return sscanf(s.c_str(), "%d/%d%c", &index, &count, &tail) == 2 && count > 0 && index >= 0 && index < count;
+}
+
 const char* VHASH_VERSION = "vhash 0.0.1 (20220520)";
 
 int app_run(int argc, char *argv[]) {
@@ -34,6 +41,11 @@ int app_run(int argc, char *argv[]) {
         }
         return "";
     };
+    auto shard_checker = [](const std::string& s) -> std::string {
+        int index = 0;
+        int count = 0;
+        return app_parse_shard(s, index, count) ? "" : "should be i/N with 0 <= i < N";
+    };
 
     // cache command
     cache_config c_conf;
@@ -49,14 +61,45 @@ int app_run(int argc, char *argv[]) {
     // dup command
     dup_config d_conf;
     auto& d_cmd = *app.add_subcommand("dup", "Finding duplicate video or image files");
-    d_cmd.add_option("path", d_conf.path, "file or directory path")->check(CLI::ExistingPath);
+    d_cmd.add_option("path", d_conf.path, "directory path or binary hash file")->check(CLI::ExistingPath);
     d_cmd.add_option("-e,--ext", d_conf.ext, "file extension filter (i.e. -e mp4,mkv)")->delimiter(',')->check(not_empty_checker);
     d_cmd.add_option("-c,--cache", d_conf.cache_url, "cache file or url")->check(not_empty_checker);
     d_cmd.add_option("-o,--output", d_conf.output, "output file")->check(not_empty_checker);
-    d_cmd.add_option("-j,--jobs", d_conf.jobs, "parallel jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("-j,--jobs", d_conf.jobs, "parallel decode jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--image-jobs", d_conf.image_jobs, "decode jobs reserved for images")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--video-jobs", d_conf.video_jobs, "decode jobs reserved for videos")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--io-jobs", d_conf.io_jobs, "parallel metadata and read jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--hash-jobs", d_conf.hash_jobs, "parallel hash jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--queue-size", d_conf.queue_size, "queue size of each stage")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--max-memory", d_conf.max_memory, "memory budget of decoding (i.e. 4G), 0 is unlimited")->transform(CLI::AsSizeValue(false))->default_val(0);
+    d_cmd.add_option("-D,--distance", d_conf.distance, "max hamming distance of duplicate hashes")->check(CLI::Range(0, 64))->default_val(0);
+    d_cmd.add_option("--max-diameter", d_conf.max_diameter, "max hamming distance within a near duplicate group, 0 is unbounded")->check(CLI::Range(0, 64))->default_val(0);
+    d_cmd.add_option("--strategy", d_conf.strategy, "near duplicate strategy, auto, join, bktree or mih")->check(CLI::IsMember({"auto", "join", "bktree", "mih"}))->default_val("auto");
+    d_cmd.add_option("--index", d_conf.index, "persistent hash index directory, updated with new and changed files")->check(not_empty_checker);
+    d_cmd.add_option("--reference", d_conf.reference, "reference folder, index or binary hash file, only matches against it are reported")->check(CLI::ExistingPath);
+    d_cmd.add_option("--reference-index", d_conf.reference_index, "index directory a reference folder or binary hash file is kept in for later runs")->check(not_empty_checker)->needs("--reference");
+    d_cmd.add_flag("--tiered", d_conf.tiered, "full hash only files whose cheap hashes are near");
+    d_cmd.add_option("--tier-distance", d_conf.tier_distance, "max hamming distance of cheap hashes to verify by full hash")->check(CLI::Range(0, 64))->default_val(10);
+    d_cmd.add_flag("--external", d_conf.external, "group files in sorted runs on disk for more files than fit in memory");
+    d_cmd.add_option("--external-memory", d_conf.external_memory, "memory cap of grouping in external mode (i.e. 1G)")->transform(CLI::AsSizeValue(false))->default_val("1G");
+    d_cmd.add_option("--temp-dir", d_conf.temp_dir, "directory of temp files in external mode")->check(CLI::ExistingDirectory);
+    d_cmd.add_flag("--dirs", d_conf.dirs, "report duplicated directories once and skip their files in file groups");
+    d_cmd.add_option("--dir-similarity", d_conf.dir_similarity, "min jaccard similarity of files of similar directories, 0 is exact only")->check(CLI::Range(0.0, 1.0))->default_val(0)->needs("--dirs");
+    d_cmd.add_flag("--dihedral", d_conf.dihedral, "give flipped and rotated copies of images the same hash");
+    d_cmd.add_option_function<std::string>("--shard", [&d_conf](const std::string& s) {
+        app_parse_shard(s, d_conf.shard_index, d_conf.shard_count);
+    }, "only files of shard i of N by stable hash of relative path (i.e. 0/4)")->check(shard_checker);
+    d_cmd.add_option("--timeout", d_conf.timeout, "decode time budget of a file in seconds, 0 is unlimited")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--max-packets", d_conf.max_packets, "max packets read for a video frame, 0 is unlimited")->check(CLI::NonNegativeNumber)->default_val(0);
+    d_cmd.add_option("--timeout-retry", d_conf.timeout_retry, "retry cached timeouts after seconds")->check(CLI::NonNegativeNumber)->default_val(24 * 60 * 60);
+    d_cmd.add_option("-s,--schedule", d_conf.schedule, "schedule policy, fifo or lpt (largest first)")->check(CLI::IsMember({"fifo", "lpt"}))->default_val("fifo");
     d_cmd.add_flag("-C,--use-cache", d_conf.use_cache, "use cache");
     d_cmd.add_flag("-r,--recursive", d_conf.recursive, "recursively find files");
     d_cmd.add_flag("-P,--no-progress", d_conf.no_progress, "not print progress bar");
+    d_cmd.add_flag("--stats", d_conf.stats, "print run statistics");
+    d_cmd.add_flag("--no-thread-budget", d_conf.no_thread_budget, "not limit threads to allowed cpus");
+    d_cmd.add_option("--journal", d_conf.journal, "journal file of hashed files")->check(not_empty_checker);
+    d_cmd.add_flag("--resume", d_conf.resume, "skip unchanged files in journal")->needs("--journal");
 
     // hash command
     hash_config h_conf;
@@ -65,10 +108,73 @@ int app_run(int argc, char *argv[]) {
     h_cmd.add_option("-e,--ext", h_conf.ext, "file extension filter (i.e. -e mp4,mkv)")->delimiter(',')->check(not_empty_checker);
     h_cmd.add_option("-c,--cache", h_conf.cache_url, "cache file or url")->check(not_empty_checker);
     h_cmd.add_option("-o,--output", h_conf.output, "output file")->check(not_empty_checker);
-    h_cmd.add_option("-j,--jobs", h_conf.jobs, "parallel jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("-f,--format", h_conf.format, "output format, text, ndjson, csv or bin")->check(CLI::IsMember({"text", "ndjson", "csv", "bin"}))->default_val("text");
+    h_cmd.add_option("-j,--jobs", h_conf.jobs, "parallel decode jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--image-jobs", h_conf.image_jobs, "decode jobs reserved for images")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--video-jobs", h_conf.video_jobs, "decode jobs reserved for videos")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--io-jobs", h_conf.io_jobs, "parallel metadata and read jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--hash-jobs", h_conf.hash_jobs, "parallel hash jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--queue-size", h_conf.queue_size, "queue size of each stage")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--max-memory", h_conf.max_memory, "memory budget of decoding (i.e. 4G), 0 is unlimited")->transform(CLI::AsSizeValue(false))->default_val(0);
+    h_cmd.add_option("--timeout", h_conf.timeout, "decode time budget of a file in seconds, 0 is unlimited")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--max-packets", h_conf.max_packets, "max packets read for a video frame, 0 is unlimited")->check(CLI::NonNegativeNumber)->default_val(0);
+    h_cmd.add_option("--timeout-retry", h_conf.timeout_retry, "retry cached timeouts after seconds")->check(CLI::NonNegativeNumber)->default_val(24 * 60 * 60);
+    h_cmd.add_option("-s,--schedule", h_conf.schedule, "schedule policy, fifo or lpt (largest first)")->check(CLI::IsMember({"fifo", "lpt"}))->default_val("fifo");
     h_cmd.add_flag("-C,--use-cache", h_conf.use_cache, "use cache");
     h_cmd.add_flag("-r,--recursive", h_conf.recursive, "recursively find files");
     h_cmd.add_flag("-P,--no-progress", h_conf.no_progress, "not print progress bar");
+    h_cmd.add_flag("--stats", h_conf.stats, "print run statistics");
+    h_cmd.add_flag("--no-thread-budget", h_conf.no_thread_budget, "not limit threads to allowed cpus");
+    h_cmd.add_option("--journal", h_conf.journal, "journal file of hashed files")->check(not_empty_checker);
+    h_cmd.add_flag("--resume", h_conf.resume, "skip unchanged files in journal")->needs("--journal");
+    h_cmd.add_flag("--ordered", h_conf.ordered, "write results in scan order");
+    h_cmd.add_flag("--dihedral", h_conf.dihedral, "give flipped and rotated copies of images the same hash");
+    h_cmd.add_option_function<std::string>("--shard", [&h_conf](const std::string& s) {
+        app_parse_shard(s, h_conf.shard_index, h_conf.shard_count);
+    }, "only files of shard i of N by stable hash of relative path (i.e. 0/4)")->check(shard_checker);
+
+    // convert command
+    convert_config v_conf;
+    auto& v_cmd = *app.add_subcommand("convert", "Converting hash output between formats");
+    v_cmd.add_option("input", v_conf.input, "text or bin hash file")->check(CLI::ExistingFile)->required();
+    v_cmd.add_option("-o,--output", v_conf.output, "output file")->check(not_empty_checker);
+    v_cmd.add_option("-f,--format", v_conf.format, "output format, text, ndjson, csv or bin")->check(CLI::IsMember({"text", "ndjson", "csv", "bin"}))->default_val("text");
+
+    // merge command
+    merge_config m_conf;
+    auto& m_cmd = *app.add_subcommand("merge", "Merging outputs and caches of shards");
+    m_cmd.add_option("input", m_conf.inputs, "binary hash files of shards")->check(CLI::ExistingFile);
+    m_cmd.add_option("--caches", m_conf.caches, "caches of shards merged into cache (i.e. --caches a.sqlite,b.sqlite)")->delimiter(',')->check(CLI::ExistingFile);
+    m_cmd.add_option("-c,--cache", m_conf.cache_url, "merged cache file or url")->check(not_empty_checker);
+    m_cmd.add_option("-o,--output", m_conf.output, "output file of duplicate groups")->check(not_empty_checker);
+    m_cmd.add_option("--hash-output", m_conf.hash_output, "merged binary hash file")->check(not_empty_checker);
+    m_cmd.add_option("-D,--distance", m_conf.distance, "max hamming distance of duplicate hashes")->check(CLI::Range(0, 64))->default_val(0);
+    m_cmd.add_option("--max-diameter", m_conf.max_diameter, "max hamming distance within a near duplicate group, 0 is unbounded")->check(CLI::Range(0, 64))->default_val(0);
+    m_cmd.add_option("--strategy", m_conf.strategy, "near duplicate strategy, auto, join, bktree or mih")->check(CLI::IsMember({"auto", "join", "bktree", "mih"}))->default_val("auto");
+    m_cmd.add_flag("--external", m_conf.external, "group files in sorted runs on disk for more files than fit in memory");
+    m_cmd.add_option("--external-memory", m_conf.external_memory, "memory cap of grouping in external mode (i.e. 1G)")->transform(CLI::AsSizeValue(false))->default_val("1G");
+    m_cmd.add_option("--temp-dir", m_conf.temp_dir, "directory of temp files in external mode")->check(CLI::ExistingDirectory);
+    m_cmd.add_flag("--dirs", m_conf.dirs, "report duplicated directories once and skip their files in file groups");
+    m_cmd.add_option("--dir-similarity", m_conf.dir_similarity, "min jaccard similarity of files of similar directories, 0 is exact only")->check(CLI::Range(0.0, 1.0))->default_val(0)->needs("--dirs");
+    m_cmd.add_flag("--stats", m_conf.stats, "print run statistics");
+
+    // query command
+    query_config q_conf;
+    auto& q_cmd = *app.add_subcommand("query", "Finding indexed files near video or image files");
+    q_cmd.add_option("input", q_conf.inputs, "files or 0x prefixed hash values");
+    q_cmd.add_option("--index", q_conf.index, "persistent hash index directory")->check(CLI::ExistingDirectory)->required();
+    q_cmd.add_option("-i,--input-list", q_conf.input_list, "file of inputs one per line, - is stdin")->check(not_empty_checker);
+    q_cmd.add_option("-k,--k", q_conf.k, "nearest files num of each input, 0 is all files within radius")->check(CLI::NonNegativeNumber)->default_val(0);
+    q_cmd.add_option("-R,--radius", q_conf.radius, "max hamming distance of matches")->check(CLI::Range(0, 64));
+    q_cmd.add_option("-c,--cache", q_conf.cache_url, "cache file or url")->check(not_empty_checker);
+    q_cmd.add_option("-o,--output", q_conf.output, "output file")->check(not_empty_checker);
+    q_cmd.add_option("-f,--format", q_conf.format, "output format, text or ndjson")->check(CLI::IsMember({"text", "ndjson"}))->default_val("text");
+    q_cmd.add_option("-j,--jobs", q_conf.jobs, "parallel hash and query jobs")->check(CLI::NonNegativeNumber)->default_val(0);
+    q_cmd.add_option("--timeout", q_conf.timeout, "decode time budget of a file in seconds, 0 is unlimited")->check(CLI::NonNegativeNumber)->default_val(0);
+    q_cmd.add_option("--max-packets", q_conf.max_packets, "max packets read for a video frame, 0 is unlimited")->check(CLI::NonNegativeNumber)->default_val(0);
+    q_cmd.add_option("--timeout-retry", q_conf.timeout_retry, "retry cached timeouts after seconds")->check(CLI::NonNegativeNumber)->default_val(24 * 60 * 60);
+    q_cmd.add_flag("-C,--use-cache", q_conf.use_cache, "use cache");
+    q_cmd.add_flag("--dihedral", q_conf.dihedral, "give flipped and rotated copies of images the same hash");
 
     CLI11_PARSE(app, argc, argv);
     if (silent) {
@@ -80,6 +186,12 @@ int app_run(int argc, char *argv[]) {
         return dup_cmd(d_conf);
     } else if (h_cmd) {
         return hash_cmd(h_conf);
+    } else if (v_cmd) {
+        return convert_cmd(v_conf);
+    } else if (m_cmd) {
+        return merge_cmd(m_conf);
+    } else if (q_cmd) {
+        return query_cmd(q_conf);
     } else {
         std::cout<< app.help() << std::endl;
     }
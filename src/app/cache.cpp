@@ -42,7 +42,10 @@ int cache_cmd(const cache_config& conf) {
         auto items = db.get(key);
         for (auto& it : items) {
             std::cout << "FILE: " << conf.path << std::endl;
-            std::cout << "HASH: 0x" << it.file_hash << std::endl;
+            if (!it.cheap_only)
+                std::cout << (it.dihedral ? "DIHEDRAL: 0x" : "HASH: 0x") << std::hex << it.file_hash << std::dec << std::endl;
+            if (it.has_cheap)
+                std::cout << "CHEAP: 0x" << std::hex << it.cheap_hash << std::dec << std::endl;
         }
     } else if (conf.del) {
         cache_item key{.parent=std::get<0>(v), .file=std::get<1>(v)};
@@ -0,0 +1,112 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <cstdlib>
+#include <fstream>
+#include "spdlog/spdlog.h"
+#include "vhash_error.h"
+#include "vhash_app.h"
+#include "internal/app.h"
+#include "internal/hashfile.h"
+#include "internal/scan.h"
+
+namespace vhash {
+
+// read FILE, HASH and STATUS lines of text output, size and mtime are taken from file system if file exists
+static int convert_read_text(const std::string& file_path, app_output& output) {
+    std::ifstream in(file_path);
+    if (!in.is_open()) {
+        spdlog::error("open input file \"{}\" failed", file_path);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+
+    uint64_t seq = 0;
+    app_record record;
+    bool has_path = false;
+    bool has_hash = false;
+    // status line follows hash line, record is written when next file starts
+    auto flush = [&]() {
+        if (has_hash) {
+            int64_t size = 0;
+            scanner_get_file_info(record.path, size, record.mtime);
+            record.size = static_cast<uint64_t>(size);
+            output.write(seq++, std::move(record));
+        }
+        record = app_record();
+        has_path = false;
+        has_hash = false;
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 6, "FILE: ") == 0) {
+            flush();
+            record.path = line.substr(6);
+            has_path = true;
+        } else if (line.compare(0, 6, "HASH: ") == 0 && has_path) {
+            record.hv = std::strtoull(line.c_str() + 6, nullptr, 16);
+            has_hash = true;
+        } else if (line == "STATUS: failed" && has_hash) {
+            record.failed = true;
+        } else if (line == "STATUS: timeout" && has_hash) {
+            record.failed = true;
+            record.timeout = true;
+        }
+    }
+    flush();
+    return 0;
+}
+
+static int convert_read_bin(const std::string& file_path, app_output& output) {
+    HashFileReader reader(file_path);
+    if (!reader.is_open()) {
+        spdlog::error("read hash file \"{}\" failed", file_path);
+        return VERROR(errors::ERR_READ_FILE);
+    }
+
+    uint64_t seq = 0;
+    for (auto& r : reader) {
+        output.write(seq++, app_record{reader.path(r), r.hash, r.size, r.mtime, (r.flags & HASHFILE_FAILED) != 0,
+                                       (r.flags & HASHFILE_TIMEOUT) != 0});
+    }
+    return 0;
+}
+
+int convert_cmd(const convert_config& conf) {
+    if (conf.format == "bin" && conf.output.empty()) {
+        spdlog::error("bin format needs an output file");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    app_output output(conf.output, conf.format);
+    if (!output.is_open()) {
+        spdlog::error("open output file \"{}\" failed", conf.output);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+
+    int rtn = hashfile_check(conf.input) ? convert_read_bin(conf.input, output)
+                                         : convert_read_text(conf.input, output);
+    int write_rtn = output.close();
+    if (rtn) return rtn;
+    if (write_rtn < 0) {
+        spdlog::error("write output file \"{}\" failed", conf.output);
+        return write_rtn;
+    }
+    return 0;
+}
+
+}
@@ -14,114 +14,758 @@
 // WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
 // THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <numeric>
+#include <thread>
 #include "spdlog/spdlog.h"
-#include "tqdm.h"
 #include "vhash_error.h"
 #include "vhash_hash.h"
 #include "vhash_app.h"
 #include "internal/app.h"
 #include "internal/cache.h"
+#include "internal/external.h"
+#include "internal/index.h"
 #include "internal/scan.h"
+#include "internal/store.h"
 #include "internal/util.h"
 
 namespace vhash {
 
-int dup_cmd(const dup_config& conf) {
-    if (!scanner_check_exists(conf.path)) {
-        spdlog::error("path \"{}\" not exists", conf.path);
-        return VERROR(errors::ERR_NOT_EXISTS);
+// pairs of hashes within distance by brute force join or the index of strategy, see index_self_join for emit and done
+template<typename F, typename D>
+static void dup_self_join(const std::vector<uint64_t>& hashes, int distance, const std::string& strategy, F emit, D done) {
+    ThreadPool pool;
+    std::string chosen = index_choose_strategy(strategy, hashes.size(), distance);
+    if (chosen == "join") {
+        index_block_join(hashes, distance, pool, emit, done);
+    } else if (chosen == "bktree") {
+        BKTree tree(hashes);
+        index_self_join(tree, hashes, distance, pool, emit, done);
+    } else {
+        MIHIndex index(hashes, distance);
+        index_self_join(index, hashes, distance, pool, emit, done);
     }
+}
 
-    if (!scanner_check_is_folder(conf.path)) {
-        spdlog::error("path \"{}\" is not folder", conf.path);
-        return VERROR(errors::ERR_PARAM_INVALID);
+// paths of entries of a group are appended to out, files under duplicated directories are kept apart with the
+// directory group they are under
+static void dup_collect(const HashGroups& files, const DirGroups *dirs, const HashGroups::entry *begin,
+                        const HashGroups::entry *end, std::vector<const char *>& out,
+                        std::vector<std::pair<uint32_t, const char *>>& kept) {
+    for (auto e = begin; e != end; e++) {
+        uint32_t owner = dirs ? dirs->owner(static_cast<size_t>(e - files.entries().data())) : DirGroups::DIR_NONE;
+        if (owner != DirGroups::DIR_NONE)
+            kept.emplace_back(owner, e->path);
+        else
+            out.push_back(e->path);
     }
+}
 
-    // init output writer
-    FileWriter fw(conf.output);
-
-    // init cache db
-    db_cache db(conf.cache_url);
-    if (conf.use_cache) {
-        int rtn = db.init();
-        if(rtn) return rtn;
+// copies under one duplicated directory are reported by its group, so the first file of each directory group stands
+// for them, a group of files under a single directory group and nowhere else is not written
+static void dup_write_paths(FileWriter& fw, uint64_t hv, std::vector<const char *>& out,
+                            std::vector<std::pair<uint32_t, const char *>>& kept) {
+    std::stable_sort(kept.begin(), kept.end(), [](const std::pair<uint32_t, const char *>& a,
+                                                  const std::pair<uint32_t, const char *>& b) {
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < kept.size(); i++) {
+        if (i == 0 || kept[i].first != kept[i - 1].first)
+            out.push_back(kept[i].second);
     }
+    if (out.size() < 2)
+        return;
+    fw << "HASH: 0x" << std::hex << hv << "\n";
+    for (auto path : out)
+        fw << "FILE: " << path << "\n";
+    fw << "\n";
+}
 
-    // generate file hash
-    std::vector<std::string> files;
-    set_t black_set;
-    set_t white_set = app_generate_ext_set(conf.ext);
-    scanner scan(conf.path);
-    scan.for_each([&files, &black_set, &white_set](const char *parent, const char *file) -> bool {
-        if (!scanner_ext_filter(black_set, white_set, file))
-            return false;
+// group hashes linked by pairs within distance, files of a group are written under the hash of its first member
+// as soon as the group is complete, files are sorted by hash
+static void dup_write_near(const HashGroups& files, const DirGroups *dirs, const dup_config& conf, FileWriter& fw) {
+    std::vector<uint64_t> hashes;
+    std::vector<std::pair<const HashGroups::entry *, const HashGroups::entry *>> paths;
+    files.for_each_run([&](uint64_t hv, const HashGroups::entry *begin, const HashGroups::entry *end) {
+        hashes.push_back(hv);
+        paths.emplace_back(begin, end);
+    });
 
-        std::string file_path = parent;
-        file_path += file_seperator();
-        file_path += file;
-        files.emplace_back(file_path);
+    NearGroups groups(hashes, conf.max_diameter);
+    std::vector<const char *> out;
+    std::vector<std::pair<uint32_t, const char *>> kept;
+    auto write_group = [&](const std::vector<uint32_t>& members) {
+        size_t n = 0;
+        for (auto i : members)
+            n += paths[i].second - paths[i].first;
+        if (n < 2)
+            return;
+        out.clear();
+        kept.clear();
+        for (auto i : members)
+            dup_collect(files, dirs, paths[i].first, paths[i].second, out, kept);
+        dup_write_paths(fw, hashes[members[0]], out, kept);
+    };
+    dup_self_join(hashes, conf.distance, conf.strategy, [&groups](uint32_t i, uint32_t j) {
+        groups.link(i, j);
+    }, [&](size_t end) {
+        groups.flush(end, write_group);
+    });
+}
 
-        return false; // file has been processed, not add to results
-    }, conf.recursive);
+// directories of equal files are written as DIRHASH groups and of similar files as SIMILAR pairs,
+// before file groups which then skip files of duplicated directories, failed files tell directories apart too
+static std::unique_ptr<DirGroups> dup_write_dirs(const HashGroups& files, const std::vector<std::string>& failed,
+                                                 const dup_config& conf, FileWriter& fw) {
+    std::unique_ptr<DirGroups> dirs(new DirGroups(conf.dir_similarity));
+    for (auto& e : files.entries())
+        dirs->add(e.hash, e.path);
+    for (auto& path : failed)
+        dirs->add_failed(path.c_str());
+    dirs->build();
+    for (auto& group : dirs->exact()) {
+        fw << "DIRHASH: 0x" << std::hex << group.sig << "\n";
+        for (auto d : group.dirs)
+            fw << "DIR: " << dirs->path(d) << "\n";
+        fw << "\n";
+    }
+    char similarity[16];
+    for (auto& pair : dirs->similar()) {
+        snprintf(similarity, sizeof(similarity), "%.2f", pair.similarity);
+        fw << "SIMILAR: " << similarity << "\n";
+        fw << "DIR: " << dirs->path(pair.a) << "\n";
+        fw << "DIR: " << dirs->path(pair.b) << "\n";
+        fw << "\n";
+    }
+    if (conf.stats) {
+        spdlog::info("dirs: directories: {}, exact groups: {}, similar pairs: {}", dirs->size(), dirs->exact().size(),
+                     dirs->similar().size());
+    }
+    return dirs;
+}
 
-    tqdm bar;
-    bool has_progress = !conf.no_progress && !conf.output.empty();
+// sorted files are written in groups of equal hashes or hashes within distance, directory groups come first
+static void dup_write_groups(const HashGroups& files, const std::vector<std::string>& failed, const dup_config& conf,
+                             FileWriter& fw) {
+    std::unique_ptr<DirGroups> dirs;
+    if (conf.dirs)
+        dirs = dup_write_dirs(files, failed, conf, fw);
+    if (conf.distance > 0) {
+        dup_write_near(files, dirs.get(), conf, fw);
+        return;
+    }
+    std::vector<const char *> out;
+    std::vector<std::pair<uint32_t, const char *>> kept;
+    files.for_each_run([&](uint64_t hv, const HashGroups::entry *begin, const HashGroups::entry *end) {
+        if (end - begin < 2)
+            return;
+        out.clear();
+        kept.clear();
+        dup_collect(files, dirs.get(), begin, end, out, kept);
+        dup_write_paths(fw, hv, out, kept);
+    });
+}
 
-    std::mutex db_lock;
-    std::mutex map_lock;
+// path would be found by a scan of conf, files of index out of scan or out of its shard are kept
+static bool dup_index_scope(const dup_config& conf, const std::string& root, const set_t& white_set, const std::string& path) {
+    if (path.size() <= root.size() + 1 || path.compare(0, root.size(), root) != 0 || path[root.size()] != file_seperator())
+        return false;
+    if (!app_in_shard(conf, root, path))
+        return false;
+    std::string::size_type pos = path.find_last_of(file_seperator());
+    if (!conf.recursive && pos != root.size())
+        return false;
+    std::string file = path.substr(pos + 1);
+    return scanner_ext_filter(set_t(), white_set, file) && app_check_file_type(file) != FileType::TP_OTHER;
+}
 
-    ThreadPool pool(conf.jobs);
-    std::unordered_map<uint64_t, std::vector<std::string>> map;
-    std::atomic<int> completed{0};
-    int total = static_cast<int>(files.size());
-    for (auto& file : files) {
-        if (has_progress) bar.progress(completed.load(), total);
+// hash files of scan that are new or changed since index, and add them to index with removed files of scan,
+// paths of failed files are appended to failed if set
+static int dup_update_index(const dup_config& conf, const db_cache& db, app_stats& stats, IndexStore& store,
+                            std::vector<std::string> *failed=nullptr) {
+    std::unique_ptr<std::atomic<uint64_t>[]> seen(new std::atomic<uint64_t>[store.size() / 64 + 1]);
+    for (uint64_t i = 0; i <= store.size() / 64; i++)
+        seen[i].store(0, std::memory_order_relaxed);
+    uint32_t flags = conf.dihedral ? STORE_DIHEDRAL : 0;
+    auto known = [&store, &seen, flags](const app_file& file, uint64_t& hv) {
+        uint64_t pos = 0;
+        const store_record *record = store.find(file.path.c_str(), &pos);
+        if (!record)
+            return false;
+        // changed files and files hashed in the other dihedral mode are replaced by their new record
+        seen[pos / 64].fetch_or(1ULL << (pos % 64), std::memory_order_relaxed);
+        if (record->size != file.size || record->mtime != file.mtime || (record->flags & STORE_DIHEDRAL) != flags)
+            return false;
+        hv = record->hash;
+        return true;
+    };
 
-        while (pool.idle_count() == 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100)); // wait 100ms
+    std::vector<store_entry> entries;
+    std::mutex entries_lock;
+    int rtn = app_hash_files(conf, db, stats, [&](const app_file& file, uint64_t hv) {
+        if (file.indexed)
+            return;
+        std::lock_guard<std::mutex> lock(entries_lock);
+        // failed and timed out files are retried next run, their old records are removed
+        if (file.failed) {
+            if (failed) {
+                failed->push_back(file.path);
+                for (auto& link : file.links)
+                    failed->push_back(link.path);
+            }
+            if (store.find(file.path.c_str()))
+                entries.push_back({0, file.size, file.mtime, file.path, STORE_REMOVED});
+            for (auto& link : file.links) {
+                if (store.find(link.path.c_str()))
+                    entries.push_back({0, file.size, file.mtime, link.path, STORE_REMOVED});
+            }
+            return;
         }
+        entries.push_back({hv, file.size, file.mtime, file.path, flags});
+        for (auto& link : file.links)
+            entries.push_back({hv, file.size, file.mtime, link.path, flags});
+    }, known);
+    if (rtn < 0) return rtn;
 
-        pool.commit([&conf, &db, &file, &map, &db_lock, &map_lock, &completed]() {
-            FileType ft = app_check_file_type(file);
-            if (ft == FileType::TP_OTHER) {
-                completed ++;
-                return;
-            }
+    // files of index not found by this scan are removed
+    std::string root = scanner_abs_path(conf.path);
+    set_t white_set = app_generate_ext_set(conf.ext);
+    store.for_each_live([&](uint64_t pos, const char *path, const store_record& record) {
+        if (seen[pos / 64].load(std::memory_order_relaxed) & (1ULL << (pos % 64)))
+            return;
+        if (dup_index_scope(conf, root, white_set, path))
+            entries.push_back({record.hash, record.size, record.mtime, path, STORE_REMOVED});
+    });
+    if (conf.stats)
+        spdlog::info("index: records: {}, updates: {}", store.size(), entries.size());
+    return store.append(entries);
+}
 
-            uint64_t hv = app_get_file_hash(db_lock, db, file, conf.use_cache, ft);
+// update index with new and changed files, then find duplication among all files of index,
+// segments are compacted in the background meanwhile
+static int dup_index_cmd(const dup_config& conf, const db_cache& db, app_stats& stats, FileWriter& fw) {
+    IndexStore store(conf.index);
+    if (!store.is_open()) {
+        spdlog::error("open index \"{}\" failed, it may be in use", conf.index);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+    std::vector<std::string> failed;
+    int rtn = dup_update_index(conf, db, stats, store, conf.dirs ? &failed : nullptr);
+    if (conf.stats) app_print_stats(stats);
+    if (rtn < 0) {
+        spdlog::error("update index \"{}\" failed", conf.index);
+        return rtn;
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(map_lock);
-                auto it = map.find(hv);
-                if (it != map.end()) {
-                    it->second.emplace_back(file);
-                } else {
-                    map.emplace(hv, std::vector<std::string>{std::move(file)});
-                }
-            }
-            completed ++;
+    int compact_rtn = 0;
+    std::thread compaction;
+    if (store.needs_compaction())
+        compaction = std::thread([&store, &compact_rtn] { compact_rtn = store.compact(); });
+
+    if (conf.distance > 0 || conf.dirs) {
+        HashGroups files;
+        store.for_each_group([&files](uint64_t hv, const std::vector<const char *>& paths) {
+            for (auto path : paths)
+                files.add(0, hv, path, strlen(path));
+        });
+        {
+            ThreadPool pool;
+            files.sort(pool);
+        }
+        dup_write_groups(files, failed, conf, fw);
+    } else {
+        store.for_each_group([&fw](uint64_t hv, const std::vector<const char *>& paths) {
+            if (paths.size() < 2)
+                return;
+            fw << "HASH: 0x" << std::hex << hv << "\n";
+            for (auto item : paths)
+                fw << "FILE: " << item << "\n";
+            fw << "\n";
         });
     }
 
-    // wait all tasks finished
-    while (completed.load() < total) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // wait 100ms
+    if (compaction.joinable())
+        compaction.join();
+    if (compact_rtn < 0) {
+        spdlog::error("compact index \"{}\" failed", conf.index);
+        return compact_rtn;
     }
-    if (has_progress) bar.finish();
+    return 0;
+}
 
-    // find duplication by hash
-    for (auto& m: map) {
-        if (m.second.size() > 1) {
-            fw << "HASH: 0x" << std::hex << m.first << "\n";
-            for (auto& item: m.second) {
-                fw << "FILE: " << item << "\n";
+// temp files of external mode are written under temp dir, TMPDIR or /tmp
+static std::string dup_temp_dir(const dup_config& conf) {
+    if (!conf.temp_dir.empty())
+        return conf.temp_dir;
+    const char *tmp = getenv("TMPDIR");
+    return tmp && *tmp ? tmp : "/tmp";
+}
+
+// exact or banded near groups merged from sorted runs on disk
+static int dup_write_external(ExternalGroups& external, const dup_config& conf, FileWriter& fw) {
+    int rtn;
+    if (conf.distance == 0) {
+        // exact groups are streamed, a group ends where the next starts
+        bool open = false;
+        rtn = external.for_each_exact([&fw, &open](uint64_t hv, const std::string& path, bool first) {
+            if (first) {
+                if (open)
+                    fw << "\n";
+                fw << "HASH: 0x" << std::hex << hv << "\n";
+                open = true;
             }
+            fw << "FILE: " << path << "\n";
+        });
+        if (open)
+            fw << "\n";
+    } else {
+        rtn = external.for_each_group(conf.distance, conf.max_diameter,
+                                      [&fw](uint64_t hv, const std::vector<std::string>& paths) {
+            fw << "HASH: 0x" << std::hex << hv << "\n";
+            for (auto& item : paths)
+                fw << "FILE: " << item << "\n";
             fw << "\n";
+        });
+    }
+    if (conf.stats) {
+        spdlog::info("external: files: {}, runs: {}, merge passes: {}, spilled: {:.1f}MB", external.size(),
+                     external.runs(), external.passes(), external.spilled() / (1024.0 * 1024.0));
+    }
+    if (rtn < 0)
+        spdlog::error("group files of external mode failed");
+    return rtn;
+}
+
+// paths of file and its links are added by add(hv, path, len, failed), failed and timed out files have no hash to
+// compare
+template<typename A>
+static void dup_add_file(A& add, const app_file& file, uint64_t hv) {
+    add(hv, file.path.c_str(), file.path.size(), file.failed);
+    for (auto& link : file.links) {
+        add(hv, link.path.c_str(), link.path.size(), file.failed);
+    }
+}
+
+// cheap tier hashes reduced decodes of all files, only files whose cheap hash is within tier distance of another
+// file's and files with links are candidates, they are added by their full hashes
+template<typename A>
+static int dup_tiered_files(const dup_config& conf, const db_cache& db, A& add) {
+    app_stats cheap_stats;
+    std::vector<app_file> files;
+    std::vector<uint64_t> hashes;
+    std::mutex files_lock;
+    int rtn = app_hash_files(conf, db, cheap_stats, [&](const app_file& file, uint64_t hv) {
+        // failed and timed out files have no cheap hash to compare
+        if (file.failed)
+            return;
+        std::lock_guard<std::mutex> lock(files_lock);
+        files.push_back(file);
+        hashes.push_back(hv);
+    }, [](const app_file&, uint64_t&) { return false; }, app_tier::CHEAP);
+    if (conf.stats) app_print_stats(cheap_stats);
+    if (rtn < 0) return rtn;
+
+    // files in hash order, runs of equal hashes are candidates as a whole and the join only sees unique hashes
+    std::vector<uint32_t> order(files.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&hashes](uint32_t a, uint32_t b) {
+        return hashes[a] < hashes[b];
+    });
+    std::vector<uint64_t> unique;
+    std::vector<size_t> runs;   // offset in order of each unique hash, and the end
+    for (size_t k = 0; k < order.size(); k++) {
+        if (unique.empty() || hashes[order[k]] != unique.back()) {
+            unique.push_back(hashes[order[k]]);
+            runs.push_back(k);
+        }
+    }
+    runs.push_back(order.size());
+
+    std::unique_ptr<std::atomic<bool>[]> marks(new std::atomic<bool>[unique.size()]);
+    for (size_t u = 0; u < unique.size(); u++)
+        marks[u].store(runs[u + 1] - runs[u] > 1, std::memory_order_relaxed);
+    dup_self_join(unique, conf.tier_distance, conf.strategy, [&marks](uint32_t i, uint32_t j) {
+        marks[i].store(true, std::memory_order_relaxed);
+        marks[j].store(true, std::memory_order_relaxed);
+    }, [](size_t) {});
+
+    std::vector<app_file> candidates;
+    for (size_t u = 0; u < unique.size(); u++) {
+        for (size_t k = runs[u]; k < runs[u + 1]; k++) {
+            app_file& file = files[order[k]];
+            if (marks[u].load(std::memory_order_relaxed) || !file.links.empty())
+                candidates.emplace_back(std::move(file));
+        }
+    }
+    std::vector<app_file>().swap(files);
+    if (conf.stats)
+        spdlog::info("tiers: cheap hashed: {}, candidates: {}", hashes.size(), candidates.size());
+
+    app_stats stats;
+    rtn = app_hash_listed(conf, db, stats, candidates, [&add](const app_file& file, uint64_t hv) {
+        dup_add_file(add, file, hv);
+    });
+    if (rtn < 0) return rtn;
+    if (conf.stats) app_print_stats(stats);
+    return 0;
+}
+
+// files added by ingest(add) are grouped in memory or spilled to temp files in external mode, then
+// groups of equal hashes or hashes within distance are written
+template<typename I>
+static int dup_group_files(const dup_config& conf, FileWriter& fw, I ingest) {
+    if (conf.external && conf.dirs) {
+        spdlog::error("directory groups are found in memory, not external mode");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    // emit of pipeline is called by its single output worker, so one slot takes all files without lock
+    HashGroups groups;
+    std::unique_ptr<ExternalGroups> external;
+    if (conf.external) {
+        external.reset(new ExternalGroups(dup_temp_dir(conf), static_cast<uint64_t>(conf.external_memory)));
+        if (!external->is_open()) {
+            spdlog::error("open temp files of external mode failed");
+            return VERROR(errors::ERR_OPEN_FILE);
+        }
+    }
+    int add_error = 0;
+    std::vector<std::string> failed;
+    auto add = [&](uint64_t hv, const char *path, size_t len, bool is_failed) {
+        // failed files are only kept for directory signatures
+        if (is_failed) {
+            if (conf.dirs)
+                failed.emplace_back(path, len);
+            return;
+        }
+        if (!external)
+            groups.add(0, hv, path, len);
+        else if (add_error == 0)
+            add_error = external->add(hv, path, len);
+    };
+    int rtn = ingest(add);
+    if (rtn < 0) return rtn;
+
+    if (external) {
+        if (add_error < 0) {
+            spdlog::error("write temp files of external mode failed");
+            return add_error;
+        }
+        return dup_write_external(*external, conf, fw);
+    }
+
+    // find duplication by hash, runs of sorted files share a hash
+    {
+        ThreadPool pool;
+        groups.sort(pool);
+    }
+    dup_write_groups(groups, failed, conf, fw);
+    return 0;
+}
+
+// hashes of binary hash file are comparable only in the dihedral mode they are taken in
+static int dup_check_hashfile_mode(const HashFileReader& reader, const std::string& file_path, bool dihedral) {
+    if (reader.dihedral() != dihedral) {
+        spdlog::error("hash file \"{}\" is hashed {} dihedral mode", file_path, reader.dihedral() ? "in" : "without");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    return 0;
+}
+
+// records of binary hash file are added without hashing, see dup_add_file for add
+template<typename A>
+static int dup_add_hashfile(const std::string& file_path, bool dihedral, A& add) {
+    HashFileReader reader(file_path);
+    if (!reader.is_open()) {
+        spdlog::error("read hash file \"{}\" failed", file_path);
+        return VERROR(errors::ERR_READ_FILE);
+    }
+    int rtn = dup_check_hashfile_mode(reader, file_path, dihedral);
+    if (rtn < 0) return rtn;
+    for (auto& record : reader) {
+        const char *path = reader.path(record);
+        add(record.hash, path, strlen(path), (record.flags & HASHFILE_FAILED) != 0);
+    }
+    return 0;
+}
+
+int dup_hashfiles(const dup_config& conf, const std::vector<std::string>& files) {
+    FileWriter fw(conf.output);
+    return dup_group_files(conf, fw, [&conf, &files](auto& add) {
+        for (auto& file : files) {
+            int rtn = dup_add_hashfile(file, conf.dihedral, add);
+            if (rtn < 0) return rtn;
         }
+        return 0;
+    });
+}
+
+// records of binary hash file replace changed records of index, records of index not in it are removed
+static int dup_update_from_hashfile(const dup_config& conf, const std::string& file_path, IndexStore& store) {
+    HashFileReader reader(file_path);
+    if (!reader.is_open()) {
+        spdlog::error("read hash file \"{}\" failed", file_path);
+        return VERROR(errors::ERR_READ_FILE);
+    }
+    int rtn = dup_check_hashfile_mode(reader, file_path, conf.dihedral);
+    if (rtn < 0) return rtn;
+    uint32_t flags = conf.dihedral ? STORE_DIHEDRAL : 0;
+    std::vector<const char *> paths;
+    std::vector<store_entry> entries;
+    paths.reserve(reader.size());
+    for (auto& record : reader) {
+        // failed files have no hash to match
+        if (record.flags & HASHFILE_FAILED)
+            continue;
+        const char *path = reader.path(record);
+        paths.push_back(path);
+        const store_record *known = store.find(path);
+        if (known && known->hash == record.hash && known->size == record.size && known->mtime == record.mtime &&
+            (known->flags & STORE_DIHEDRAL) == flags)
+            continue;
+        entries.push_back({record.hash, record.size, record.mtime, path, flags});
     }
 
+    auto less = [](const char *a, const char *b) { return strcmp(a, b) < 0; };
+    std::sort(paths.begin(), paths.end(), less);
+    store.for_each_live([&](uint64_t, const char *path, const store_record& record) {
+        if (!std::binary_search(paths.begin(), paths.end(), path, less))
+            entries.push_back({record.hash, record.size, record.mtime, path, STORE_REMOVED});
+    });
+    if (conf.stats)
+        spdlog::info("index: records: {}, updates: {}", store.size(), entries.size());
+    return store.append(entries);
+}
+
+// reference folder or binary hash file is synced into index, a folder by the same update as an index of dup,
+// then the index is compacted so queries probe the substring tables of its base
+static int dup_sync_reference(const dup_config& conf, const db_cache& db, const std::string& index_path) {
+    IndexStore store(index_path);
+    if (!store.is_open()) {
+        spdlog::error("open index \"{}\" failed, it may be in use", index_path);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+    int rtn;
+    if (scanner_check_is_folder(conf.reference)) {
+        dup_config ref_conf = conf;
+        ref_conf.path = conf.reference;
+        ref_conf.index = index_path;
+        ref_conf.journal.clear();
+        ref_conf.resume = false;
+        ref_conf.shard_index = 0;
+        ref_conf.shard_count = 1;
+        app_stats stats;
+        rtn = dup_update_index(ref_conf, db, stats, store);
+        if (conf.stats) app_print_stats(stats);
+    } else {
+        rtn = dup_update_from_hashfile(conf, conf.reference, store);
+    }
+    if (rtn == 0 && store.needs_compaction())
+        rtn = store.compact();
+    if (rtn < 0)
+        spdlog::error("update reference index \"{}\" failed", index_path);
+    return rtn;
+}
+
+/**
+ * File of the new side queried against reference index
+ */
+struct dup_query {
+    std::string path;
+    uint64_t hash;
+};
+
+// new files of folder or binary hash file, failed and timed out files have no hash to query
+static int dup_collect_queries(const dup_config& conf, const db_cache& db, bool from_hashfile,
+                               std::vector<dup_query>& queries) {
+    std::mutex queries_lock;
+    auto add = [&queries, &queries_lock](uint64_t hv, const char *path, size_t len, bool failed) {
+        if (failed)
+            return;
+        std::lock_guard<std::mutex> lock(queries_lock);
+        queries.push_back({std::string(path, len), hv});
+    };
+    int rtn;
+    if (from_hashfile) {
+        rtn = dup_add_hashfile(conf.path, conf.dihedral, add);
+    } else {
+        app_stats stats;
+        rtn = app_hash_files(conf, db, stats, [&add](const app_file& file, uint64_t hv) {
+            dup_add_file(add, file, hv);
+        });
+        if (conf.stats) app_print_stats(stats);
+    }
+    std::sort(queries.begin(), queries.end(), [](const dup_query& a, const dup_query& b) {
+        return a.path < b.path;
+    });
+    return rtn;
+}
+
+// each new file is queried within distance of reference index, files with matches are written with them
+static int dup_query_reference(const dup_config& conf, const std::vector<dup_query>& queries,
+                               const std::string& index_path, FileWriter& fw) {
+    IndexStore store(index_path, true);
+    if (!store.is_open()) {
+        spdlog::error("open reference index \"{}\" failed", index_path);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+
+    // records of a reference index hashed in the other dihedral mode are not matched
+    uint32_t mode = conf.dihedral ? STORE_DIHEDRAL : 0;
+    std::vector<std::vector<store_match>> results(queries.size());
+    {
+        ThreadPool pool;
+        size_t chunks = (queries.size() + INDEX_QUERY_CHUNK - 1) / INDEX_QUERY_CHUNK;
+        index_parallel_for(pool, chunks, [&](size_t c) {
+            size_t end = std::min(queries.size(), (c + 1) * INDEX_QUERY_CHUNK);
+            for (size_t i = c * INDEX_QUERY_CHUNK; i < end; i++)
+                store.radius(queries[i].hash, conf.distance, results[i], mode);
+        });
+    }
+
+    // a new file inside the reference is not matched with itself
+    size_t matched = 0;
+    std::string buf;
+    for (size_t i = 0; i < queries.size(); i++) {
+        buf.clear();
+        for (auto& m : results[i]) {
+            if (queries[i].path == m.path)
+                continue;
+            buf.append("MATCH: ").append(std::to_string(m.distance)).push_back(' ');
+            app_append_hex(m.record->hash, buf);
+            buf.push_back(' ');
+            buf.append(m.path).push_back('\n');
+        }
+        if (buf.empty())
+            continue;
+        matched++;
+        fw << "FILE: " << queries[i].path << "\n";
+        fw << "HASH: 0x" << std::hex << queries[i].hash << "\n";
+        fw << buf << "\n";
+    }
+    if (conf.stats)
+        spdlog::info("reference: records: {}, queried: {}, matched: {}", store.size(), queries.size(), matched);
     return 0;
 }
 
+// only matches of new files against reference are reported, a reference index is used as it is, a reference
+// folder or binary hash file is built into reference index dir or a temp index removed afterwards
+static int dup_reference_cmd(const dup_config& conf, bool from_hashfile) {
+    bool from_index = scanner_check_is_folder(conf.reference) && store_check(conf.reference);
+    bool ref_hashfile = scanner_check_is_file(conf.reference) && hashfile_check(conf.reference);
+    if (!from_index && !ref_hashfile && !scanner_check_is_folder(conf.reference)) {
+        spdlog::error("reference \"{}\" is not folder, index or binary hash file", conf.reference);
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (from_index && !conf.reference_index.empty()) {
+        spdlog::error("reference \"{}\" is an index already", conf.reference);
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    // init cache db
+    db_cache db(conf.cache_url);
+    if (conf.use_cache) {
+        int rtn = db.init();
+        if(rtn) return rtn;
+    }
+
+    std::string index_path = from_index ? conf.reference : conf.reference_index;
+    bool temp_index = index_path.empty();
+    if (temp_index) {
+        std::string templ = dup_temp_dir(conf) + file_seperator() + "vhash-ref-XXXXXX";
+        std::vector<char> name(templ.begin(), templ.end());
+        name.push_back('\0');
+        if (!mkdtemp(name.data())) {
+            spdlog::error("create temp index under \"{}\" failed", dup_temp_dir(conf));
+            return VERROR(errors::ERR_OPEN_FILE);
+        }
+        index_path = name.data();
+    }
+
+    int rtn = from_index ? 0 : dup_sync_reference(conf, db, index_path);
+    std::vector<dup_query> queries;
+    if (rtn == 0)
+        rtn = dup_collect_queries(conf, db, from_hashfile, queries);
+    if (rtn == 0) {
+        FileWriter fw(conf.output);
+        rtn = dup_query_reference(conf, queries, index_path, fw);
+    }
+    if (temp_index && store_remove(index_path) < 0)
+        spdlog::warn("remove temp index \"{}\" failed", index_path);
+    return rtn;
+}
+
+int dup_cmd(const dup_config& conf) {
+    if (!scanner_check_exists(conf.path)) {
+        spdlog::error("path \"{}\" not exists", conf.path);
+        return VERROR(errors::ERR_NOT_EXISTS);
+    }
+
+    // binary hash file is grouped without hashing
+    bool from_hashfile = scanner_check_is_file(conf.path) && hashfile_check(conf.path);
+    if (!from_hashfile && !scanner_check_is_folder(conf.path)) {
+        spdlog::error("path \"{}\" is not folder or binary hash file", conf.path);
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (from_hashfile && !conf.index.empty()) {
+        spdlog::error("index is updated from folder, not binary hash file");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (conf.tiered && (from_hashfile || !conf.index.empty())) {
+        spdlog::error("tiered hashing is run over folder without index");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (conf.tiered && conf.dihedral) {
+        spdlog::error("cheap hashes of tiered hashing are not tolerant of flips and rotations");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (conf.external && !conf.index.empty()) {
+        spdlog::error("external mode groups files of folder or binary hash file without index");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (from_hashfile && conf.shard_count > 1) {
+        spdlog::error("shard selects files of folder, not binary hash file");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    if (!conf.reference.empty() && (!conf.index.empty() || conf.tiered || conf.external || conf.dirs)) {
+        spdlog::error("reference is matched without index, tiered hashing, external mode or directory groups");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    if (!conf.reference.empty())
+        return dup_reference_cmd(conf, from_hashfile);
+    if (from_hashfile)
+        return dup_hashfiles(conf, {conf.path});
+
+    // init cache db
+    db_cache db(conf.cache_url);
+    if (conf.use_cache) {
+        int rtn = db.init();
+        if(rtn) return rtn;
+    }
+
+    // init output writer
+    FileWriter fw(conf.output);
+
+    // generate file hash
+    app_stats stats;
+    if (!conf.index.empty())
+        return dup_index_cmd(conf, db, stats, fw);
+    return dup_group_files(conf, fw, [&](auto& add) {
+        if (conf.tiered)
+            return dup_tiered_files(conf, db, add);
+        int rtn = app_hash_files(conf, db, stats, [&add](const app_file& file, uint64_t hv) {
+            dup_add_file(add, file, hv);
+        });
+        if (rtn < 0) return rtn;
+        if (conf.stats) app_print_stats(stats);
+        return 0;
+    });
+}
+
 }
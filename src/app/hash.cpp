@@ -15,10 +15,7 @@
 // THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <iostream>
-#include <chrono>
-#include <thread>
 #include "spdlog/spdlog.h"
-#include "tqdm.h"
 #include "vhash_error.h"
 #include "vhash_hash.h"
 #include "vhash_app.h"
@@ -38,8 +35,10 @@ int hash_cmd(const hash_config& conf) {
         return VERROR(errors::ERR_NOT_EXISTS);
     }
 
-    // init output writer
-    FileWriter fw(conf.output);
+    if (conf.format == "bin" && conf.output.empty()) {
+        spdlog::error("bin format needs an output file");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
 
     // init cache db
     db_cache db(conf.cache_url);
@@ -48,75 +47,53 @@ int hash_cmd(const hash_config& conf) {
         if(rtn) return rtn;
     }
 
+    // init output, records are formatted and written by writer thread
+    app_output output(conf.output, conf.format, conf.ordered ? APP_REORDER_WINDOW : 0);
+    if (!output.is_open()) {
+        spdlog::error("open output file \"{}\" failed", conf.output);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+    output.set_shard(conf.shard_index, conf.shard_count);
+    output.set_dihedral(conf.dihedral);
+
     // generate file hash
     if (scanner_check_is_file(conf.path)) {
         FileType ft = app_check_file_type(conf.path);
         if (ft == FileType::TP_OTHER) {
             spdlog::error("file \"{}\" has unknown file type", conf.path);
+            output.close();
             return VERROR(errors::ERR_UNKNOWN_TYPE);
         }
 
         std::mutex db_lock;
-        uint64_t hv = app_get_file_hash(db_lock, db, conf.path, conf.use_cache, ft);
-        fw << "FILE: " << conf.path << "\n";
-        fw << "HASH: 0x" << std::hex << hv << "\n";
+        app_stats stats;
+        Watchdog watchdog(conf.timeout);
+        app_record record{conf.path};
+        record.hv = app_get_file_hash(db_lock, db, conf, watchdog, conf.path, ft, stats, record.failed, record.timeout);
+        int64_t size = 0;
+        scanner_get_file_info(conf.path, size, record.mtime);
+        record.size = static_cast<uint64_t>(size);
+        output.write(0, std::move(record));
     } else {
-        std::vector<std::string> files;
-        set_t black_set;
-        set_t white_set = app_generate_ext_set(conf.ext);
-        scanner scan(conf.path);
-        scan.for_each([&files, &black_set, &white_set](const char *parent, const char *file) -> bool {
-            if (!scanner_ext_filter(black_set, white_set, file))
-                return false;
-
-            std::string file_path = parent;
-            file_path += file_seperator();
-            file_path += file;
-            files.emplace_back(file_path);
-
-            return false; // file has been processed, not add to results
-        }, conf.recursive);
-
-        tqdm bar;
-        bool has_progress = !conf.no_progress && !conf.output.empty();
-
-        std::mutex db_lock;
-        std::mutex fw_lock;
-
-        ThreadPool pool(conf.jobs);
-        std::atomic<int> completed{0};
-        int total = static_cast<int>(files.size());
-        for (auto& file : files) {
-            if (has_progress) bar.progress(completed.load(), total);
-
-            while (pool.idle_count() == 0) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100)); // wait 100ms
+        app_stats stats;
+        int rtn = app_hash_files(conf, db, stats, [&output](const app_file& file, uint64_t hv) {
+            output.write(file.seq, app_record{file.path, hv, file.size, file.mtime, file.failed, file.timeout});
+            for (auto& link : file.links) {
+                output.write(link.seq, app_record{link.path, hv, file.size, file.mtime, file.failed, file.timeout});
             }
-
-            pool.commit([&conf, &db, &file, &fw, &db_lock, &fw_lock, &completed]() {
-                FileType ft = app_check_file_type(file);
-                if (ft == FileType::TP_OTHER) {
-                    completed ++;
-                    return;
-                }
-                uint64_t hv = app_get_file_hash(db_lock, db, file, conf.use_cache, ft);
-
-                {
-                    std::lock_guard<std::mutex> lock(fw_lock);
-                    fw << "FILE: " << file << "\n";
-                    fw << "HASH: 0x" << std::hex << hv << "\n";
-                }
-                completed ++;
-            });
+        });
+        if (rtn < 0) {
+            output.close();
+            return rtn;
         }
-
-        // wait all tasks finished
-        while (completed.load() < total) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100)); // wait 100ms
-        }
-        if (has_progress) bar.finish();
+        if (conf.stats) app_print_stats(stats);
     }
 
+    int rtn = output.close();
+    if (rtn < 0) {
+        spdlog::error("write output file \"{}\" failed", conf.output);
+        return rtn;
+    }
     return 0;
 }
 
@@ -0,0 +1,169 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <vector>
+#include "spdlog/spdlog.h"
+#include "vhash_error.h"
+#include "vhash_app.h"
+#include "internal/app.h"
+#include "internal/cache.h"
+#include "internal/hashfile.h"
+#include "internal/scan.h"
+
+namespace vhash {
+
+// a shard given twice would repeat its files and a missing shard drops them, unsharded inputs are merged as they are,
+// hashes of all inputs are taken in one dihedral mode
+static int merge_check_shards(const std::vector<std::string>& inputs, bool& dihedral) {
+    uint32_t count = 0;
+    std::vector<bool> seen;
+    for (auto& input : inputs) {
+        if (!hashfile_check(input)) {
+            spdlog::error("input \"{}\" is not binary hash file", input);
+            return VERROR(errors::ERR_PARAM_INVALID);
+        }
+        HashFileReader reader(input);
+        if (!reader.is_open()) {
+            spdlog::error("read hash file \"{}\" failed", input);
+            return VERROR(errors::ERR_READ_FILE);
+        }
+        if (&input == &inputs.front())
+            dihedral = reader.dihedral();
+        if (reader.dihedral() != dihedral) {
+            spdlog::error("hash file \"{}\" is hashed {} dihedral mode unlike \"{}\"", input,
+                          reader.dihedral() ? "in" : "without", inputs.front());
+            return VERROR(errors::ERR_PARAM_INVALID);
+        }
+        if (reader.shard_count() == 0)
+            continue;
+        if (count == 0) {
+            count = reader.shard_count();
+            seen.assign(count, false);
+        }
+        if (reader.shard_count() != count || reader.shard_index() >= count) {
+            spdlog::error("shard {}/{} of \"{}\" is not one of {} shards", reader.shard_index(), reader.shard_count(),
+                          input, count);
+            return VERROR(errors::ERR_PARAM_INVALID);
+        }
+        if (seen[reader.shard_index()]) {
+            spdlog::error("shard {}/{} of \"{}\" is given twice", reader.shard_index(), count, input);
+            return VERROR(errors::ERR_PARAM_INVALID);
+        }
+        seen[reader.shard_index()] = true;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (!seen[i])
+            spdlog::warn("shard {}/{} is missing, its files are not merged", i, count);
+    }
+    return 0;
+}
+
+// rows of shard caches are streamed into the merged cache
+static int merge_caches(const merge_config& conf) {
+    db_cache db(conf.cache_url);
+    int rtn = db.init();
+    if (rtn) return rtn;
+    for (auto& file : conf.caches) {
+        if (!scanner_check_is_file(file)) {
+            spdlog::error("cache \"{}\" not exists", file);
+            return VERROR(errors::ERR_NOT_EXISTS);
+        }
+        db_cache shard(file);
+        rtn = shard.init();
+        if (rtn) return rtn;
+        int64_t merged = db.merge(shard);
+        if (merged < 0) {
+            spdlog::error("merge cache \"{}\" failed", file);
+            return static_cast<int>(merged);
+        }
+        if (conf.stats)
+            spdlog::info("cache: merged {} rows of \"{}\"", merged, file);
+    }
+    return 0;
+}
+
+// records of inputs are copied in order into one binary hash file without shard, in dihedral mode of inputs
+static int merge_write_hashfile(const std::vector<std::string>& inputs, const std::string& output, bool dihedral) {
+    HashFileWriter writer(output);
+    if (!writer.is_open()) {
+        spdlog::error("open output file \"{}\" failed", output);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+    writer.set_dihedral(dihedral);
+    int rtn = 0;
+    for (auto& input : inputs) {
+        HashFileReader reader(input);
+        if (!reader.is_open()) {
+            spdlog::error("read hash file \"{}\" failed", input);
+            writer.close();
+            return VERROR(errors::ERR_READ_FILE);
+        }
+        for (auto& r : reader) {
+            rtn = writer.append(r.hash, r.size, r.mtime, reader.path(r), r.flags);
+            if (rtn < 0) break;
+        }
+        if (rtn < 0) break;
+    }
+    int close_rtn = writer.close();
+    if (rtn == 0) rtn = close_rtn;
+    if (rtn < 0)
+        spdlog::error("write output file \"{}\" failed", output);
+    return rtn;
+}
+
+int merge_cmd(const merge_config& conf) {
+    if (conf.inputs.empty() && conf.caches.empty()) {
+        spdlog::error("nothing to merge, binary hash files or caches of shards are needed");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    if (conf.inputs.empty() && !conf.hash_output.empty()) {
+        spdlog::error("hash output is merged from binary hash files");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    bool dihedral = false;
+    if (!conf.inputs.empty()) {
+        int rtn = merge_check_shards(conf.inputs, dihedral);
+        if (rtn < 0) return rtn;
+    }
+    if (!conf.caches.empty()) {
+        int rtn = merge_caches(conf);
+        if (rtn < 0) return rtn;
+    }
+    if (!conf.hash_output.empty()) {
+        int rtn = merge_write_hashfile(conf.inputs, conf.hash_output, dihedral);
+        if (rtn < 0) return rtn;
+    }
+
+    // global duplicate groups, skipped if only merged hash file is asked
+    if (conf.inputs.empty() || (conf.output.empty() && !conf.hash_output.empty()))
+        return 0;
+    dup_config d_conf;
+    d_conf.output = conf.output;
+    d_conf.strategy = conf.strategy;
+    d_conf.temp_dir = conf.temp_dir;
+    d_conf.external_memory = conf.external_memory;
+    d_conf.distance = conf.distance;
+    d_conf.max_diameter = conf.max_diameter;
+    d_conf.dir_similarity = conf.dir_similarity;
+    d_conf.external = conf.external;
+    d_conf.dirs = conf.dirs;
+    d_conf.dihedral = dihedral;
+    d_conf.stats = conf.stats;
+    return dup_hashfiles(d_conf, conf.inputs);
+}
+
+}
@@ -0,0 +1,213 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include "spdlog/spdlog.h"
+#include "vhash_error.h"
+#include "vhash_app.h"
+#include "vhash_index.h"
+#include "internal/app.h"
+#include "internal/cache.h"
+#include "internal/scan.h"
+#include "internal/util.h"
+
+namespace vhash {
+
+// hash value of an input written as 0x prefixed hex, as hash output prints it
+static bool query_parse_hash(const std::string& input, uint64_t& hv) {
+    if (input.size() < 3 || input.size() > 18 || input.compare(0, 2, "0x") != 0)
+        return false;
+    for (size_t i = 2; i < input.size(); i++) {
+        if (!std::isxdigit(static_cast<unsigned char>(input[i])))
+            return false;
+    }
+    hv = std::strtoull(input.c_str() + 2, nullptr, 16);
+    return true;
+}
+
+// non-empty lines of list file or stdin
+static int query_read_list(const std::string& file_path, std::vector<std::string>& inputs) {
+    std::ifstream file;
+    if (file_path != "-") {
+        file.open(file_path);
+        if (!file.is_open()) {
+            spdlog::error("open input list \"{}\" failed", file_path);
+            return VERROR(errors::ERR_OPEN_FILE);
+        }
+    }
+    std::istream& in = file_path == "-" ? std::cin : file;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            inputs.push_back(line);
+    }
+    return 0;
+}
+
+// hash of an existing file, otherwise of a hash value
+static int query_resolve(std::mutex& db_lock, const db_cache& db, const query_config& conf, Watchdog& watchdog,
+                         const std::string& input, uint64_t& hv) {
+    if (scanner_check_is_file(input)) {
+        FileType ft = app_check_file_type(input);
+        if (ft == FileType::TP_OTHER) {
+            spdlog::error("file \"{}\" has unknown file type", input);
+            return VERROR(errors::ERR_UNKNOWN_TYPE);
+        }
+        app_stats stats;
+        bool failed = false, timeout = false;
+        hv = app_get_file_hash(db_lock, db, conf, watchdog, input, ft, stats, failed, timeout);
+        if (timeout)
+            return VERROR(errors::ERR_TIMEOUT);
+        return failed ? VERROR(errors::ERR_READ_FILE) : 0;
+    }
+    if (query_parse_hash(input, hv))
+        return 0;
+    spdlog::error("query \"{}\" is neither a file nor a hash value", input);
+    return VERROR(errors::ERR_NOT_EXISTS);
+}
+
+// QUERY and HASH lines, then a MATCH line of distance, hash and path for each match
+static void query_format_text(const std::string& input, uint64_t hv, int error,
+                              const std::vector<index_match>& matches, std::string& buf) {
+    buf.append("QUERY: ").append(input).push_back('\n');
+    if (error < 0) {
+        buf.append(error == VERROR(errors::ERR_TIMEOUT) ? "STATUS: timeout\n\n" : "STATUS: failed\n\n");
+        return;
+    }
+    buf.append("HASH: ");
+    app_append_hex(hv, buf);
+    buf.push_back('\n');
+    for (auto& m : matches) {
+        buf.append("MATCH: ").append(std::to_string(m.distance)).push_back(' ');
+        app_append_hex(m.hash, buf);
+        buf.push_back(' ');
+        buf.append(m.path).push_back('\n');
+    }
+    buf.push_back('\n');
+}
+
+// one json object per query with its matches
+static void query_format_ndjson(const std::string& input, uint64_t hv, int error,
+                                const std::vector<index_match>& matches, std::string& buf) {
+    buf.append("{\"query\":");
+    app_append_json(input, buf);
+    if (error < 0) {
+        buf.append(",\"error\":").append(std::to_string(error)).append("}\n");
+        return;
+    }
+    buf.append(",\"hash\":\"");
+    app_append_hex(hv, buf);
+    buf.append("\",\"matches\":[");
+    for (size_t i = 0; i < matches.size(); i++) {
+        const index_match& m = matches[i];
+        buf.append(i > 0 ? ",{\"path\":" : "{\"path\":");
+        app_append_json(m.path, buf);
+        buf.append(",\"hash\":\"");
+        app_append_hex(m.hash, buf);
+        buf.append("\",\"distance\":").append(std::to_string(m.distance));
+        buf.append(",\"size\":").append(std::to_string(m.size));
+        buf.append(",\"mtime\":").append(std::to_string(m.mtime)).push_back('}');
+    }
+    buf.append("]}\n");
+}
+
+int query_cmd(const query_config& conf) {
+    if (conf.k == 0 && conf.radius < 0) {
+        spdlog::error("query needs nearest files num or radius");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    std::vector<std::string> inputs = conf.inputs;
+    if (!conf.input_list.empty()) {
+        int rtn = query_read_list(conf.input_list, inputs);
+        if (rtn < 0) return rtn;
+    }
+    if (inputs.empty()) {
+        spdlog::error("query has no input");
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+
+    // files of the index hashed in the other dihedral mode are not matched
+    hash_index index(conf.index, conf.dihedral);
+    if (!index.is_open()) {
+        spdlog::error("open index \"{}\" failed", conf.index);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+
+    // init cache db
+    db_cache db(conf.cache_url);
+    if (conf.use_cache) {
+        int rtn = db.init();
+        if(rtn) return rtn;
+    }
+
+    FileWriter fw(conf.output);
+    if (!conf.output.empty() && !fw.is_open()) {
+        spdlog::error("open output file \"{}\" failed", conf.output);
+        return VERROR(errors::ERR_OPEN_FILE);
+    }
+
+    // hash inputs in parallel, hash values are taken as they are
+    std::vector<uint64_t> hvs(inputs.size(), 0);
+    std::vector<int> status(inputs.size(), 0);
+    {
+        std::mutex db_lock;
+        Watchdog watchdog(conf.timeout);
+        ThreadPool pool(static_cast<size_t>(conf.jobs));
+        std::vector<std::future<int>> futures;
+        futures.reserve(inputs.size());
+        for (size_t i = 0; i < inputs.size(); i++) {
+            futures.push_back(pool.commit([&, i] {
+                return query_resolve(db_lock, db, conf, watchdog, inputs[i], hvs[i]);
+            }));
+        }
+        for (size_t i = 0; i < inputs.size(); i++)
+            status[i] = futures[i].get();
+    }
+
+    std::vector<uint64_t> queries;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (status[i] == 0)
+            queries.push_back(hvs[i]);
+    }
+    std::vector<std::vector<index_match>> results;
+    int radius = conf.radius < 0 ? 64 : conf.radius;
+    int rtn = index.query(queries, static_cast<size_t>(conf.k), radius, results, conf.jobs);
+    if (rtn < 0) {
+        spdlog::error("query index \"{}\" failed", conf.index);
+        return rtn;
+    }
+
+    // results in input order
+    std::string buf;
+    std::vector<index_match> none;
+    for (size_t i = 0, q = 0; i < inputs.size(); i++) {
+        const std::vector<index_match>& matches = status[i] == 0 ? results[q++] : none;
+        if (conf.format == "ndjson")
+            query_format_ndjson(inputs[i], hvs[i], status[i], matches, buf);
+        else
+            query_format_text(inputs[i], hvs[i], status[i], matches, buf);
+        fw << buf;
+        buf.clear();
+    }
+    return 0;
+}
+
+}
@@ -26,6 +26,9 @@ namespace vhash {
 
 using namespace sqlite_orm;
 
+// rows of a merge committed in one transaction
+static const int64_t CACHE_MERGE_BATCH = 4096;
+
 db_cache::db_cache(const std::string& db_file): db_file(db_file), storage(nullptr) {
     if (db_file.empty()) {
         std::string s = scanner_get_home();
@@ -112,4 +115,34 @@ int db_cache::pure(int64_t period) const {
     }
 }
 
+int64_t db_cache::merge(const db_cache& other) const {
+    // rows of other cache are streamed, writes are committed in batches
+    int64_t merged = 0;
+    int64_t pending = 0;
+    try {
+        storage->begin_transaction();
+        for (auto& item : other.storage->iterate<cache_item>()) {
+            auto current = storage->get_pointer<cache_item>(item.parent, item.file);
+            if (current && current->rec_update_ts > item.rec_update_ts)
+                continue;
+            storage->replace(item);
+            merged++;
+            if (++pending == CACHE_MERGE_BATCH) {
+                storage->commit();
+                storage->begin_transaction();
+                pending = 0;
+            }
+        }
+        storage->commit();
+        return merged;
+    } catch (std::system_error& e) {
+        spdlog::error("merge db records with exception: {}", e.what());
+        try {
+            storage->rollback();
+        } catch (std::system_error&) {
+        }
+        return VERROR(errors::ERR_INSERT_DB);
+    }
+}
+
 }
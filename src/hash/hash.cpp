@@ -19,24 +19,34 @@
 
 namespace vhash {
 
+// seconds between video thumbs of reduced hasher
+constexpr double HASH_REDUCED_VIDEO_RATE = 8.0;
+
+// side of video thumbs of reduced hasher
+constexpr int HASH_REDUCED_VIDEO_SIDE = 32;
+
 /**
  * hasher implement
  */
 class hasher::hashimpl {
 public:
-    explicit hashimpl(FileType ft=FileType::TP_IMAGE, HashType ht=HashType::TP_WHASH): dch(0), ft(ft) {
+    explicit hashimpl(FileType ft=FileType::TP_IMAGE, HashType ht=HashType::TP_WHASH, bool reduced=false,
+                      bool dihedral=false):
+        dch(0), ft(ft), flags(reduced ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_GRAYSCALE) {
+        // flips of a video collage also reorder its thumbs, so only images are hashed by canonical variant
+        bool canonical = dihedral && ft == FileType::TP_IMAGE;
         switch (ht) {
             case HashType::TP_AHASH:
                 h = new ahash<8>;
                 break;
             case HashType::TP_PHASH:
-                h = new phash<8>;
+                h = new phash<8>(4, canonical);
                 break;
             case HashType::TP_DHASH:
                 h = new dhash<8>;
                 break;
             case HashType::TP_WHASH:
-                h = new whash<8>;
+                h = new whash<8>("haar", 0, true, canonical);
                 break;
             default:
                 break;
@@ -48,7 +58,11 @@ public:
     }
 
     int load(const std::string& file_path) {
-        return h->load(file_path);
+        return h->load(file_path, flags);
+    }
+
+    int load(const std::vector<uint8_t>& data) {
+        return h->load(data, flags);
     }
 
     int load(const cv::Mat& mat) {
@@ -72,16 +86,19 @@ private:
     imagehash<8> *h;         /* main hash */
     uint64_t dch;            /* domain color hash */
     FileType ft;             /* file type */
+    int flags;               /* image decode flags */
 };
 
 /**
  * Hasher
  */
-hasher::hasher(FileType ft, HashType ht): ft(ft), ht(ht) {
-    impl = new hasher::hashimpl(ft, ht);
+hasher::hasher(FileType ft, HashType ht, bool reduced, bool dihedral):
+    ft(ft), ht(ht), reduced(reduced), dihedral(dihedral) {
+    impl = new hasher::hashimpl(ft, ht, reduced, dihedral);
 }
 
-hasher::hasher(hasher&& other) noexcept: ft(other.ft), ht(other.ht), impl(nullptr) {
+hasher::hasher(hasher&& other) noexcept:
+    ft(other.ft), ht(other.ht), reduced(other.reduced), dihedral(other.dihedral), impl(nullptr) {
     *this = std::move(other);
 }
 
@@ -95,6 +112,8 @@ hasher& hasher::operator=(hasher&& other) noexcept {
         delete impl;
         ht = other.ht;
         ft = other.ft;
+        reduced = other.reduced;
+        dihedral = other.dihedral;
         impl = other.impl;
         other.impl = nullptr;
     }
@@ -105,17 +124,31 @@ int hasher::load(const std::string& file_path) {
     if (ft == FileType::TP_IMAGE)
         return impl->load(file_path);
     else if (ft == FileType::TP_VIDEO) {
-        auto images = vhash::video_make_thumb(file_path);
+        auto images = reduced ?
+                vhash::video_make_thumb(file_path, HASH_REDUCED_VIDEO_RATE, HASH_REDUCED_VIDEO_SIDE, HASH_REDUCED_VIDEO_SIDE) :
+                vhash::video_make_thumb(file_path);
+        DecodeBudget *budget = DecodeBudget::current();
+        if (budget && budget->expired()) {
+            return VERROR(errors::ERR_TIMEOUT);
+        }
         if (images.empty()) {
             return VERROR(errors::ERR_MAKE_THUMB);
         }
         auto image = vhash::video_make_collage(images);
-        impl->load(images);
+        // dominant color of few thumbs is not worth a cheap hash
+        if (!reduced)
+            impl->load(images);
         return impl->load(image);
     }
     return 0;
 }
 
+int hasher::load(const std::vector<uint8_t>& data) {
+    if (ft == FileType::TP_IMAGE)
+        return impl->load(data);
+    return VERROR(errors::ERR_UNKNOWN_TYPE);
+}
+
 uint64_t hasher::hash() {
     return impl->hash();
 }
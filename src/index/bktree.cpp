@@ -0,0 +1,99 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include "internal/index.h"
+
+namespace vhash {
+
+// each node partitions the hashes below it by distance to its own hash, non-empty partitions become
+// its children and are expanded in turn, so every level costs one pass of popcounts. Partitions small
+// enough stay as flat leaves, the partition of distance 0 is the node's duplicate list
+void BKTree::build(const std::vector<uint64_t>& hashes) {
+    nodes.clear();
+    leaf_hashes.clear();
+    leaf_ids.clear();
+    dup_ids.clear();
+    if (hashes.empty())
+        return;
+    nodes.reserve(hashes.size() / BKTREE_LEAF_SIZE * 2 + 1);
+    leaf_hashes.reserve(hashes.size());
+    leaf_ids.reserve(hashes.size());
+
+    std::vector<uint32_t> ids(hashes.size());
+    std::iota(ids.begin(), ids.end(), 0);
+    std::vector<uint32_t> scratch(hashes.size());
+    std::vector<uint8_t> dists(hashes.size());
+
+    struct task {
+        uint32_t node;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<task> tasks;
+    nodes.push_back(node{hashes[0], 0, 0, 0, 0, 0, 0, 0, 0});
+    tasks.push_back(task{0, 1, ids.size()});
+
+    while (!tasks.empty()) {
+        task t = tasks.back();
+        tasks.pop_back();
+        nodes[t.node].child_begin = static_cast<uint32_t>(nodes.size());
+        if (t.end - t.begin <= BKTREE_LEAF_SIZE) {
+            nodes[t.node].leaf_begin = static_cast<uint32_t>(leaf_ids.size());
+            nodes[t.node].leaf_count = static_cast<uint8_t>(t.end - t.begin);
+            for (size_t i = t.begin; i < t.end; i++) {
+                leaf_hashes.push_back(hashes[ids[i]]);
+                leaf_ids.push_back(ids[i]);
+            }
+            continue;
+        }
+
+        // counting sort of hashes by distance to node
+        uint64_t hv = nodes[t.node].hash;
+        size_t count[66] = {0};
+        for (size_t i = t.begin; i < t.end; i++) {
+            dists[i] = static_cast<uint8_t>(hamming_distance(hv, hashes[ids[i]]));
+            count[dists[i] + 1]++;
+        }
+        for (int d = 0; d < 65; d++)
+            count[d + 1] += count[d];
+        size_t offset[65];
+        std::copy(count, count + 65, offset);
+        for (size_t i = t.begin; i < t.end; i++)
+            scratch[t.begin + offset[dists[i]]++] = ids[i];
+        std::copy(scratch.begin() + t.begin, scratch.begin() + t.end, ids.begin() + t.begin);
+
+        // copies of node's hash have nothing to partition by
+        nodes[t.node].dup_begin = static_cast<uint32_t>(dup_ids.size());
+        nodes[t.node].dup_count = static_cast<uint32_t>(count[1]);
+        dup_ids.insert(dup_ids.end(), ids.begin() + t.begin, ids.begin() + t.begin + count[1]);
+
+        // first hash of each partition is its child
+        uint8_t children = 0;
+        for (int d = 1; d < 65; d++) {
+            size_t begin = t.begin + count[d];
+            size_t end = t.begin + count[d + 1];
+            if (begin == end)
+                continue;
+            auto child = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(node{hashes[ids[begin]], ids[begin], 0, 0, 0, 0, 0, 0, static_cast<uint8_t>(d)});
+            tasks.push_back(task{child, begin + 1, end});
+            children++;
+        }
+        nodes[t.node].child_count = children;
+    }
+}
+
+}
@@ -0,0 +1,285 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cstring>
+#include <tuple>
+#include <unordered_set>
+#include "internal/index.h"
+#include "internal/scan.h"
+
+namespace vhash {
+
+constexpr uint32_t DirGroups::DIR_NONE;
+constexpr uint64_t DIR_SUM_SEEDS[2] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL};
+// FNV-1a of names of failed files, apart from file hashes by a seed
+constexpr uint64_t DIR_NAME_FNV_BASIS = 0xcbf29ce484222325ULL;
+constexpr uint64_t DIR_NAME_FNV_PRIME = 0x100000001b3ULL;
+constexpr uint64_t DIR_FAILED_SEED = 0x165667b19e3779f9ULL;
+
+// splitmix64 finalizer, file hashes of near images share most bits and are spread before summing
+static inline uint64_t dir_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// parent directory of dir, empty for top directories
+static std::string dir_parent(const std::string& dir) {
+    std::string::size_type pos = dir.find_last_of(file_seperator());
+    if (pos == std::string::npos || dir.size() == 1)
+        return std::string();
+    return pos == 0 ? dir.substr(0, 1) : dir.substr(0, pos);
+}
+
+// directory and its missing ancestors are created top down, so a parent id is below ids of its children
+uint32_t DirGroups::node_of(const std::string& dir) {
+    auto it = ids.find(dir);
+    if (it != ids.end())
+        return it->second;
+
+    std::vector<std::string> missing{dir};
+    uint32_t parent = DIR_NONE;
+    while (true) {
+        std::string up = dir_parent(missing.back());
+        if (up.empty())
+            break;
+        it = ids.find(up);
+        if (it != ids.end()) {
+            parent = it->second;
+            break;
+        }
+        missing.push_back(std::move(up));
+    }
+    for (auto m = missing.rbegin(); m != missing.rend(); ++m) {
+        auto id = static_cast<uint32_t>(nodes.size());
+        auto inserted = ids.emplace(std::move(*m), id).first;
+        paths.push_back(&inserted->first);
+        nodes.emplace_back();
+        nodes[id].parent = parent;
+        if (parent != DIR_NONE) {
+            nodes[id].depth = nodes[parent].depth + 1;
+            nodes[parent].children++;
+        }
+        if (similarity > 0)
+            minhash.resize(minhash.size() + DIR_MINHASH_SLOTS, UINT32_MAX);
+        parent = id;
+    }
+    return parent;
+}
+
+// directory of path, "." if it has none
+static std::string dir_of(const char *path, const char *& name) {
+    const char *sep = strrchr(path, file_seperator());
+    name = sep ? sep + 1 : path;
+    return !sep ? std::string(".") : sep == path ? std::string(1, *sep) : std::string(path, sep);
+}
+
+void DirGroups::add(uint64_t hv, const char *path) {
+    const char *name = nullptr;
+    uint32_t n = node_of(dir_of(path, name));
+    file_dirs.push_back(n);
+    aggregate(n, hv);
+}
+
+void DirGroups::add_failed(const char *path) {
+    const char *name = nullptr;
+    uint32_t n = node_of(dir_of(path, name));
+    uint64_t h = DIR_NAME_FNV_BASIS;
+    for (; *name; name++)
+        h = (h ^ static_cast<unsigned char>(*name)) * DIR_NAME_FNV_PRIME;
+    aggregate(n, h ^ DIR_FAILED_SEED);
+}
+
+void DirGroups::aggregate(uint32_t n, uint64_t hv) {
+    node& d = nodes[n];
+    d.direct++;
+    d.files++;
+    d.sum[0] += dir_mix(hv ^ DIR_SUM_SEEDS[0]);
+    d.sum[1] += dir_mix(hv ^ DIR_SUM_SEEDS[1]);
+    if (similarity > 0) {
+        uint32_t *mh = minhash.data() + static_cast<size_t>(n) * DIR_MINHASH_SLOTS;
+        for (size_t k = 0; k < DIR_MINHASH_SLOTS; k++)
+            mh[k] = std::min(mh[k], static_cast<uint32_t>(dir_mix(hv + (k + 1) * DIR_SUM_SEEDS[0]) >> 32));
+    }
+}
+
+bool DirGroups::ancestor(uint32_t a, uint32_t b) const {
+    while (b != DIR_NONE && nodes[b].depth > nodes[a].depth)
+        b = nodes[b].parent;
+    return a == b;
+}
+
+void DirGroups::build() {
+    // children are folded into parents, ids of children are above ids of parents
+    for (size_t i = nodes.size(); i-- > 0;) {
+        uint32_t p = nodes[i].parent;
+        if (p == DIR_NONE)
+            continue;
+        nodes[p].files += nodes[i].files;
+        nodes[p].sum[0] += nodes[i].sum[0];
+        nodes[p].sum[1] += nodes[i].sum[1];
+        if (similarity > 0) {
+            uint32_t *mp = minhash.data() + static_cast<size_t>(p) * DIR_MINHASH_SLOTS;
+            const uint32_t *mi = minhash.data() + i * DIR_MINHASH_SLOTS;
+            for (size_t k = 0; k < DIR_MINHASH_SLOTS; k++)
+                mp[k] = std::min(mp[k], mi[k]);
+        }
+    }
+    find_exact();
+    if (similarity > 0)
+        find_similar();
+}
+
+void DirGroups::find_exact() {
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].files >= DIR_MIN_FILES && !wrapper(i))
+            order.push_back(i);
+    }
+    auto key = [this](uint32_t i) {
+        return std::make_tuple(nodes[i].sum[0], nodes[i].sum[1], nodes[i].files);
+    };
+    std::sort(order.begin(), order.end(), [&key](uint32_t a, uint32_t b) {
+        return key(a) < key(b) || (key(a) == key(b) && a < b);
+    });
+
+    std::vector<exact_group> runs;
+    for (size_t i = 0, j; i < order.size(); i = j) {
+        for (j = i + 1; j < order.size() && key(order[j]) == key(order[i]); j++) {}
+        if (j - i < 2)
+            continue;
+        auto g = static_cast<uint32_t>(runs.size());
+        runs.push_back({nodes[order[i]].sum[0], std::vector<uint32_t>(order.begin() + i, order.begin() + j)});
+        for (size_t k = i; k < j; k++)
+            nodes[order[k]].group = g;
+    }
+
+    // owners are passed down, parents come first
+    for (auto& n : nodes) {
+        if (n.group != DIR_NONE)
+            n.owner = n.group;
+        else if (n.parent != DIR_NONE)
+            n.owner = nodes[n.parent].owner;
+    }
+
+    // members in copies of one duplicated directory are implied by its group
+    for (auto& run : runs) {
+        uint32_t owner = DIR_NONE;
+        bool implied = true;
+        for (auto d : run.dirs) {
+            uint32_t p = nodes[d].parent;
+            uint32_t o = p == DIR_NONE ? DIR_NONE : nodes[p].owner;
+            if (o == DIR_NONE || (owner != DIR_NONE && o != owner)) {
+                implied = false;
+                break;
+            }
+            owner = o;
+        }
+        if (implied)
+            continue;
+        std::sort(run.dirs.begin(), run.dirs.end(), [this](uint32_t a, uint32_t b) {
+            return *paths[a] < *paths[b];
+        });
+        groups.push_back(std::move(run));
+    }
+    std::sort(groups.begin(), groups.end(), [this](const exact_group& a, const exact_group& b) {
+        uint32_t fa = nodes[a.dirs[0]].files, fb = nodes[b.dirs[0]].files;
+        return fa > fb || (fa == fb && *paths[a.dirs[0]] < *paths[b.dirs[0]]);
+    });
+}
+
+void DirGroups::find_similar() {
+    // tops of duplicated trees stand for their copies, one member per exact group
+    std::vector<uint32_t> candidates;
+    std::unordered_set<uint32_t> seen_groups;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        const node& n = nodes[i];
+        if (n.files < DIR_MIN_FILES || wrapper(i))
+            continue;
+        if (n.parent != DIR_NONE && nodes[n.parent].owner != DIR_NONE)
+            continue;
+        if (n.group != DIR_NONE && !seen_groups.insert(n.group).second)
+            continue;
+        candidates.push_back(i);
+    }
+
+    // directories sharing all rows of a band are candidate pairs
+    std::unordered_set<uint64_t> tested;
+    std::vector<std::pair<uint64_t, uint32_t>> band;
+    std::vector<similar_pair> found;
+    for (size_t b = 0; b < DIR_MINHASH_SLOTS; b += DIR_MINHASH_ROWS) {
+        band.clear();
+        for (auto c : candidates) {
+            const uint32_t *mh = minhash.data() + static_cast<size_t>(c) * DIR_MINHASH_SLOTS + b;
+            uint64_t h = b;
+            for (size_t r = 0; r < DIR_MINHASH_ROWS; r++)
+                h = dir_mix(h ^ mh[r]);
+            band.emplace_back(h, c);
+        }
+        std::sort(band.begin(), band.end());
+        for (size_t i = 0, j; i < band.size(); i = j) {
+            for (j = i + 1; j < band.size() && band[j].first == band[i].first; j++) {}
+            if (j - i < 2 || j - i > DIR_BUCKET_LIMIT)
+                continue;
+            for (size_t x = i; x < j; x++) {
+                for (size_t y = x + 1; y < j; y++) {
+                    uint32_t a = std::min(band[x].second, band[y].second);
+                    uint32_t c = std::max(band[x].second, band[y].second);
+                    if (!tested.insert(static_cast<uint64_t>(a) << 32 | c).second)
+                        continue;
+                    // a directory is similar to its sub directory holding most of its files
+                    if (ancestor(a, c) || ancestor(c, a))
+                        continue;
+                    const uint32_t *ma = minhash.data() + static_cast<size_t>(a) * DIR_MINHASH_SLOTS;
+                    const uint32_t *mc = minhash.data() + static_cast<size_t>(c) * DIR_MINHASH_SLOTS;
+                    size_t equal = 0;
+                    for (size_t k = 0; k < DIR_MINHASH_SLOTS; k++)
+                        equal += ma[k] == mc[k];
+                    double s = static_cast<double>(equal) / DIR_MINHASH_SLOTS;
+                    if (s >= similarity)
+                        found.push_back({s, a, c});
+                }
+            }
+        }
+    }
+
+    // pairs of sub directories of a similar pair are implied by it, shallower pairs come first
+    std::sort(found.begin(), found.end(), [this](const similar_pair& x, const similar_pair& y) {
+        return nodes[x.a].depth + nodes[x.b].depth < nodes[y.a].depth + nodes[y.b].depth;
+    });
+    std::unordered_set<uint64_t> reported;
+    auto up = [this](uint32_t n) {
+        n = nodes[n].parent;
+        while (n != DIR_NONE && wrapper(n))
+            n = nodes[n].parent;
+        return n;
+    };
+    for (auto& p : found) {
+        reported.insert(static_cast<uint64_t>(p.a) << 32 | p.b);
+        uint32_t pa = up(p.a), pb = up(p.b);
+        if (pa != DIR_NONE && pb != DIR_NONE &&
+            reported.count(static_cast<uint64_t>(std::min(pa, pb)) << 32 | std::max(pa, pb)))
+            continue;
+        pairs.push_back(p);
+        if (*paths[p.b] < *paths[p.a])
+            std::swap(pairs.back().a, pairs.back().b);
+    }
+    std::sort(pairs.begin(), pairs.end(), [this](const similar_pair& x, const similar_pair& y) {
+        return x.similarity > y.similarity || (x.similarity == y.similarity && *paths[x.a] < *paths[y.a]);
+    });
+}
+
+}
@@ -0,0 +1,528 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cstring>
+#include <fcntl.h>
+#include <queue>
+#include <unistd.h>
+#include "spdlog/spdlog.h"
+#include "vhash_error.h"
+#include "internal/external.h"
+#include "internal/index.h"
+#include "internal/scan.h"
+
+namespace vhash {
+
+// unique hashes of a bucket compared pair by pair, larger buckets are searched with multi-index hashing
+static const size_t EXTERNAL_SCAN_HASHES = 2048;
+
+/**
+ * Sequential reader of a run, one block is buffered
+ */
+class ExternalRunReader {
+public:
+    ExternalRunReader(const std::string& path, size_t block): buf(std::max<size_t>(1, block / sizeof(external_record))) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        else
+            error = VERROR(errors::ERR_OPEN_FILE);
+    }
+    ExternalRunReader(const ExternalRunReader& other) = delete;
+    ~ExternalRunReader() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // false at end of run or on error
+    bool next(external_record& record) {
+        if (pos == len && !fill())
+            return false;
+        record = buf[pos++];
+        return true;
+    }
+
+    int error = 0;
+
+private:
+    bool fill() {
+        if (fd < 0)
+            return false;
+        auto data = reinterpret_cast<char *>(buf.data());
+        size_t bytes = 0, size = buf.size() * sizeof(external_record);
+        while (bytes < size) {
+            ssize_t n = read(fd, data + bytes, size - bytes);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                error = VERROR(errors::ERR_READ_FILE);
+                return false;
+            }
+            if (n == 0)
+                break;
+            bytes += static_cast<size_t>(n);
+        }
+        pos = 0;
+        len = bytes / sizeof(external_record);
+        return len > 0;
+    }
+
+    int fd = -1;
+    std::vector<external_record> buf;
+    size_t pos = 0;
+    size_t len = 0;
+};
+
+/**
+ * Sequential writer of a run, one block is buffered
+ */
+class ExternalRunWriter {
+public:
+    ExternalRunWriter(const std::string& path, size_t block) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            error = VERROR(errors::ERR_OPEN_FILE);
+        buf.reserve(std::max<size_t>(1, block / sizeof(external_record)));
+    }
+    ExternalRunWriter(const ExternalRunWriter& other) = delete;
+    ~ExternalRunWriter() {
+        close();
+    }
+
+    int append(const external_record& record) {
+        buf.push_back(record);
+        if (buf.size() == buf.capacity())
+            flush();
+        return error;
+    }
+
+    int close() {
+        if (fd < 0)
+            return error;
+        flush();
+        ::close(fd);
+        fd = -1;
+        return error;
+    }
+
+    uint64_t bytes = 0;
+    int error = 0;
+
+private:
+    void flush() {
+        if (error == 0 && !buf.empty()) {
+            error = file_write_all(fd, reinterpret_cast<const char *>(buf.data()), buf.size() * sizeof(external_record));
+            bytes += buf.size() * sizeof(external_record);
+        }
+        buf.clear();
+    }
+
+    int fd = -1;
+    std::vector<external_record> buf;
+};
+
+ExternalGroups::ExternalGroups(const std::string& dir, uint64_t memory) {
+    memory = std::max(memory, EXTERNAL_MIN_MEMORY);
+    block = static_cast<size_t>(std::min<uint64_t>(EXTERNAL_BLOCK_SIZE, std::max<uint64_t>(EXTERNAL_MIN_BLOCK, memory / 16)));
+    fan_in = std::max<size_t>(2, memory / block);
+    capacity = std::max<size_t>(1, (memory - block) / 2 / sizeof(external_record));
+
+    std::string name = dir + file_seperator() + "vhash_external_XXXXXX";
+    if (!mkdtemp(&name[0])) {
+        spdlog::error("create temp folder under \"{}\" failed", dir);
+        error = VERROR(errors::ERR_MK_DIR);
+        return;
+    }
+    this->dir = name;
+    paths_fd = open((name + file_seperator() + "paths").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (paths_fd < 0) {
+        error = VERROR(errors::ERR_OPEN_FILE);
+        return;
+    }
+    records.reserve(capacity);
+}
+
+ExternalGroups::~ExternalGroups() {
+    if (paths_fd >= 0)
+        close(paths_fd);
+    if (dir.empty())
+        return;
+    for (auto& run : base)
+        unlink(run.c_str());
+    unlink((dir + file_seperator() + "paths").c_str());
+    rmdir(dir.c_str());
+}
+
+bool ExternalGroups::is_open() const {
+    return paths_fd >= 0 && error == 0;
+}
+
+int ExternalGroups::add(uint64_t hv, const char *path, size_t len) {
+    if (!is_open())
+        return error ? error : VERROR(errors::ERR_OPEN_FILE);
+    if (len >> EXTERNAL_PATH_LEN_BITS) {
+        spdlog::error("path \"{}\" is too long", std::string(path, len));
+        return VERROR(errors::ERR_PARAM_INVALID);
+    }
+    records.push_back({hv, (paths_size + paths.size()) << EXTERNAL_PATH_LEN_BITS | len});
+    paths.append(path, len);
+    count++;
+    if (paths.size() >= block)
+        error = flush_paths();
+    if (error == 0 && records.size() >= capacity)
+        error = flush_records(band{0, 64, ~0ULL}, base);
+    return error;
+}
+
+int ExternalGroups::flush_paths() {
+    if (paths.empty())
+        return 0;
+    int rtn = file_write_all(paths_fd, paths.data(), paths.size());
+    paths_size += paths.size();
+    spilled_bytes += paths.size();
+    paths.clear();
+    return rtn;
+}
+
+int ExternalGroups::flush_records(const band& b, std::vector<std::string>& out) {
+    if (records.empty())
+        return 0;
+    index_radix_sort(records, scratch, b.bits, [&b](const external_record& r) { return b.key(r.hash); }, pool);
+    int rtn = write_run(records, out);
+    records.clear();
+    return rtn;
+}
+
+int ExternalGroups::write_run(const std::vector<external_record>& run, std::vector<std::string>& out) {
+    out.push_back(dir + file_seperator() + "run_" + std::to_string(run_seq++));
+    int fd = open(out.back().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return VERROR(errors::ERR_OPEN_FILE);
+    size_t bytes = run.size() * sizeof(external_record);
+    int rtn = file_write_all(fd, reinterpret_cast<const char *>(run.data()), bytes);
+    close(fd);
+    runs_num++;
+    spilled_bytes += bytes;
+    return rtn;
+}
+
+// runs of added records are read in order and cut into runs sorted by band
+int ExternalGroups::sort_runs(const band& b, std::vector<std::string>& out) {
+    records.reserve(capacity);
+    for (auto& run : base) {
+        ExternalRunReader reader(run, block);
+        external_record record = {};
+        while (reader.next(record)) {
+            records.push_back(record);
+            if (records.size() >= capacity) {
+                int rtn = flush_records(b, out);
+                if (rtn < 0) return rtn;
+            }
+        }
+        if (reader.error < 0)
+            return reader.error;
+    }
+    return flush_records(b, out);
+}
+
+// runs are merged fan_in at a time until one merge of all is left, it calls f with every record.
+// Runs of earlier passes and runs not in base are removed once merged
+int ExternalGroups::merge(const band& b, std::vector<std::string> in, const record_fn& f) {
+    auto owned = [this](const std::string& run) {
+        return std::find(base.begin(), base.end(), run) == base.end();
+    };
+    passes_num = 1;
+    while (in.size() > fan_in) {
+        std::vector<std::string> next;
+        for (size_t first = 0; first < in.size(); first += fan_in) {
+            size_t last = std::min(in.size(), first + fan_in);
+            if (last - first == 1) {
+                next.push_back(in[first]);
+                continue;
+            }
+            next.push_back(dir + file_seperator() + "run_" + std::to_string(run_seq++));
+            ExternalRunWriter writer(next.back(), block);
+            int rtn = merge_runs(b, in, first, last, [&writer](const external_record& record) {
+                return writer.append(record);
+            });
+            if (rtn == 0)
+                rtn = writer.close();
+            runs_num++;
+            spilled_bytes += writer.bytes;
+            for (size_t r = first; r < last; r++) {
+                if (owned(in[r]))
+                    unlink(in[r].c_str());
+            }
+            if (rtn < 0) {
+                for (size_t r = last; r < in.size(); r++) {
+                    if (owned(in[r]))
+                        unlink(in[r].c_str());
+                }
+                for (auto& run : next)
+                    unlink(run.c_str());
+                return rtn;
+            }
+        }
+        in.swap(next);
+        passes_num++;
+    }
+    int rtn = merge_runs(b, in, 0, in.size(), f);
+    for (auto& run : in) {
+        if (owned(run))
+            unlink(run.c_str());
+    }
+    return rtn;
+}
+
+// k-way merge by band key, equal keys come in run order so merges are stable
+int ExternalGroups::merge_runs(const band& b, const std::vector<std::string>& in, size_t first, size_t last,
+                               const record_fn& f) {
+    std::vector<std::unique_ptr<ExternalRunReader>> readers;
+    std::vector<external_record> heads(last - first);
+    using item = std::pair<uint64_t, size_t>;
+    std::priority_queue<item, std::vector<item>, std::greater<item>> heap;
+    for (size_t r = first; r < last; r++) {
+        readers.emplace_back(new ExternalRunReader(in[r], block));
+        if (readers.back()->error < 0)
+            return readers.back()->error;
+        if (readers.back()->next(heads[r - first]))
+            heap.emplace(b.key(heads[r - first].hash), r - first);
+    }
+    while (!heap.empty()) {
+        size_t r = heap.top().second;
+        heap.pop();
+        int rtn = f(heads[r]);
+        if (rtn < 0)
+            return rtn;
+        if (readers[r]->next(heads[r]))
+            heap.emplace(b.key(heads[r].hash), r);
+    }
+    for (auto& reader : readers) {
+        if (reader->error < 0)
+            return reader->error;
+    }
+    return 0;
+}
+
+int ExternalGroups::read_path(uint64_t path, std::string& out) const {
+    out.resize(path & ((1ULL << EXTERNAL_PATH_LEN_BITS) - 1));
+    auto offset = static_cast<off_t>(path >> EXTERNAL_PATH_LEN_BITS);
+    if (pread(paths_fd, &out[0], out.size(), offset) != static_cast<ssize_t>(out.size()))
+        return VERROR(errors::ERR_READ_FILE);
+    return 0;
+}
+
+// unique hashes of bucket are linked by pairs within distance whose first equal band is b, groups of band 0 include
+// files of one hash, later bands only report groups they linked
+int ExternalGroups::group_bucket(const std::vector<band>& bands, size_t b, std::vector<external_record>& bucket,
+                                 int distance, int diameter, const group_fn& f) {
+    if (bucket.size() < 2)
+        return 0;
+    std::stable_sort(bucket.begin(), bucket.end(), [](const external_record& x, const external_record& y) {
+        return x.hash < y.hash;
+    });
+    std::vector<uint64_t> hashes;
+    std::vector<size_t> starts;
+    for (size_t i = 0; i < bucket.size(); i++) {
+        if (i == 0 || bucket[i].hash != bucket[i - 1].hash) {
+            hashes.push_back(bucket[i].hash);
+            starts.push_back(i);
+        }
+    }
+    starts.push_back(bucket.size());
+    if (b > 0 && hashes.size() < 2)
+        return 0;
+
+    DisjointSet set(hashes.size());
+    if (distance > 0 && hashes.size() > 1) {
+        auto link = [&](uint32_t i, uint32_t j) {
+            uint64_t x = hashes[i] ^ hashes[j];
+            for (size_t p = 0; p < b; p++) {
+                if (bands[p].key(x) == 0)
+                    return;
+            }
+            if (diameter > 0)
+                set.unite_within(i, j, hashes.data(), diameter);
+            else
+                set.unite(i, j);
+        };
+        auto n = static_cast<uint32_t>(hashes.size());
+        if (hashes.size() <= EXTERNAL_SCAN_HASHES) {
+            for (uint32_t i = 0; i < n; i++) {
+                for (uint32_t j = i + 1; j < n; j++) {
+                    if (hamming_distance(hashes[i], hashes[j]) <= distance)
+                        link(i, j);
+                }
+            }
+        } else {
+            MIHIndex index(hashes, distance);
+            for (uint32_t i = 0; i < n; i++) {
+                index.radius(hashes[i], distance, [&](uint32_t j, int) {
+                    if (j > i)
+                        link(i, j);
+                });
+            }
+        }
+    }
+
+    // members of each root in hash order, root is the first member
+    std::vector<std::pair<uint32_t, uint32_t>> members(hashes.size());
+    for (uint32_t i = 0; i < members.size(); i++)
+        members[i] = {set.find(i), i};
+    std::sort(members.begin(), members.end());
+    std::vector<std::string> paths;
+    for (size_t g = 0, k; g < members.size(); g = k) {
+        for (k = g + 1; k < members.size() && members[k].first == members[g].first; k++) {}
+        if (b > 0 && k - g < 2)
+            continue;
+        size_t first = starts[members[g].second];
+        if (k - g < 2 && starts[members[g].second + 1] - first < 2)
+            continue;
+        paths.clear();
+        for (size_t m = g; m < k; m++) {
+            for (size_t i = starts[members[m].second]; i < starts[members[m].second + 1]; i++) {
+                paths.emplace_back();
+                int rtn = read_path(bucket[i].path, paths.back());
+                if (rtn < 0)
+                    return rtn;
+            }
+        }
+        f(hashes[members[g].second], paths);
+    }
+    return 0;
+}
+
+// buffered records and paths are written before grouping, buffers are freed for the merge
+int ExternalGroups::flush_all(const band& full) {
+    if (!is_open())
+        return error ? error : VERROR(errors::ERR_OPEN_FILE);
+    int rtn = flush_records(full, base);
+    if (rtn == 0)
+        rtn = flush_paths();
+    if (rtn < 0)
+        return error = rtn;
+    std::vector<external_record>().swap(records);
+    std::vector<external_record>().swap(scratch);
+    return 0;
+}
+
+// the first record of a run is held until a second one shares its hash, later ones are passed on as they come
+int ExternalGroups::for_each_exact(const path_fn& f) {
+    const band full{0, 64, ~0ULL};
+    int rtn = flush_all(full);
+    if (rtn < 0)
+        return rtn;
+    external_record held{0, 0};
+    uint64_t run = 0;
+    std::string path;
+    return merge(full, base, [&](const external_record& record) {
+        if (run == 0 || record.hash != held.hash) {
+            held = record;
+            run = 1;
+            return 0;
+        }
+        int r;
+        if (run++ == 1) {
+            if ((r = read_path(held.path, path)) < 0)
+                return r;
+            f(held.hash, path, true);
+        }
+        if ((r = read_path(record.path, path)) < 0)
+            return r;
+        f(record.hash, path, false);
+        return 0;
+    });
+}
+
+// band 0 takes the top bits, so runs sorted by hash are sorted by band 0 too
+int ExternalGroups::for_each_group(int distance, int diameter, const group_fn& f) {
+    if (distance <= 0) {
+        std::vector<std::string> paths;
+        uint64_t hv = 0;
+        int rtn = for_each_exact([&](uint64_t h, const std::string& path, bool first) {
+            if (first && !paths.empty()) {
+                f(hv, paths);
+                paths.clear();
+            }
+            hv = h;
+            paths.push_back(path);
+        });
+        if (rtn == 0 && !paths.empty())
+            f(hv, paths);
+        return rtn;
+    }
+    const band full{0, 64, ~0ULL};
+    int rtn = flush_all(full);
+    if (rtn < 0)
+        return rtn;
+
+    int m = std::min(std::max(distance, 0) + 1, 64);
+    std::vector<band> bands(m);
+    int shift = 64;
+    for (int i = 0; i < m; i++) {
+        bands[i].bits = 64 / m + (i < 64 % m ? 1 : 0);
+        shift -= bands[i].bits;
+        bands[i].shift = shift;
+        bands[i].mask = bands[i].bits == 64 ? ~0ULL : (1ULL << bands[i].bits) - 1;
+    }
+
+    // records of a band value are grouped in memory
+    size_t limit = capacity * 2;
+    uint64_t passes = 0;
+    for (size_t b = 0; b < bands.size(); b++) {
+        std::vector<std::string> runs;
+        if (b == 0) {
+            runs = base;
+        } else {
+            rtn = sort_runs(bands[b], runs);
+            std::vector<external_record>().swap(records);
+            std::vector<external_record>().swap(scratch);
+            if (rtn < 0) {
+                for (auto& run : runs)
+                    unlink(run.c_str());
+                return rtn;
+            }
+        }
+
+        std::vector<external_record> bucket;
+        uint64_t key = 0;
+        rtn = merge(bands[b], runs, [&](const external_record& record) {
+            uint64_t k = bands[b].key(record.hash);
+            if (!bucket.empty() && k != key) {
+                int r = group_bucket(bands, b, bucket, distance, diameter, f);
+                bucket.clear();
+                if (r < 0)
+                    return r;
+            }
+            key = k;
+            bucket.push_back(record);
+            if (bucket.size() > limit) {
+                spdlog::error("{} files share band {} of hashes, raise memory or lower distance", bucket.size(), b);
+                return VERROR(errors::ERR_OUT_OF_MEMORY);
+            }
+            return 0;
+        });
+        if (rtn == 0)
+            rtn = group_bucket(bands, b, bucket, distance, diameter, f);
+        passes += passes_num;
+        if (rtn < 0)
+            return rtn;
+    }
+    passes_num = passes;
+    return 0;
+}
+
+}
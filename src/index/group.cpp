@@ -0,0 +1,70 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cstring>
+#include "internal/index.h"
+
+namespace vhash {
+
+// paths longer than a block get a block of their own
+const char *HashGroups::intern(slot& s, const char *path, size_t len) {
+    if (len + 1 > GROUP_ARENA_BLOCK) {
+        s.blocks.emplace_back(new char[len + 1]);
+        char *p = s.blocks.back().get();
+        memcpy(p, path, len);
+        p[len] = '\0';
+        // keep filling the previous block
+        if (s.blocks.size() > 1)
+            std::swap(s.blocks[s.blocks.size() - 1], s.blocks[s.blocks.size() - 2]);
+        return p;
+    }
+    if (s.used + len + 1 > GROUP_ARENA_BLOCK) {
+        s.blocks.emplace_back(new char[GROUP_ARENA_BLOCK]);
+        s.used = 0;
+    }
+    char *p = s.blocks.back().get() + s.used;
+    memcpy(p, path, len);
+    p[len] = '\0';
+    s.used += len + 1;
+    return p;
+}
+
+void HashGroups::add(size_t slot, uint64_t hv, const char *path, size_t len) {
+    auto& s = slots[slot];
+    s.entries.push_back({hv, intern(s, path, len)});
+}
+
+size_t HashGroups::size() const {
+    size_t n = sorted.size();
+    for (auto& s : slots)
+        n += s.entries.size();
+    return n;
+}
+
+void HashGroups::sort(ThreadPool& pool) {
+    for (auto& s : slots) {
+        if (sorted.empty()) {
+            sorted.swap(s.entries);
+        } else {
+            sorted.insert(sorted.end(), s.entries.begin(), s.entries.end());
+            std::vector<entry>().swap(s.entries);
+        }
+    }
+    std::vector<entry> buffer;
+    index_radix_sort(sorted, buffer, 64, [](const entry& e) { return e.hash; }, pool);
+}
+
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "internal/index.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define VHASH_JOIN_X86
+#endif
+
+namespace vhash {
+
+/**
+ * Match kernel of brute force join and its name
+ */
+struct join_kernel_fn {
+    size_t (*match)(uint64_t, const uint64_t *, size_t, int, uint32_t *);
+    const char *name;
+};
+
+static inline size_t join_match_scalar(uint64_t x, const uint64_t *b, size_t n, int r, uint32_t *out) {
+    size_t m = 0;
+    for (size_t j = 0; j < n; j++) {
+        out[m] = static_cast<uint32_t>(j);
+        m += hamming_distance(x, b[j]) <= r;
+    }
+    return m;
+}
+
+#ifdef VHASH_JOIN_X86
+// popcount instruction instead of the library call of builds without -mpopcnt
+__attribute__((target("popcnt")))
+static size_t join_match_popcnt(uint64_t x, const uint64_t *b, size_t n, int r, uint32_t *out) {
+    return join_match_scalar(x, b, n, r, out);
+}
+
+// write offsets of set bits of mask from base
+static inline size_t join_mask_offsets(uint32_t mask, size_t base, uint32_t *out) {
+    size_t m = 0;
+    while (mask) {
+        out[m++] = static_cast<uint32_t>(base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+    return m;
+}
+
+// popcount of 64-bit lanes by nibble lookup, bytes are summed per lane by sad
+__attribute__((target("avx2")))
+static inline __m256i join_popcnt_avx2(__m256i v) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static size_t join_match_avx2(uint64_t x, const uint64_t *b, size_t n, int r, uint32_t *out) {
+    const __m256i vx = _mm256_set1_epi64x(static_cast<int64_t>(x));
+    const __m256i vr = _mm256_set1_epi64x(r + 1);
+    size_t m = 0, j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256i c0 = join_popcnt_avx2(_mm256_xor_si256(vx, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j))));
+        __m256i c1 = join_popcnt_avx2(_mm256_xor_si256(vx, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j + 4))));
+        auto m0 = static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vr, c0))));
+        auto m1 = static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vr, c1))));
+        if (m0 | m1)
+            m += join_mask_offsets(m0 | m1 << 4, j, out + m);
+    }
+    size_t t = join_match_scalar(x, b + j, n - j, r, out + m);
+    for (size_t k = m; k < m + t; k++)
+        out[k] += static_cast<uint32_t>(j);
+    return m + t;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t join_match_avx512(uint64_t x, const uint64_t *b, size_t n, int r, uint32_t *out) {
+    const __m512i vx = _mm512_set1_epi64(static_cast<int64_t>(x));
+    const __m512i vr = _mm512_set1_epi64(r);
+    size_t m = 0, j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m512i c0 = _mm512_popcnt_epi64(_mm512_xor_si512(vx, _mm512_loadu_si512(b + j)));
+        __m512i c1 = _mm512_popcnt_epi64(_mm512_xor_si512(vx, _mm512_loadu_si512(b + j + 8)));
+        uint32_t mask = _mm512_cmple_epu64_mask(c0, vr) | static_cast<uint32_t>(_mm512_cmple_epu64_mask(c1, vr)) << 8;
+        if (mask)
+            m += join_mask_offsets(mask, j, out + m);
+    }
+    if (j < n) {
+        auto tail = static_cast<__mmask8>((1u << std::min<size_t>(n - j, 8)) - 1);
+        __m512i c0 = _mm512_popcnt_epi64(_mm512_xor_si512(vx, _mm512_maskz_loadu_epi64(tail, b + j)));
+        m += join_mask_offsets(_mm512_mask_cmple_epu64_mask(tail, c0, vr), j, out + m);
+        j += 8;
+        if (j < n) {
+            tail = static_cast<__mmask8>((1u << (n - j)) - 1);
+            c0 = _mm512_popcnt_epi64(_mm512_xor_si512(vx, _mm512_maskz_loadu_epi64(tail, b + j)));
+            m += join_mask_offsets(_mm512_mask_cmple_epu64_mask(tail, c0, vr), j, out + m);
+        }
+    }
+    return m;
+}
+#endif
+
+// widest kernel supported by the running cpu
+static join_kernel_fn join_kernel_select() {
+#ifdef VHASH_JOIN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+        return {join_match_avx512, "avx512"};
+    if (__builtin_cpu_supports("avx2"))
+        return {join_match_avx2, "avx2"};
+    if (__builtin_cpu_supports("popcnt"))
+        return {join_match_popcnt, "popcnt"};
+#endif
+    return {join_match_scalar, "scalar"};
+}
+
+static const join_kernel_fn& join_kernel_get() {
+    static const join_kernel_fn kernel = join_kernel_select();
+    return kernel;
+}
+
+size_t join_match(uint64_t x, const uint64_t *b, size_t n, int r, uint32_t *out) {
+    return join_kernel_get().match(x, b, n, r, out);
+}
+
+const char *join_kernel() {
+    return join_kernel_get().name;
+}
+
+}
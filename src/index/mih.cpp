@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cmath>
+#include "internal/index.h"
+
+namespace vhash {
+
+// cost of probing n hashes in m tables, a probe is one lookup and its bucket of candidates
+int MIHIndex::choose_substrings(size_t n, int radius) {
+    radius = std::max(radius, 0);
+    int best = 1;
+    double best_cost = 0;
+    for (int m = 1; m <= 16; m++) {
+        int bits = 64 / m;
+        int sub_r = radius / m;
+        double probes = 0, combination = 1;
+        for (int k = 0; k <= sub_r && k <= bits; k++) {
+            probes += combination;
+            combination = combination * (bits - k) / (k + 1);
+        }
+        bool direct = bits <= MIH_DIRECT_BITS && (1ULL << bits) <= 4 * std::max<size_t>(n, 1);
+        double lookup = direct ? 1 : std::log2(static_cast<double>(n) + 2);
+        double candidates = static_cast<double>(n) / std::ldexp(1.0, bits);
+        double cost = m * probes * (lookup + candidates);
+        if (m == 1 || cost < best_cost) {
+            best = m;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+void MIHIndex::build(const std::vector<uint64_t>& hashes, int radius) {
+    this->hashes = hashes;
+    tables.clear();
+    int m = choose_substrings(hashes.size(), radius);
+    tables.resize(m);
+
+    // the first 64 % m substrings take one more bit
+    int shift = 0;
+    for (int t = 0; t < m; t++) {
+        table& tb = tables[t];
+        tb.bits = 64 / m + (t < 64 % m ? 1 : 0);
+        tb.shift = shift;
+        tb.mask = tb.bits == 64 ? ~0ULL : (1ULL << tb.bits) - 1;
+        tb.direct = tb.bits <= MIH_DIRECT_BITS && (1ULL << tb.bits) <= 4 * std::max<size_t>(hashes.size(), 1);
+        shift += tb.bits;
+
+        tb.ids.resize(hashes.size());
+        if (tb.direct) {
+            // counting sort by substring
+            tb.offsets.assign((1ULL << tb.bits) + 1, 0);
+            for (auto hv : hashes)
+                tb.offsets[((hv >> tb.shift) & tb.mask) + 1]++;
+            for (size_t k = 1; k < tb.offsets.size(); k++)
+                tb.offsets[k] += tb.offsets[k - 1];
+            std::vector<uint32_t> next(tb.offsets.begin(), tb.offsets.end() - 1);
+            for (size_t i = 0; i < hashes.size(); i++)
+                tb.ids[next[(hashes[i] >> tb.shift) & tb.mask]++] = static_cast<uint32_t>(i);
+        } else {
+            std::iota(tb.ids.begin(), tb.ids.end(), 0);
+            std::sort(tb.ids.begin(), tb.ids.end(), [&tb, &hashes](uint32_t a, uint32_t b) {
+                return ((hashes[a] >> tb.shift) & tb.mask) < ((hashes[b] >> tb.shift) & tb.mask);
+            });
+            tb.keys.resize(hashes.size());
+            for (size_t i = 0; i < hashes.size(); i++)
+                tb.keys[i] = (hashes[tb.ids[i]] >> tb.shift) & tb.mask;
+        }
+    }
+}
+
+}
@@ -0,0 +1,129 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include "vhash_error.h"
+#include "vhash_index.h"
+#include "internal/index.h"
+#include "internal/store.h"
+#include "internal/util.h"
+
+namespace vhash {
+
+// queries of each task in a batch
+static const size_t QUERY_BATCH_CHUNK = 64;
+
+/**
+ * hash index implement
+ */
+class hash_index::indeximpl {
+public:
+    indeximpl(const std::string& dir_path, bool dihedral): store(dir_path, true), mode(dihedral ? STORE_DIHEDRAL : 0) {}
+
+    int query(uint64_t hv, size_t k, int radius, std::vector<index_match>& matches) const {
+        matches.clear();
+        if (!store.is_open())
+            return VERROR(errors::ERR_OPEN_FILE);
+        if (radius < 0)
+            return VERROR(errors::ERR_PARAM_INVALID);
+        std::vector<store_match> found;
+        if (k == 0)
+            store.radius(hv, radius, found, mode);
+        else
+            store.nearest(hv, k, radius, found, mode);
+        matches.reserve(found.size());
+        for (auto& m : found)
+            matches.push_back(index_match{m.path, m.record->hash, m.record->size, m.record->mtime, m.distance});
+        return 0;
+    }
+
+    IndexStore store;
+    uint32_t mode;      // dihedral mode of queried records
+};
+
+/**
+ * Hash index
+ */
+hash_index::hash_index(const std::string& dir_path, bool dihedral) {
+    impl = new hash_index::indeximpl(dir_path, dihedral);
+}
+
+hash_index::hash_index(hash_index&& other) noexcept: impl(nullptr) {
+    *this = std::move(other);
+}
+
+hash_index::~hash_index() {
+    delete impl;
+    impl = nullptr;
+}
+
+hash_index& hash_index::operator=(hash_index&& other) noexcept {
+    if (this != &other) {
+        delete impl;
+        impl = other.impl;
+        other.impl = nullptr;
+    }
+    return *this;
+}
+
+bool hash_index::is_open() const {
+    return impl && impl->store.is_open();
+}
+
+uint64_t hash_index::size() const {
+    return impl ? impl->store.size() : 0;
+}
+
+int hash_index::query(uint64_t hv, size_t k, int radius, std::vector<index_match>& matches) const {
+    if (!impl)
+        return VERROR(errors::ERR_OPEN_FILE);
+    return impl->query(hv, k, radius, matches);
+}
+
+int hash_index::query(const std::vector<uint64_t>& hvs, size_t k, int radius,
+                      std::vector<std::vector<index_match>>& matches, int jobs) const {
+    matches.clear();
+    matches.resize(hvs.size());
+    if (!impl)
+        return VERROR(errors::ERR_OPEN_FILE);
+    size_t chunks = (hvs.size() + QUERY_BATCH_CHUNK - 1) / QUERY_BATCH_CHUNK;
+    if (chunks <= 1) {
+        for (size_t i = 0; i < hvs.size(); i++) {
+            int rtn = impl->query(hvs[i], k, radius, matches[i]);
+            if (rtn < 0) return rtn;
+        }
+        return 0;
+    }
+
+    // queries only read the mapped index, each task fills its own results
+    std::atomic<int> error(0);
+    JoinProgress progress(chunks);
+    ThreadPool pool(static_cast<size_t>(std::max(jobs, 0)));
+    pool.post_batch(chunks, [&](size_t c) {
+        return [&, c] {
+            size_t end = std::min(hvs.size(), (c + 1) * QUERY_BATCH_CHUNK);
+            for (size_t i = c * QUERY_BATCH_CHUNK; i < end; i++) {
+                int rtn = impl->query(hvs[i], k, radius, matches[i]);
+                if (rtn < 0) error = rtn;
+            }
+            progress.finish(c);
+        };
+    });
+    while (!progress.finished())
+        progress.wait();
+    return error.load();
+}
+
+}
@@ -0,0 +1,679 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <cerrno>
+#include <cinttypes>
+#include <dirent.h>
+#include <fcntl.h>
+#include <cmath>
+#include <numeric>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "internal/scan.h"
+#include "internal/store.h"
+#include "internal/util.h"
+
+namespace vhash {
+
+// buffered bytes of each section before writing
+static const size_t STORE_BUFFER_SIZE = 1024 * 1024;
+static const char *STORE_BASE = "base.vhi";
+static const char *STORE_LOCK = "LOCK";
+// opening a store read only is retried if a compaction removes the segments being opened
+static const int STORE_OPEN_RETRY = 8;
+
+/**
+ * Temporary file of a section, buffered as it comes and copied to segment on close
+ */
+struct IndexSegmentWriter::spill {
+    std::string path;
+    int fd;
+    std::string buf;
+    uint64_t size;
+
+    explicit spill(std::string path): path(std::move(path)), size(0) {
+        fd = open(this->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        buf.reserve(STORE_BUFFER_SIZE);
+    }
+
+    ~spill() {
+        if (fd >= 0) ::close(fd);
+        unlink(path.c_str());
+    }
+
+    int append(const void *data, size_t n) {
+        buf.append(static_cast<const char *>(data), n);
+        size += n;
+        return buf.size() >= STORE_BUFFER_SIZE ? flush() : 0;
+    }
+
+    int flush() {
+        int rtn = buf.empty() ? 0 : file_write_all(fd, buf.data(), buf.size());
+        buf.clear();
+        return rtn;
+    }
+
+    // append whole file to out
+    int copy_to(int out) {
+        int rtn = flush();
+        if (rtn == 0 && lseek(fd, 0, SEEK_SET) != 0)
+            rtn = VERROR(errors::ERR_READ_FILE);
+        std::vector<char> chunk(STORE_BUFFER_SIZE);
+        ssize_t n = 0;
+        while (rtn == 0 && (n = read(fd, chunk.data(), chunk.size())) > 0)
+            rtn = file_write_all(out, chunk.data(), static_cast<size_t>(n));
+        if (n < 0)
+            rtn = VERROR(errors::ERR_READ_FILE);
+        return rtn;
+    }
+};
+
+IndexSegmentWriter::IndexSegmentWriter(const std::string& file_path, uint64_t seq, bool tables)
+    : file_path(file_path), fd(-1), seq(seq), count(0), unique(0), last_hash(0), tables(tables), error(0) {
+    fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    // .tmp leftovers of a crash are removed when the store is opened or removed
+    hashes.reset(new spill(file_path + ".hashes.tmp"));
+    postings.reset(new spill(file_path + ".postings.tmp"));
+    strings.reset(new spill(file_path + ".strings.tmp"));
+    if (fd < 0 || hashes->fd < 0 || postings->fd < 0 || strings->fd < 0) {
+        error = VERROR(errors::ERR_OPEN_FILE);
+        return;
+    }
+    // header is written on close
+    store_header header = {};
+    error = file_write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+    records.reserve(STORE_BUFFER_SIZE);
+}
+
+IndexSegmentWriter::~IndexSegmentWriter() {
+    close();
+}
+
+bool IndexSegmentWriter::is_open() const {
+    return fd >= 0 && error == 0;
+}
+
+int IndexSegmentWriter::append(uint64_t hash, uint64_t size, int64_t mtime, const char *path, uint32_t flags) {
+    if (!is_open())
+        return error ? error : VERROR(errors::ERR_OPEN_FILE);
+    if (count == UINT32_MAX)
+        return error = VERROR(errors::ERR_PARAM_INVALID);
+    if (count == 0 || hash != last_hash) {
+        error = hashes->append(&hash, sizeof(hash));
+        if (error == 0)
+            error = postings->append(&count, sizeof(count));
+        unique++;
+        last_hash = hash;
+    }
+    store_record record = {hash, size, mtime, strings->size, flags, 0};
+    records.append(reinterpret_cast<const char *>(&record), sizeof(record));
+    if (error == 0)
+        error = strings->append(path, strlen(path) + 1);
+    count++;
+    if (error == 0 && records.size() >= STORE_BUFFER_SIZE)
+        error = flush();
+    return error;
+}
+
+int IndexSegmentWriter::flush() {
+    int rtn = records.empty() ? 0 : file_write_all(fd, records.data(), records.size());
+    records.clear();
+    return rtn;
+}
+
+int IndexSegmentWriter::close() {
+    if (fd < 0)
+        return error;
+    if (error == 0)
+        error = flush();
+    if (error == 0)
+        error = postings->append(&count, sizeof(count));
+
+    store_header header = {};
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.version = STORE_VERSION;
+    header.record_size = sizeof(store_record);
+    header.seq = seq;
+    header.count = count;
+    header.unique = unique;
+    header.records_offset = sizeof(store_header);
+    header.hashes_offset = header.records_offset + count * sizeof(store_record);
+    header.postings_offset = header.hashes_offset + unique * sizeof(uint64_t);
+    header.tables_offset = header.postings_offset + (unique + 1) * sizeof(uint64_t);
+    header.tables_num = tables && unique > 0 ? static_cast<uint64_t>(store_tables_num(unique)) : 0;
+    header.paths_offset = header.tables_offset + store_tables_size(static_cast<int>(header.tables_num), unique);
+    header.strings_offset = header.paths_offset + count * sizeof(uint32_t);
+    header.strings_size = strings->size;
+    header.byte_order = STORE_BYTE_ORDER;
+
+    if (error == 0)
+        error = hashes->copy_to(fd);
+    if (error == 0)
+        error = postings->copy_to(fd);
+    if (error == 0 && header.tables_num > 0)
+        error = write_tables(header.tables_num);
+
+    // record ids sorted by path, paths are read back from the string table
+    if (error == 0 && count > 0) {
+        error = strings->flush();
+        size_t length = static_cast<size_t>(strings->size);
+        void *p = error == 0 ? mmap(nullptr, length, PROT_READ, MAP_SHARED, strings->fd, 0) : MAP_FAILED;
+        void *r = error == 0 ? mmap(nullptr, static_cast<size_t>(header.hashes_offset), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (p != MAP_FAILED && r != MAP_FAILED) {
+            // path offsets are copied in one pass, so that sorting only touches the string table
+            auto recs = reinterpret_cast<const store_record *>(static_cast<const char *>(r) + header.records_offset);
+            std::vector<uint64_t> offsets(count);
+            for (uint64_t i = 0; i < count; i++)
+                offsets[i] = recs[i].path;
+            munmap(r, static_cast<size_t>(header.hashes_offset));
+            r = MAP_FAILED;
+
+            auto text = static_cast<const char *>(p);
+            std::vector<uint32_t> ids(count);
+            std::iota(ids.begin(), ids.end(), 0);
+            std::sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) {
+                return strcmp(text + offsets[a], text + offsets[b]) < 0;
+            });
+            error = file_write_all(fd, reinterpret_cast<const char *>(ids.data()), ids.size() * sizeof(uint32_t));
+        } else if (error == 0) {
+            error = VERROR(errors::ERR_READ_FILE);
+        }
+        if (p != MAP_FAILED) munmap(p, length);
+        if (r != MAP_FAILED) munmap(r, static_cast<size_t>(header.hashes_offset));
+    }
+
+    if (error == 0)
+        error = strings->copy_to(fd);
+    if (error == 0 && pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        error = VERROR(errors::ERR_WRITE_FILE);
+    if (error == 0 && fsync(fd) != 0)
+        error = VERROR(errors::ERR_WRITE_FILE);
+
+    ::close(fd);
+    fd = -1;
+    hashes.reset();
+    postings.reset();
+    strings.reset();
+    return error;
+}
+
+int IndexSegmentWriter::write_tables(uint64_t tables_num) {
+    // tables are built from unique hashes read back one table at a time
+    int rtn = hashes->flush();
+    if (rtn < 0)
+        return rtn;
+    auto length = static_cast<size_t>(unique * sizeof(uint64_t));
+    void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, hashes->fd, 0);
+    if (p == MAP_FAILED)
+        return VERROR(errors::ERR_READ_FILE);
+    auto hvs = static_cast<const uint64_t *>(p);
+    int m = static_cast<int>(tables_num);
+    int shift = 0;
+    std::vector<uint32_t> offsets;
+    std::vector<uint64_t> sorted(static_cast<size_t>(unique));
+    for (int t = 0; t < m && rtn == 0; t++) {
+        int bits = store_table_bits(m, t);
+        uint64_t mask = (1ULL << bits) - 1;
+        // counting sort by substring
+        offsets.assign((1ULL << bits) + 2, 0);
+        for (uint64_t u = 0; u < unique; u++)
+            offsets[((hvs[u] >> shift) & mask) + 1]++;
+        for (size_t k = 1; k < offsets.size() - 1; k++)
+            offsets[k] += offsets[k - 1];
+        std::vector<uint32_t> next(offsets.begin(), offsets.end() - 2);
+        for (uint64_t u = 0; u < unique; u++)
+            sorted[next[(hvs[u] >> shift) & mask]++] = hvs[u];
+        rtn = file_write_all(fd, reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint32_t));
+        if (rtn == 0)
+            rtn = file_write_all(fd, reinterpret_cast<const char *>(sorted.data()), sorted.size() * sizeof(uint64_t));
+        shift += bits;
+    }
+    munmap(p, length);
+    return rtn;
+}
+
+IndexSegment::IndexSegment(const std::string& file_path)
+    : data(nullptr), length(0), header(nullptr), records(nullptr), hashes(nullptr), postings(nullptr), paths(nullptr),
+      strings(nullptr), strings_size(0), count(0), unique_num(0) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(store_header)) {
+        ::close(fd);
+        return;
+    }
+    void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return;
+    data = p;
+    length = static_cast<size_t>(st.st_size);
+
+    // validate layout before exposing sections
+    auto h = static_cast<const store_header *>(data);
+    const char *base = static_cast<const char *>(data);
+    uint64_t n = h->count, u = h->unique;
+    // segments without tables may leave tables offset unset
+    int m = static_cast<int>(std::min<uint64_t>(h->tables_num, 64));
+    bool tables_valid = h->tables_num == 0 ||
+                        (h->tables_num <= 64 && u > 0 && store_table_bits(m, 0) <= MIH_DIRECT_BITS);
+    uint64_t tables_offset = h->postings_offset + (u + 1) * sizeof(uint64_t);
+    uint64_t tables_size = tables_valid ? store_tables_size(m, u) : 0;
+    bool valid = memcmp(h->magic, STORE_MAGIC, sizeof(h->magic)) == 0 &&
+                 h->version == STORE_VERSION &&
+                 h->byte_order == STORE_BYTE_ORDER &&
+                 h->record_size == sizeof(store_record) &&
+                 n <= UINT32_MAX && u <= n &&
+                 h->records_offset == sizeof(store_header) &&
+                 h->hashes_offset == h->records_offset + n * sizeof(store_record) &&
+                 h->postings_offset == h->hashes_offset + u * sizeof(uint64_t) &&
+                 tables_valid && (m == 0 || h->tables_offset == tables_offset) &&
+                 h->paths_offset == tables_offset + tables_size &&
+                 h->strings_offset == h->paths_offset + n * sizeof(uint32_t) &&
+                 h->strings_offset <= length && h->strings_size <= length - h->strings_offset &&
+                 (h->strings_size == 0 || base[h->strings_offset + h->strings_size - 1] == '\0');
+    // posting lists are ascending ranges covering all records, path ids are records
+    if (valid) {
+        auto pv = reinterpret_cast<const uint64_t *>(base + h->postings_offset);
+        valid = pv[0] == 0 && pv[u] == n;
+        for (uint64_t i = 0; valid && i < u; i++)
+            valid = pv[i] < pv[i + 1];
+        auto ids = reinterpret_cast<const uint32_t *>(base + h->paths_offset);
+        for (uint64_t i = 0; valid && i < n; i++)
+            valid = ids[i] < n;
+    }
+    if (!valid) {
+        munmap(data, length);
+        data = nullptr;
+        length = 0;
+        return;
+    }
+    header = h;
+    records = reinterpret_cast<const store_record *>(base + h->records_offset);
+    hashes = reinterpret_cast<const uint64_t *>(base + h->hashes_offset);
+    postings = reinterpret_cast<const uint64_t *>(base + h->postings_offset);
+    paths = reinterpret_cast<const uint32_t *>(base + h->paths_offset);
+    strings = base + h->strings_offset;
+    strings_size = h->strings_size;
+    count = n;
+    unique_num = u;
+
+    const char *tp = base + tables_offset;
+    int shift = 0;
+    for (int t = 0; t < m; t++) {
+        table tb = {};
+        tb.shift = shift;
+        tb.bits = store_table_bits(m, t);
+        tb.mask = (1ULL << tb.bits) - 1;
+        tb.offsets = reinterpret_cast<const uint32_t *>(tp);
+        tb.hashes = reinterpret_cast<const uint64_t *>(tb.offsets + (1ULL << tb.bits) + 2);
+        tables.push_back(tb);
+        tp += ((1ULL << tb.bits) + 2) * sizeof(uint32_t) + u * sizeof(uint64_t);
+        shift += tb.bits;
+    }
+}
+
+IndexSegment::~IndexSegment() {
+    if (data)
+        munmap(data, length);
+}
+
+bool IndexSegment::is_open() const {
+    return data != nullptr;
+}
+
+void IndexSegment::prefetch() const {
+    if (!data || unique_num == 0)
+        return;
+    // faults read single pages instead of windows around them, which would evict hot pages of large segments
+    madvise(data, length, MADV_RANDOM);
+    // advice covers whole pages around hashes and tables
+    auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    auto advise = [this, page](uint64_t begin, uint64_t end) {
+        begin -= begin % page;
+        madvise(static_cast<char *>(data) + begin, static_cast<size_t>(end - begin), MADV_WILLNEED);
+    };
+    advise(header->hashes_offset, header->postings_offset);
+    if (!tables.empty())
+        advise(header->tables_offset, header->paths_offset);
+}
+
+const store_record *IndexSegment::find(const char *path) const {
+    auto it = std::lower_bound(paths, paths + count, path, [this](uint32_t id, const char *p) {
+        return strcmp(this->path(records[id]), p) < 0;
+    });
+    if (it == paths + count || strcmp(this->path(records[*it]), path) != 0)
+        return nullptr;
+    return records + *it;
+}
+
+IndexStore::IndexStore(const std::string& dir_path, bool read_only)
+    : dir_path(dir_path), lock_fd(-1), read_only(read_only), opened(false), has_base(false), last_seq(0) {
+    if (read_only) {
+        for (int i = 0; i < STORE_OPEN_RETRY && !opened; i++)
+            opened = load();
+        return;
+    }
+
+    if (mkdir(dir_path.c_str(), 0755) != 0 && errno != EEXIST)
+        return;
+    lock_fd = open((dir_path + file_seperator() + STORE_LOCK).c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0)
+        return;
+    // one run updates an index at a time
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0 || !load()) {
+        ::close(lock_fd);
+        lock_fd = -1;
+        return;
+    }
+    opened = true;
+}
+
+IndexStore::~IndexStore() {
+    segments.clear();
+    if (lock_fd >= 0)
+        ::close(lock_fd);
+}
+
+bool IndexStore::load() {
+    segments.clear();
+    has_base = false;
+    last_seq = 0;
+
+    DIR *dir = opendir(dir_path.c_str());
+    if (!dir)
+        return false;
+    std::string base_path = dir_path + file_seperator() + STORE_BASE;
+    if (access(base_path.c_str(), F_OK) == 0) {
+        std::unique_ptr<IndexSegment> base(new IndexSegment(base_path));
+        if (!base->is_open()) {
+            closedir(dir);
+            return false;
+        }
+        last_seq = base->seq();
+        if (read_only)
+            base->prefetch();
+        segments.emplace_back(std::move(base));
+        has_base = true;
+    }
+
+    // deltas newer than base in sequence, older ones were merged before a crash and leftovers are removed
+    std::vector<uint64_t> deltas;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        uint64_t seq = 0;
+        int end = 0;
+        std::string name = ent->d_name;
+        if (sscanf(ent->d_name, "delta-%" SCNu64 ".vhi%n", &seq, &end) == 1 && end == static_cast<int>(name.size())) {
+            if (seq > last_seq)
+                deltas.push_back(seq);
+            else if (!read_only)
+                unlink((dir_path + file_seperator() + name).c_str());
+        } else if (!read_only && name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            unlink((dir_path + file_seperator() + name).c_str());
+        }
+    }
+    closedir(dir);
+    std::sort(deltas.begin(), deltas.end());
+    for (auto seq : deltas) {
+        std::unique_ptr<IndexSegment> delta(new IndexSegment(segment_path(seq)));
+        if (!delta->is_open()) {
+            segments.clear();
+            return false;
+        }
+        segments.emplace_back(std::move(delta));
+        last_seq = seq;
+    }
+    return true;
+}
+
+bool IndexStore::is_open() const {
+    return opened;
+}
+
+uint64_t IndexStore::size() const {
+    uint64_t n = 0;
+    for (auto& seg : segments)
+        n += seg->size();
+    return n;
+}
+
+std::string IndexStore::segment_path(uint64_t seq) const {
+    char name[64];
+    snprintf(name, sizeof(name), "delta-%010" PRIu64 ".vhi", seq);
+    return dir_path + file_seperator() + name;
+}
+
+const store_record *IndexStore::find(const char *path, uint64_t *pos) const {
+    uint64_t first = size();
+    for (size_t s = segments.size(); s-- > 0;) {
+        first -= segments[s]->size();
+        const store_record *record = segments[s]->find(path);
+        if (!record)
+            continue;
+        if (record->flags & STORE_REMOVED)
+            return nullptr;
+        if (pos)
+            *pos = first + static_cast<uint64_t>(record - &(*segments[s])[0]);
+        return record;
+    }
+    return nullptr;
+}
+
+bool IndexSegment::probes_cheaper(int r) const {
+    if (tables.empty())
+        return false;
+    // probes of the widest table and candidates of the narrowest
+    int m = static_cast<int>(tables.size());
+    int sub_r = r / m;
+    double probes = 0, combination = 1;
+    for (int k = 0; k <= sub_r && k <= tables[0].bits; k++) {
+        probes += combination;
+        combination = combination * (tables[0].bits - k) / (k + 1);
+    }
+    double candidates = static_cast<double>(unique_num) / std::ldexp(1.0, tables[m - 1].bits);
+    return m * probes * (1 + candidates) * STORE_SCAN_RATIO < static_cast<double>(unique_num);
+}
+
+bool IndexStore::live(size_t s, const char *path) const {
+    for (size_t t = s + 1; t < segments.size(); t++) {
+        if (segments[t]->find(path))
+            return false;
+    }
+    return true;
+}
+
+void IndexStore::collect(size_t s, uint64_t u, int distance, uint32_t mode, std::vector<store_match>& out) const {
+    const IndexSegment& seg = *segments[s];
+    for (auto r = seg.postings_begin(u); r != seg.postings_end(u); r++) {
+        const char *path = seg.path(*r);
+        if (!(r->flags & STORE_REMOVED) && (r->flags & STORE_DIHEDRAL) == (mode & STORE_DIHEDRAL) && live(s, path))
+            out.push_back(store_match{path, r, distance});
+    }
+}
+
+static void store_sort_matches(std::vector<store_match>& matches) {
+    std::sort(matches.begin(), matches.end(), [](const store_match& a, const store_match& b) {
+        return a.distance != b.distance ? a.distance < b.distance : strcmp(a.path, b.path) < 0;
+    });
+}
+
+void IndexStore::radius(uint64_t hv, int r, std::vector<store_match>& out, uint32_t mode) const {
+    out.clear();
+    for (size_t s = 0; s < segments.size(); s++) {
+        segments[s]->radius(hv, r, [&](uint64_t u, int d) {
+            collect(s, u, d, mode, out);
+        });
+    }
+    store_sort_matches(out);
+}
+
+void IndexStore::nearest(uint64_t hv, size_t k, int r, std::vector<store_match>& out, uint32_t mode) const {
+    out.clear();
+    if (k == 0 || r < 0)
+        return;
+
+    // grow radius while probing base is cheap, radius below the next multiple of tables num costs the same probes
+    const IndexSegment *base = has_base ? segments[0].get() : nullptr;
+    int step = base ? std::max(base->tables_num(), 1) : 1;
+    for (int cur = std::min(r, step - 1); base && base->probes_cheaper(cur); cur = std::min(r, cur + step)) {
+        radius(hv, cur, out, mode);
+        if (out.size() >= k || cur == r) {
+            if (out.size() > k)
+                out.resize(k);
+            return;
+        }
+    }
+
+    // scan all hashes keeping k nearest, the radius shrinks to the k-th distance found so far
+    out.clear();
+    int bound = r;
+    for (size_t s = 0; s < segments.size(); s++) {
+        segments[s]->scan(hv, bound, [&](uint64_t u, int d) {
+            if (d > bound)
+                return;
+            collect(s, u, d, mode, out);
+            if (out.size() >= 2 * k) {
+                store_sort_matches(out);
+                out.resize(k);
+                bound = out.back().distance;
+            }
+        });
+    }
+    store_sort_matches(out);
+    if (out.size() > k)
+        out.resize(k);
+}
+
+int IndexStore::append(std::vector<store_entry>& entries) {
+    if (!is_open() || read_only)
+        return VERROR(errors::ERR_OPEN_FILE);
+    if (entries.empty())
+        return 0;
+    std::sort(entries.begin(), entries.end(), [](const store_entry& a, const store_entry& b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.path < b.path;
+    });
+
+    // a delta is written under a temporary name and renamed once complete
+    uint64_t seq = last_seq + 1;
+    std::string path = segment_path(seq);
+    std::string tmp_path = path + ".tmp";
+    int rtn;
+    {
+        IndexSegmentWriter writer(tmp_path, seq);
+        for (auto& e : entries) {
+            rtn = writer.append(e.hash, e.size, e.mtime, e.path.c_str(), e.flags);
+            if (rtn < 0) break;
+        }
+        rtn = writer.close();
+    }
+    if (rtn == 0 && rename(tmp_path.c_str(), path.c_str()) != 0)
+        rtn = VERROR(errors::ERR_WRITE_FILE);
+    if (rtn < 0) {
+        unlink(tmp_path.c_str());
+        return rtn;
+    }
+
+    std::unique_ptr<IndexSegment> delta(new IndexSegment(path));
+    if (!delta->is_open())
+        return VERROR(errors::ERR_READ_FILE);
+    segments.emplace_back(std::move(delta));
+    last_seq = seq;
+    return 0;
+}
+
+bool IndexStore::needs_compaction() const {
+    size_t delta_num = segments.size() - (has_base ? 1 : 0);
+    uint64_t base = has_base ? segments[0]->size() : 0;
+    return delta_num >= STORE_MAX_DELTAS || (delta_num > 0 && (size() - base) * STORE_DELTA_RATIO >= base);
+}
+
+int IndexStore::compact() const {
+    if (!is_open() || read_only)
+        return VERROR(errors::ERR_OPEN_FILE);
+    std::string base_path = dir_path + file_seperator() + STORE_BASE;
+    std::string tmp_path = base_path + ".tmp";
+
+    // merge records of segments in hash and path order, dropping removed and overridden ones
+    std::vector<size_t> next(segments.size(), 0);
+    int rtn = 0;
+    {
+        IndexSegmentWriter writer(tmp_path, last_seq, true);
+        while (rtn == 0) {
+            size_t best = segments.size();
+            for (size_t s = 0; s < segments.size(); s++) {
+                if (next[s] >= segments[s]->size())
+                    continue;
+                if (best == segments.size()) {
+                    best = s;
+                    continue;
+                }
+                const store_record& a = (*segments[s])[next[s]];
+                const store_record& b = (*segments[best])[next[best]];
+                if (a.hash < b.hash || (a.hash == b.hash && strcmp(segments[s]->path(a), segments[best]->path(b)) < 0))
+                    best = s;
+            }
+            if (best == segments.size())
+                break;
+            const IndexSegment& seg = *segments[best];
+            const store_record& r = seg[next[best]++];
+            const char *path = seg.path(r);
+            if (!(r.flags & STORE_REMOVED) && live(best, path))
+                rtn = writer.append(r.hash, r.size, r.mtime, path, r.flags);
+        }
+        int close_rtn = writer.close();
+        if (rtn == 0) rtn = close_rtn;
+    }
+    if (rtn == 0 && rename(tmp_path.c_str(), base_path.c_str()) != 0)
+        rtn = VERROR(errors::ERR_WRITE_FILE);
+    if (rtn < 0) {
+        unlink(tmp_path.c_str());
+        return rtn;
+    }
+
+    // merged deltas are older than new base, they are removed on next open if this is interrupted
+    for (size_t s = has_base ? 1 : 0; s < segments.size(); s++)
+        unlink(segment_path(segments[s]->seq()).c_str());
+    return 0;
+}
+
+bool store_check(const std::string& dir_path) {
+    return access((dir_path + file_seperator() + STORE_LOCK).c_str(), F_OK) == 0;
+}
+
+int store_remove(const std::string& dir_path) {
+    DIR *dir = opendir(dir_path.c_str());
+    if (!dir)
+        return VERROR(errors::ERR_OPEN_FILE);
+    struct dirent *ent;
+    int rtn = 0;
+    while ((ent = readdir(dir)) != nullptr) {
+        std::string name = ent->d_name;
+        bool segment = name.size() > 4 && (name.compare(name.size() - 4, 4, ".vhi") == 0 ||
+                                           name.compare(name.size() - 4, 4, ".tmp") == 0);
+        if ((segment || name == STORE_LOCK) && unlink((dir_path + file_seperator() + name).c_str()) != 0)
+            rtn = VERROR(errors::ERR_WRITE_FILE);
+    }
+    closedir(dir);
+    if (rtn == 0 && rmdir(dir_path.c_str()) != 0 && errno != ENOTEMPTY && errno != EEXIST)
+        rtn = VERROR(errors::ERR_WRITE_FILE);
+    return rtn;
+}
+
+}
@@ -38,7 +38,7 @@ scanner::~scanner() {
         th.join();
 }
 
-inline void for_each_internal(const std::string& dirname, const file_filter_t& filter,
+inline void for_each_internal(const std::string& dirname, const file_stat_filter_t& filter,
                               bool include_subdir, bool collect, bool use_builtin_filter,
                               pairs_t& pairs) {
     auto dir = opendir(dirname.c_str());
@@ -52,13 +52,17 @@ inline void for_each_internal(const std::string& dirname, const file_filter_t& f
         }
 
         auto path = std::string(dirname).append({file_seperator()}).append(ent->d_name);
-        if (scanner_check_is_folder(path)) {
+        // a file whose stat fails, i.e. a dangling link, is passed on with a zeroed stat
+        struct stat st = {0};
+        if (stat(path.c_str(), &st) != 0)
+            st = {};
+        if (S_ISDIR(st.st_mode)) {
             if (use_builtin_filter && !builtin_dir_filter(path))
                 continue;
             if (include_subdir)
                 for_each_internal(path, filter, include_subdir, collect, use_builtin_filter, pairs); // recursive
         } else {
-            if (filter(dirname.c_str(), ent->d_name) && collect)
+            if (filter(dirname.c_str(), ent->d_name, st) && collect)
                 pairs.emplace_back(std::make_tuple(dirname, std::string(ent->d_name)));
         }
     }
@@ -66,15 +70,25 @@ inline void for_each_internal(const std::string& dirname, const file_filter_t& f
 }
 
 pairs_t scanner::for_each(const file_filter_t& filter, bool include_subdir) {
+    return for_each_stat([&filter](const char *parent, const char *file, const struct stat& st) -> bool {
+        return filter(parent, file);
+    }, include_subdir);
+}
+
+pairs_t scanner::for_each_stat(const file_stat_filter_t& filter, bool include_subdir) {
     pairs_t pairs;
     for_each_internal(scanner_abs_path(dirname), filter, include_subdir, true, use_builtin_filter, pairs);
     return pairs;
 }
 
 void scanner::for_each_bg(const file_filter_t& filter, bool include_subdir) {
-    th = std::thread([&] {
+    // filter and include_subdir are copied, they may not outlive the caller
+    th = std::thread([this, filter, include_subdir] {
         pairs_t pairs;
-        for_each_internal(scanner_abs_path(dirname), filter, include_subdir, false, use_builtin_filter, pairs);
+        auto stat_filter = [&filter](const char *parent, const char *file, const struct stat& st) -> bool {
+            return filter(parent, file);
+        };
+        for_each_internal(scanner_abs_path(dirname), stat_filter, include_subdir, false, use_builtin_filter, pairs);
     });
     run_background = true;
 }
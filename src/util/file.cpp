@@ -14,6 +14,9 @@
 // WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
 // THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 #include "internal/util.h"
 
 namespace vhash {
@@ -55,6 +58,40 @@ int FileLoader::read(std::vector<uint8_t>& vec) {
     return static_cast<int>(n);
 }
 
+int file_prefetch(const std::string& file_path, size_t length) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return VERROR(errors::ERR_OPEN_FILE);
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+    return 0;
+}
+
+int file_open_output(const std::string& file_path) {
+    if (file_path.empty())
+        return STDOUT_FILENO;
+    int fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return VERROR(errors::ERR_OPEN_FILE);
+    return fd;
+}
+
+int file_write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return VERROR(errors::ERR_WRITE_FILE);
+        }
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+    return 0;
+}
+
 FileWriter::FileWriter(const std::string& file_path): error(false), is_cout(true) {
     if (!file_path.empty()) {
         try {
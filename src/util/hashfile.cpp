@@ -0,0 +1,209 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "internal/hashfile.h"
+#include "internal/util.h"
+
+namespace vhash {
+
+// buffered bytes of records and strings before writing
+static const size_t HASHFILE_BUFFER_SIZE = 1024 * 1024;
+
+bool hashfile_check(const std::string& file_path) {
+    hashfile_header header = {};
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    ssize_t n = read(fd, &header, sizeof(header));
+    close(fd);
+    return n == sizeof(header) && memcmp(header.magic, HASHFILE_MAGIC, sizeof(header.magic)) == 0;
+}
+
+HashFileWriter::HashFileWriter(const std::string& file_path): file_path(file_path), strings_path(file_path + ".strings"),
+                                                              fd(-1), strings_fd(-1), count(0), strings_size(0),
+                                                              shard_index(0), shard_count(0), flags(0), error(0) {
+    fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    strings_fd = open(strings_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || strings_fd < 0) {
+        error = VERROR(errors::ERR_OPEN_FILE);
+        return;
+    }
+    // header is written on close
+    hashfile_header header = {};
+    error = file_write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+    records.reserve(HASHFILE_BUFFER_SIZE);
+    strings.reserve(HASHFILE_BUFFER_SIZE);
+}
+
+HashFileWriter::~HashFileWriter() {
+    close();
+}
+
+bool HashFileWriter::is_open() const {
+    return fd >= 0 && strings_fd >= 0 && error == 0;
+}
+
+int HashFileWriter::append(uint64_t hash, uint64_t size, int64_t mtime, const std::string& path, uint32_t flags) {
+    if (!is_open())
+        return error ? error : VERROR(errors::ERR_OPEN_FILE);
+    hashfile_record record = {hash, size, mtime, strings_size, flags, 0};
+    records.append(reinterpret_cast<const char *>(&record), sizeof(record));
+    strings.append(path.c_str(), path.size() + 1);
+    strings_size += path.size() + 1;
+    count++;
+    if (records.size() >= HASHFILE_BUFFER_SIZE || strings.size() >= HASHFILE_BUFFER_SIZE)
+        return flush();
+    return 0;
+}
+
+void HashFileWriter::set_shard(uint32_t index, uint32_t count) {
+    shard_index = index;
+    shard_count = count;
+}
+
+void HashFileWriter::set_dihedral(bool dihedral) {
+    flags = dihedral ? HASHFILE_DIHEDRAL : 0;
+}
+
+int HashFileWriter::flush() {
+    if (error == 0 && !records.empty())
+        error = file_write_all(fd, records.data(), records.size());
+    if (error == 0 && !strings.empty())
+        error = file_write_all(strings_fd, strings.data(), strings.size());
+    records.clear();
+    strings.clear();
+    return error;
+}
+
+int HashFileWriter::close() {
+    if (fd < 0 && strings_fd < 0)
+        return error;
+    flush();
+
+    // append string table
+    if (error == 0 && lseek(strings_fd, 0, SEEK_SET) == 0) {
+        std::vector<char> buf(HASHFILE_BUFFER_SIZE);
+        ssize_t n = 0;
+        while (error == 0 && (n = read(strings_fd, buf.data(), buf.size())) > 0)
+            error = file_write_all(fd, buf.data(), static_cast<size_t>(n));
+        if (n < 0)
+            error = VERROR(errors::ERR_READ_FILE);
+    }
+
+    // header
+    if (error == 0) {
+        hashfile_header header = {};
+        memcpy(header.magic, HASHFILE_MAGIC, sizeof(header.magic));
+        header.version = HASHFILE_VERSION;
+        header.record_size = sizeof(hashfile_record);
+        header.count = count;
+        header.records_offset = sizeof(hashfile_header);
+        header.strings_offset = sizeof(hashfile_header) + count * sizeof(hashfile_record);
+        header.strings_size = strings_size;
+        header.shard_index = shard_index;
+        header.shard_count = shard_count;
+        header.byte_order = HASHFILE_BYTE_ORDER;
+        header.flags = flags;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+            error = VERROR(errors::ERR_WRITE_FILE);
+    }
+
+    if (fd >= 0) ::close(fd);
+    if (strings_fd >= 0) ::close(strings_fd);
+    unlink(strings_path.c_str());
+    fd = -1;
+    strings_fd = -1;
+    return error;
+}
+
+HashFileReader::HashFileReader(const std::string& file_path): data(nullptr), length(0), records(nullptr),
+                                                              strings(nullptr), strings_size(0), count(0),
+                                                              shard(0), shards(0), flags(0) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(hashfile_header)) {
+        ::close(fd);
+        return;
+    }
+    void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return;
+    data = p;
+    length = static_cast<size_t>(st.st_size);
+
+    // validate layout before exposing records
+    auto header = static_cast<const hashfile_header *>(data);
+    const char *base = static_cast<const char *>(data);
+    bool valid = memcmp(header->magic, HASHFILE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == HASHFILE_VERSION &&
+                 header->byte_order == HASHFILE_BYTE_ORDER &&
+                 header->record_size == sizeof(hashfile_record) &&
+                 header->records_offset == sizeof(hashfile_header) &&
+                 header->count <= (length - header->records_offset) / sizeof(hashfile_record) &&
+                 header->strings_offset == header->records_offset + header->count * sizeof(hashfile_record) &&
+                 header->strings_size <= length - header->strings_offset &&
+                 (header->strings_size == 0 || base[header->strings_offset + header->strings_size - 1] == '\0');
+    if (!valid) {
+        munmap(data, length);
+        data = nullptr;
+        length = 0;
+        return;
+    }
+    records = reinterpret_cast<const hashfile_record *>(base + header->records_offset);
+    strings = base + header->strings_offset;
+    strings_size = header->strings_size;
+    count = header->count;
+    shard = header->shard_index;
+    shards = header->shard_count;
+    flags = header->flags;
+#ifdef MADV_SEQUENTIAL
+    madvise(data, length, MADV_SEQUENTIAL);
+#endif
+}
+
+HashFileReader::~HashFileReader() {
+    if (data)
+        munmap(data, length);
+}
+
+bool HashFileReader::is_open() const {
+    return data != nullptr;
+}
+
+uint64_t HashFileReader::size() const {
+    return count;
+}
+
+uint32_t HashFileReader::shard_index() const {
+    return shard;
+}
+
+uint32_t HashFileReader::shard_count() const {
+    return shards;
+}
+
+bool HashFileReader::dihedral() const {
+    return (flags & HASHFILE_DIHEDRAL) != 0;
+}
+
+}
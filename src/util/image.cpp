@@ -0,0 +1,121 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cstdlib>
+#include <cstring>
+#include "internal/util.h"
+
+namespace vhash {
+
+static inline uint32_t read_be16(const uint8_t *p) {
+    return static_cast<uint32_t>(p[0]) << 8 | p[1];
+}
+
+static inline uint32_t read_be32(const uint8_t *p) {
+    return read_be16(p) << 16 | read_be16(p + 2);
+}
+
+static inline uint32_t read_le16(const uint8_t *p) {
+    return static_cast<uint32_t>(p[1]) << 8 | p[0];
+}
+
+static inline uint32_t read_le24(const uint8_t *p) {
+    return static_cast<uint32_t>(p[2]) << 16 | read_le16(p);
+}
+
+static inline uint32_t read_le32(const uint8_t *p) {
+    return read_le16(p + 2) << 16 | read_le16(p);
+}
+
+static int jpeg_probe(const uint8_t *p, size_t len, int& rows, int& cols) {
+    size_t pos = 2;
+    while (pos + 4 <= len) {
+        if (p[pos] != 0xFF)
+            return VERROR(errors::ERR_DECODE_IMAGE);
+        uint8_t marker = p[pos + 1];
+        if (marker == 0xFF) {       // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {     // markers without length
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA)   // end of image or start of scan before frame header
+            break;
+        uint32_t seg_len = read_be16(p + pos + 2);
+        // start of frame, except DHT, JPG and DAC
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (pos + 9 > len)
+                break;
+            rows = static_cast<int>(read_be16(p + pos + 5));
+            cols = static_cast<int>(read_be16(p + pos + 7));
+            return 0;
+        }
+        pos += 2 + seg_len;
+    }
+    return VERROR(errors::ERR_DECODE_IMAGE);
+}
+
+static int webp_probe(const uint8_t *p, size_t len, int& rows, int& cols) {
+    if (len < 30)
+        return VERROR(errors::ERR_DECODE_IMAGE);
+    if (memcmp(p + 12, "VP8 ", 4) == 0) {
+        cols = static_cast<int>(read_le16(p + 26) & 0x3FFF);
+        rows = static_cast<int>(read_le16(p + 28) & 0x3FFF);
+    } else if (memcmp(p + 12, "VP8L", 4) == 0) {
+        uint32_t bits = read_le32(p + 21);
+        cols = static_cast<int>((bits & 0x3FFF) + 1);
+        rows = static_cast<int>(((bits >> 14) & 0x3FFF) + 1);
+    } else if (memcmp(p + 12, "VP8X", 4) == 0) {
+        cols = static_cast<int>(read_le24(p + 24) + 1);
+        rows = static_cast<int>(read_le24(p + 27) + 1);
+    } else {
+        return VERROR(errors::ERR_DECODE_IMAGE);
+    }
+    return 0;
+}
+
+int image_probe(const std::vector<uint8_t>& data, int& rows, int& cols) {
+    const uint8_t *p = data.data();
+    size_t len = data.size();
+    rows = 0;
+    cols = 0;
+
+    static const uint8_t png_sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (len >= 24 && memcmp(p, png_sig, 8) == 0 && memcmp(p + 12, "IHDR", 4) == 0) {
+        cols = static_cast<int>(read_be32(p + 16));
+        rows = static_cast<int>(read_be32(p + 20));
+        return 0;
+    }
+    if (len >= 4 && p[0] == 0xFF && p[1] == 0xD8)
+        return jpeg_probe(p, len, rows, cols);
+    if (len >= 10 && (memcmp(p, "GIF87a", 6) == 0 || memcmp(p, "GIF89a", 6) == 0)) {
+        cols = static_cast<int>(read_le16(p + 6));
+        rows = static_cast<int>(read_le16(p + 8));
+        return 0;
+    }
+    if (len >= 26 && p[0] == 'B' && p[1] == 'M') {
+        cols = std::abs(static_cast<int32_t>(read_le32(p + 18)));
+        rows = std::abs(static_cast<int32_t>(read_le32(p + 22)));   // negative height is top-down bitmap
+        return 0;
+    }
+    if (len >= 16 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0)
+        return webp_probe(p, len, rows, cols);
+    return VERROR(errors::ERR_UNKNOWN_TYPE);
+}
+
+}
@@ -0,0 +1,200 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "internal/journal.h"
+#include "internal/util.h"
+
+namespace vhash {
+
+// buffered bytes of lines before writing
+static const size_t JOURNAL_BUFFER_SIZE = 64 * 1024;
+
+// at most this much progress is lost on crash
+static const std::chrono::seconds JOURNAL_SYNC_INTERVAL(1);
+
+Journal::Journal(const std::string& file_path, bool resume, uint32_t mode): file_path(file_path), fd(-1), error(0),
+                                                                            file_mode(mode), stop(false) {
+    buffer.reserve(JOURNAL_BUFFER_SIZE);
+    writing.reserve(JOURNAL_BUFFER_SIZE);
+    if (resume)
+        error = load();
+    if (error == 0 && file_mode != mode)
+        error = VERROR(errors::ERR_PARAM_INVALID);
+    if (error == 0) {
+        fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+        struct stat st = {};
+        if (fd < 0 || fstat(fd, &st) != 0)
+            error = VERROR(errors::ERR_OPEN_FILE);
+        else if (st.st_size == 0)
+            buffer.append("#mode\t").append(std::to_string(mode)).push_back('\n');
+    }
+    if (error == 0)
+        th = std::thread(&Journal::run, this);
+}
+
+Journal::~Journal() {
+    close();
+}
+
+// parse header line of "#mode n" and lines of "hash size mtime path", the valid length ends at the last complete
+// line, a torn header leaves the journal empty
+int Journal::load() {
+    int in = open(file_path.c_str(), O_RDONLY);
+    if (in < 0)
+        return errno == ENOENT ? 0 : VERROR(errors::ERR_OPEN_FILE);
+
+    std::string data;
+    std::vector<char> buf(JOURNAL_BUFFER_SIZE * 16);
+    ssize_t n;
+    while ((n = read(in, buf.data(), buf.size())) > 0)
+        data.append(buf.data(), static_cast<size_t>(n));
+    ::close(in);
+    if (n < 0)
+        return VERROR(errors::ERR_READ_FILE);
+
+    size_t valid = 0;
+    size_t pos = 0;
+    file_mode = 0;
+    size_t header = strlen("#mode\t");
+    if (data.compare(0, header, "#mode\t") == 0 && data.find('\n') != std::string::npos) {
+        char *end = nullptr;
+        file_mode = static_cast<uint32_t>(std::strtoul(data.c_str() + header, &end, 10));
+        if (*end != '\n')
+            return VERROR(errors::ERR_READ_FILE);
+        pos = static_cast<size_t>(end - data.c_str()) + 1;
+        valid = pos;
+    }
+    while (pos < data.size()) {
+        size_t eol = data.find('\n', pos);
+        if (eol == std::string::npos)
+            break;
+        data[eol] = '\0';
+        const char *line = data.c_str() + pos;
+        char *end = nullptr;
+        journal_entry entry = {};
+        entry.hash = std::strtoull(line, &end, 16);
+        if (*end != '\t') break;
+        entry.size = std::strtoull(end + 1, &end, 10);
+        if (*end != '\t') break;
+        entry.mtime = std::strtoll(end + 1, &end, 10);
+        if (*end != '\t' || end[1] == '\0') break;
+        entries[std::string(end + 1)] = entry;
+        pos = eol + 1;
+        valid = pos;
+    }
+
+    // drop torn tail, appended lines would be glued to it
+    if (valid < data.size() && truncate(file_path.c_str(), static_cast<off_t>(valid)) != 0)
+        return VERROR(errors::ERR_WRITE_FILE);
+    return 0;
+}
+
+bool Journal::is_open() const {
+    std::lock_guard<std::mutex> lock_gd{lock};
+    return fd >= 0 && error == 0 && !stop;
+}
+
+size_t Journal::size() const {
+    return entries.size();
+}
+
+uint32_t Journal::mode() const {
+    return file_mode;
+}
+
+bool Journal::find(const std::string& path, uint64_t size, int64_t mtime, uint64_t& hash) const {
+    auto it = entries.find(path);
+    if (it == entries.end() || it->second.size != size || it->second.mtime != mtime)
+        return false;
+    hash = it->second.hash;
+    return true;
+}
+
+int Journal::append(uint64_t hash, uint64_t size, int64_t mtime, const std::string& path) {
+    // a path with line break can not be journaled, it will be hashed again on resume
+    if (path.find('\n') != std::string::npos)
+        return is_open() ? 0 : error ? error : VERROR(errors::ERR_OPEN_FILE);
+
+    char head[64];
+    int len = snprintf(head, sizeof(head), "%llx\t%llu\t%lld\t", static_cast<unsigned long long>(hash),
+                       static_cast<unsigned long long>(size), static_cast<long long>(mtime));
+    std::lock_guard<std::mutex> lock_gd{lock};
+    if (fd < 0 || error != 0 || stop)
+        return error ? error : VERROR(errors::ERR_OPEN_FILE);
+    buffer.append(head, static_cast<size_t>(len)).append(path).push_back('\n');
+    if (buffer.size() >= JOURNAL_BUFFER_SIZE)
+        cond.notify_one();
+    return 0;
+}
+
+void Journal::run() {
+    auto synced = std::chrono::steady_clock::now();
+    bool unsynced = false;
+    std::unique_lock<std::mutex> lk(lock);
+    while (true) {
+        // lines are synced on time even while a slow file holds up appending
+        cond.wait_until(lk, synced + JOURNAL_SYNC_INTERVAL, [this] {
+            return stop || buffer.size() >= JOURNAL_BUFFER_SIZE;
+        });
+        bool stopping = stop;
+        bool failed = error != 0;
+        writing.swap(buffer);
+        lk.unlock();
+        int rtn = 0;
+        if (!failed && !writing.empty()) {
+            rtn = file_write_all(fd, writing.data(), writing.size());
+            unsynced = true;
+        }
+        writing.clear();
+        // full buffers are written as they come, syncing is once per interval
+        auto now = std::chrono::steady_clock::now();
+        if (stopping || now - synced >= JOURNAL_SYNC_INTERVAL) {
+            if (rtn == 0 && !failed && unsynced && fsync(fd) != 0)
+                rtn = VERROR(errors::ERR_WRITE_FILE);
+            unsynced = false;
+            synced = now;
+        }
+        lk.lock();
+        if (error == 0)
+            error = rtn;
+        if (stopping)
+            break;
+    }
+}
+
+int Journal::close() {
+    {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        stop = true;
+    }
+    cond.notify_one();
+    if (th.joinable())
+        th.join();
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    return error;
+}
+
+}
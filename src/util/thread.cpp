@@ -0,0 +1,138 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "internal/util.h"
+
+namespace vhash {
+
+// read first line of file
+static bool read_line(const std::string& file_path, std::string& line) {
+    std::ifstream in(file_path);
+    return in && std::getline(in, line);
+}
+
+// cgroup v2 cpu.max is "max 100000" or "<quota> <period>", returns cpus or 0 if unlimited
+static double cgroup_v2_quota(const std::string& dir) {
+    std::string line;
+    if (!read_line(dir + "/cpu.max", line))
+        return 0;
+    std::istringstream in(line);
+    std::string quota;
+    double period = 0;
+    in >> quota >> period;
+    if (quota == "max" || period <= 0)
+        return 0;
+    return std::stod(quota) / period;
+}
+
+// cgroup v1 cfs quota is -1 if unlimited
+static double cgroup_v1_quota(const std::string& dir) {
+    std::string quota, period;
+    if (!read_line(dir + "/cpu.cfs_quota_us", quota) || !read_line(dir + "/cpu.cfs_period_us", period))
+        return 0;
+    double q = std::stod(quota), p = std::stod(period);
+    if (q <= 0 || p <= 0)
+        return 0;
+    return q / p;
+}
+
+// smallest quota of cgroup of process and its parents, 0 if unlimited
+static double cgroup_cpu_quota() {
+    double cpus = 0;
+    auto take = [&cpus](double quota) {
+        if (quota > 0 && (cpus == 0 || quota < cpus))
+            cpus = quota;
+    };
+
+    std::ifstream in("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(in, line)) {
+        // hierarchy-id:controllers:path, v2 has empty controllers
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos)
+            continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        std::string root;
+        bool v2 = controllers.empty();
+        if (v2) {
+            root = "/sys/fs/cgroup";
+        } else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+            struct stat st = {};
+            bool has_cpu = stat("/sys/fs/cgroup/cpu", &st) == 0 && S_ISDIR(st.st_mode);
+            root = has_cpu ? "/sys/fs/cgroup/cpu" : "/sys/fs/cgroup/cpu,cpuacct";
+        } else {
+            continue;
+        }
+
+        // inside a cgroup namespace path is relative to the mounted root
+        while (true) {
+            std::string dir = root + (path == "/" ? "" : path);
+            take(v2 ? cgroup_v2_quota(dir) : cgroup_v1_quota(dir));
+            if (path.empty() || path == "/")
+                break;
+            path = path.substr(0, path.rfind('/'));
+            if (path.empty()) path = "/";
+        }
+    }
+    return cpus;
+}
+
+static int affinity_cpus() {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        return CPU_COUNT(&set);
+#endif
+    return static_cast<int>(std::thread::hardware_concurrency());
+}
+
+int thread_budget_cpus() {
+    static const int cpus = [] {
+        int n = affinity_cpus();
+        double quota = cgroup_cpu_quota();
+        if (quota > 0)
+            n = n > 0 ? std::min(n, static_cast<int>(std::ceil(quota))) : static_cast<int>(std::ceil(quota));
+        return std::max(n, 1);
+    }();
+    return cpus;
+}
+
+thread_budget thread_budget_make(int cpus, int decode_jobs, int hash_jobs) {
+    thread_budget budget;
+    budget.cpus = std::max(cpus, 1);
+    // hashing a decoded image is cheap compared to decoding it
+    budget.hash_jobs = hash_jobs > 0 ? hash_jobs : std::max(1, budget.cpus / 4);
+    budget.decode_jobs = decode_jobs > 0 ? decode_jobs : std::max(1, budget.cpus - budget.hash_jobs);
+    // cpus left over by hash workers and fewer decode workers go to threads inside each decode
+    budget.inner_threads = std::max(1, (budget.cpus - budget.hash_jobs) / budget.decode_jobs);
+    return budget;
+}
+
+void thread_budget_apply(const thread_budget& budget) {
+    cv::setNumThreads(budget.inner_threads);
+    video_set_codec_threads(budget.inner_threads);
+}
+
+}
@@ -53,11 +53,30 @@ inline void VideoDecoder::init() {
     peek_frame_idx = 0;
     video_duration = 0;
     end_of_stream = false;
+    budget = DecodeBudget::current();
+}
+
+// abort blocking demuxing once decode budget is spent
+static int video_interrupt(void *opaque) {
+    return static_cast<DecodeBudget *>(opaque)->expired() ? 1 : 0;
+}
+
+// format context polling decode budget of calling thread, null if no budget is set
+static AVFormatContext *video_alloc_context(DecodeBudget *budget) {
+    if (!budget)
+        return nullptr;
+    AVFormatContext *ctx = avformat_alloc_context();
+    if (ctx) {
+        ctx->interrupt_callback.callback = video_interrupt;
+        ctx->interrupt_callback.opaque = budget;
+    }
+    return ctx;
 }
 
 inline void VideoDecoder::open() {
     int rtn;
     // open input
+    afctx = video_alloc_context(budget);
     rtn = avformat_open_input(&afctx, file.c_str(), nullptr, nullptr);
     if(rtn < 0) {
         spdlog::error("couldn't open video stream: {}", file);
@@ -103,6 +122,9 @@ inline void VideoDecoder::open() {
         return;
     }
 
+    if (video_codec_threads() > 0)
+        avctx->thread_count = video_codec_threads();
+
     rtn = avcodec_open2(avctx, vcodec, nullptr);
     if(rtn < 0) {
         spdlog::error("unable to open video stream: {}", file);
@@ -169,7 +191,14 @@ int VideoDecoder::read(cv::Mat &mat) {
         return false;
 
     AVPacket *pkt = av_packet_alloc();
+    int64_t packets = 0;
     do {
+        if (budget && budget->spent(++packets)) {
+            spdlog::error("decode budget of video is spent: {}", file);
+            end_of_stream = true;
+            break;
+        }
+
         // read packet from input
         rtn = av_read_frame(afctx, pkt);
         if(rtn < 0) {
@@ -229,7 +258,14 @@ int VideoDecoder::peek(cv::Mat &mat) {
     }
 
     AVPacket *pkt = av_packet_alloc();
+    int64_t packets = 0;
     do {
+        if (budget && budget->spent(++packets)) {
+            spdlog::error("decode budget of video is spent: {}", file);
+            end_of_stream = true;
+            break;
+        }
+
         // read packet from input
         rtn = av_read_frame(afctx, pkt);
         if(rtn < 0) {
@@ -424,4 +460,36 @@ ColorType video_get_dominant_color(const cv::Mat& mat, int resize, int min_perce
     return dominant_color_of_image();
 }
 
+static std::atomic<int> codec_threads{0};
+
+void video_set_codec_threads(int threads) {
+    codec_threads = threads;
+}
+
+int video_codec_threads() {
+    return codec_threads.load();
+}
+
+int video_probe(const std::string& file, int& rows, int& cols, double& seconds) {
+    rows = 0;
+    cols = 0;
+    seconds = 0;
+    AVFormatContext *afctx = video_alloc_context(DecodeBudget::current());
+    if (avformat_open_input(&afctx, file.c_str(), nullptr, nullptr) < 0)
+        return VERROR(errors::ERR_OPEN_FILE);
+
+    int rtn = VERROR(errors::ERR_MAKE_THUMB);
+    if (avformat_find_stream_info(afctx, nullptr) >= 0) {
+        int idx = av_find_best_stream(afctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (idx >= 0) {
+            rows = afctx->streams[idx]->codecpar->height;
+            cols = afctx->streams[idx]->codecpar->width;
+            seconds = afctx->duration > 0 ? static_cast<double>(afctx->duration) / AV_TIME_BASE : 0;
+            rtn = 0;
+        }
+    }
+    avformat_close_input(&afctx);
+    return rtn;
+}
+
 }
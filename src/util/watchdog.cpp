@@ -0,0 +1,108 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include "spdlog/spdlog.h"
+#include "internal/util.h"
+
+namespace vhash {
+
+static thread_local DecodeBudget *current_budget = nullptr;
+
+DecodeBudget *DecodeBudget::current() {
+    return current_budget;
+}
+
+void DecodeBudget::set_current(DecodeBudget *budget) {
+    current_budget = budget;
+}
+
+Watchdog::Watchdog(double timeout): timeout(timeout), expired_num(0), stop(false) {
+    if (timeout > 0)
+        th = std::thread(&Watchdog::run, this);
+}
+
+Watchdog::~Watchdog() {
+    {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        stop = true;
+    }
+    cond.notify_all();
+    if (th.joinable())
+        th.join();
+}
+
+void Watchdog::watch(DecodeBudget *budget, const std::string& name) {
+    if (!th.joinable())
+        return;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    {
+        std::lock_guard<std::mutex> lock_gd{lock};
+        entries[budget] = entry{deadline, name};
+    }
+    cond.notify_all();
+}
+
+void Watchdog::unwatch(DecodeBudget *budget) {
+    if (!th.joinable())
+        return;
+    std::lock_guard<std::mutex> lock_gd{lock};
+    entries.erase(budget);
+}
+
+int64_t Watchdog::expired() const {
+    std::lock_guard<std::mutex> lock_gd{lock};
+    return expired_num;
+}
+
+// sleep until the nearest deadline, entries are as many as decoding workers
+void Watchdog::run() {
+    std::unique_lock<std::mutex> uni_lock{lock};
+    while (!stop) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->second.deadline <= now) {
+                it->first->expire();
+                expired_num++;
+                spdlog::warn("decoding \"{}\" exceeded time budget of {}s", it->second.name, timeout.count());
+                it = entries.erase(it);
+            } else {
+                next = std::min(next, it->second.deadline);
+                ++it;
+            }
+        }
+        if (next == std::chrono::steady_clock::time_point::max())
+            cond.wait(uni_lock);
+        else
+            cond.wait_until(uni_lock, next);
+    }
+}
+
+DecodeScope::DecodeScope(Watchdog *watchdog, const std::string& name, int64_t max_steps):
+        watchdog(watchdog), budget(max_steps), prev(DecodeBudget::current()) {
+    DecodeBudget::set_current(&budget);
+    if (watchdog)
+        watchdog->watch(&budget, name);
+}
+
+DecodeScope::~DecodeScope() {
+    if (watchdog)
+        watchdog->unwatch(&budget);
+    DecodeBudget::set_current(prev);
+}
+
+}
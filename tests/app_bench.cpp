@@ -0,0 +1,181 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <benchmark/benchmark.h>
+#include "vhash_app.h"
+#include "internal/app.h"
+
+using namespace vhash;
+
+// scheduling overhead of each item passing through 5 stages without any work
+static void BM_pipeline(benchmark::State& state) {
+    int64_t n = state.range(0);
+    for (auto _ : state) {
+        Pipeline<int64_t> pipeline;
+        for (int i = 0; i < 5; i++) {
+            pipeline.add_stage(std::to_string(i), 2, 0, [i](int64_t& item) -> size_t {
+                return i + 1;
+            });
+        }
+        pipeline.start();
+        for (int64_t i = 0; i < n; i++)
+            pipeline.push(i);
+        pipeline.finish();
+    }
+    state.counters["per_file"] = benchmark::Counter(static_cast<double>(n),
+            benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_pipeline)->Arg(1)->Arg(100)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+// hash command over a folder of tiny images
+static void BM_hash_cmd_tiny_images(benchmark::State& state) {
+    std::string dir = "/tmp/test_vhash_tiny_images";
+    scanner_mkdir(dir, 0755);
+    cv::Mat image(8, 8, CV_8UC1);
+    for (int i = 0; i < state.range(0); i++) {
+        cv::randu(image, 0, 255);
+        cv::imwrite(dir + "/" + std::to_string(i) + ".png", image);
+    }
+
+    hash_config conf;
+    conf.path = dir;
+    conf.output = "/tmp/test_vhash_tiny_images.txt";
+    conf.no_progress = true;
+    for (auto _ : state) {
+        hash_cmd(conf);
+    }
+    state.counters["per_file"] = benchmark::Counter(static_cast<double>(state.range(0)),
+            benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_hash_cmd_tiny_images)->Arg(1)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+// synthetic mixed corpus, many small images with a few large images and videos
+static void app_bench_mixed_corpus(const std::string& dir) {
+    scanner_mkdir(dir, 0755);
+    cv::Mat small(64, 64, CV_8UC1);
+    for (int i = 0; i < 400; i++) {
+        cv::randu(small, 0, 255);
+        cv::imwrite(dir + "/small_" + std::to_string(i) + ".png", small);
+    }
+    cv::Mat large(2048, 2048, CV_8UC1);
+    for (int i = 0; i < 4; i++) {
+        cv::randu(large, 0, 255);
+        cv::imwrite(dir + "/large_" + std::to_string(i) + ".png", large);
+    }
+    cv::Mat frame(480, 640, CV_8UC3);
+    for (int i = 0; i < 2; i++) {
+        cv::VideoWriter writer(dir + "/video_" + std::to_string(i) + ".avi",
+                               cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 25, frame.size());
+        for (int j = 0; j < 750; j++) {
+            cv::randu(frame, 0, 255);
+            writer.write(frame);
+        }
+    }
+}
+
+// makespan of hash command over mixed corpus, 0: fifo, 1: lpt, 2: lpt with a decode job reserved for images
+static void BM_hash_cmd_mixed_schedule(benchmark::State& state) {
+    std::string dir = "/tmp/test_vhash_mixed_corpus";
+    if (!scanner_check_is_folder(dir))
+        app_bench_mixed_corpus(dir);
+
+    hash_config conf;
+    conf.path = dir;
+    conf.output = "/tmp/test_vhash_mixed_corpus.txt";
+    conf.no_progress = true;
+    conf.jobs = 4;
+    conf.schedule = state.range(0) == 0 ? "fifo" : "lpt";
+    conf.image_jobs = state.range(0) == 2 ? 1 : 0;
+    for (auto _ : state) {
+        hash_cmd(conf);
+    }
+}
+BENCHMARK(BM_hash_cmd_mixed_schedule)->Arg(0)->Arg(1)->Arg(2)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// throughput of hash command over mixed corpus with default jobs, 0: without thread budget, 1: with thread budget
+static void BM_hash_cmd_thread_budget(benchmark::State& state) {
+    std::string dir = "/tmp/test_vhash_mixed_corpus";
+    if (!scanner_check_is_folder(dir))
+        app_bench_mixed_corpus(dir);
+
+    hash_config conf;
+    conf.path = dir;
+    conf.output = "/tmp/test_vhash_mixed_corpus.txt";
+    conf.no_progress = true;
+    conf.no_thread_budget = state.range(0) == 0;
+    for (auto _ : state) {
+        hash_cmd(conf);
+    }
+    state.counters["cpus"] = thread_budget_cpus();
+}
+BENCHMARK(BM_hash_cmd_thread_budget)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// dup command over a library of distinct photos with a few resized copies, 0: full hash of all files, 1: tiered
+static void BM_dup_cmd_tiered(benchmark::State& state) {
+    std::string dir = "/tmp/test_vhash_photo_library";
+    if (!scanner_check_is_folder(dir)) {
+        scanner_mkdir(dir, 0755);
+        cv::Mat photo(1536, 2048, CV_8UC3);
+        for (int i = 0; i < 200; i++) {
+            cv::randu(photo, 0, 255);
+            cv::GaussianBlur(photo, photo, cv::Size(31, 31), 0);
+            cv::imwrite(dir + "/" + std::to_string(i) + ".jpg", photo);
+            if (i % 20 == 0) {
+                cv::Mat copy;
+                cv::resize(photo, copy, cv::Size(1024, 768), 0, 0, cv::INTER_AREA);
+                cv::imwrite(dir + "/copy_" + std::to_string(i) + ".jpg", copy);
+            }
+        }
+    }
+
+    dup_config conf;
+    conf.path = dir;
+    conf.output = "/tmp/test_vhash_photo_library.txt";
+    conf.no_progress = true;
+    conf.distance = 4;
+    conf.tiered = state.range(0) == 1;
+    for (auto _ : state) {
+        dup_cmd(conf);
+    }
+}
+BENCHMARK(BM_dup_cmd_tiered)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// formatting and writing records of hash command, 0: FileWriter under lock, 1: AsyncWriter
+static void BM_output_writer(benchmark::State& state) {
+    const int64_t n = 100000;
+    std::string path = "/tmp/test_vhash_output_writer.txt";
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            FileWriter fw(path);
+            std::mutex fw_lock;
+            for (int64_t i = 0; i < n; i++) {
+                std::lock_guard<std::mutex> lock(fw_lock);
+                fw << "FILE: " << "/some/dir/image_" << i << ".jpg" << "\n";
+                fw << "HASH: 0x" << std::hex << i * 0x9E3779B97F4A7C15ULL << std::dec << "\n";
+            }
+        } else {
+            AsyncWriter<app_record> writer(path, app_format_record);
+            for (int64_t i = 0; i < n; i++) {
+                writer.write(i, app_record{"/some/dir/image_" + std::to_string(i) + ".jpg", i * 0x9E3779B97F4A7C15ULL});
+            }
+            writer.close();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_output_writer)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,192 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <csignal>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "vhash_app.h"
+#include "internal/app.h"
+
+using namespace vhash;
+
+// file lines of journal, its header and a torn last line are not counted
+static size_t count_lines(const std::string& path) {
+    std::ifstream in(path);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t lines = static_cast<size_t>(std::count(content.begin(), content.end(), '\n'));
+    return content[0] == '#' && lines > 0 ? lines - 1 : lines;
+}
+
+// hash values of files by path
+static std::map<std::string, uint64_t> hash_all(const hash_config& conf, app_stats& stats) {
+    std::map<std::string, uint64_t> hvs;
+    std::mutex lock;
+    EXPECT_EQ(app_hash_files(conf, db_cache(""), stats, [&](const app_file& file, uint64_t hv) {
+        std::lock_guard<std::mutex> guard(lock);
+        hvs[file.path] = hv;
+    }), 0);
+    return hvs;
+}
+
+TEST(app, journal_kill_resume)
+{
+    std::string dir = "/tmp/test_vhash_resume";
+    std::string journal = "/tmp/test_vhash_resume.journal";
+    system(("rm -rf " + dir).c_str());
+    std::remove(journal.c_str());
+    scanner_mkdir(dir, 0755);
+    const size_t n = 400;
+    cv::Mat image(8, 8, CV_8UC1);
+    std::string gate = dir + "/gate.png";
+    for (size_t i = 0; i < n; i++) {
+        cv::randu(image, 0, 255);
+        cv::imwrite(dir + "/" + std::to_string(i) + ".png", image);
+        // fifo amid the files, so files are scanned on both sides of it
+        if (i == n / 2)
+            ASSERT_EQ(mkfifo(gate.c_str(), 0644), 0);
+    }
+
+    hash_config conf;
+    conf.path = dir;
+    conf.journal = journal;
+    conf.output = "/tmp/test_vhash_resume.txt";
+    conf.no_progress = true;
+    conf.io_jobs = 1;
+
+    // the killed run blocks its only reader on the fifo, files read before it are hashed and synced to the journal
+    // within the sync interval, files after it are not
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0)
+        _exit(hash_cmd(conf) == 0 ? 0 : 1);
+    for (int i = 0; i < 60000 && count_lines(journal) == 0; i++)
+        usleep(1000);
+    kill(pid, SIGKILL);
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFSIGNALED(status));
+    size_t journaled = count_lines(journal);
+    ASSERT_GT(journaled, 0u);
+    ASSERT_LT(journaled, n);
+    unlink(gate.c_str());
+
+    // resumed run skips journaled files and hashes the rest
+    app_stats resumed_stats;
+    conf.resume = true;
+    auto resumed = hash_all(conf, resumed_stats);
+    EXPECT_EQ(static_cast<size_t>(resumed_stats.resumed.load()), journaled);
+    EXPECT_EQ(static_cast<size_t>(resumed_stats.hashed.load()), n - journaled);
+    // journaled files skip reading and decoding, the cost of resuming is of the rest only
+    for (auto& st : resumed_stats.stages) {
+        if (st.name == "read" || st.name == "decode")
+            EXPECT_EQ(static_cast<size_t>(st.processed), n - journaled) << st.name;
+    }
+
+    app_stats stats;
+    conf.journal.clear();
+    conf.resume = false;
+    auto expected = hash_all(conf, stats);
+    EXPECT_EQ(expected.size(), n);
+    EXPECT_EQ(resumed, expected);
+    system(("rm -rf " + dir).c_str());
+    std::remove(journal.c_str());
+    std::remove(conf.output.c_str());
+}
+
+TEST(app, inode_table_status)
+{
+    inode_table inodes;
+    file_id id{1, 42};
+    uint64_t hv = 0;
+    bool cached = false, failed = false, timeout = false;
+    EXPECT_EQ(inodes.acquire(id, app_path{"/a.mp4", 0}, hv, cached, failed, timeout), inode_table::state::OWNER);
+    EXPECT_EQ(inodes.acquire(id, app_path{"/b.mp4", 1}, hv, cached, failed, timeout), inode_table::state::PENDING);
+    auto links = inodes.release(id, 0, false, true, true);
+    ASSERT_EQ(links.size(), 1u);
+    EXPECT_EQ(links[0].path, "/b.mp4");
+
+    // a link after its owner timed out is a timeout too
+    EXPECT_EQ(inodes.acquire(id, app_path{"/c.mp4", 2}, hv, cached, failed, timeout), inode_table::state::DONE);
+    EXPECT_TRUE(failed);
+    EXPECT_TRUE(timeout);
+}
+
+TEST(app, dangling_links)
+{
+    // files without stat are not links of one another
+    std::string dir = "/tmp/test_vhash_dangling";
+    system(("rm -rf " + dir).c_str());
+    scanner_mkdir(dir, 0755);
+    cv::Mat image(8, 8, CV_8UC1);
+    cv::randu(image, 0, 255);
+    cv::imwrite(dir + "/0.png", image);
+    ASSERT_EQ(symlink((dir + "/none1.png").c_str(), (dir + "/1.png").c_str()), 0);
+    ASSERT_EQ(symlink((dir + "/none2.png").c_str(), (dir + "/2.png").c_str()), 0);
+
+    hash_config conf;
+    conf.path = dir;
+    conf.no_progress = true;
+    app_stats stats;
+    auto hvs = hash_all(conf, stats);
+    EXPECT_EQ(hvs.size(), 3u);
+    EXPECT_EQ(hvs.count(dir + "/1.png"), 1u);
+    EXPECT_EQ(hvs.count(dir + "/2.png"), 1u);
+    system(("rm -rf " + dir).c_str());
+}
+
+TEST(app, cached_zero_cheap_hash)
+{
+    // a cheap hash of 0 is cached like any other
+    std::string dir = "/tmp/test_vhash_cheap";
+    std::string cache = "/tmp/test_vhash_cheap.sqlite";
+    system(("rm -rf " + dir).c_str());
+    std::remove(cache.c_str());
+    scanner_mkdir(dir, 0755);
+    std::ofstream(dir + "/0.jpg") << "X7:0";
+    std::ofstream(dir + "/1.jpg") << "X8:3";
+
+    hash_config conf;
+    conf.path = dir;
+    conf.no_progress = true;
+    conf.use_cache = true;
+    db_cache db(cache);
+    ASSERT_EQ(db.init(), 0);
+    auto known = [](const app_file&, uint64_t&) { return false; };
+    std::map<std::string, uint64_t> first, second;
+    std::mutex lock;
+    app_stats stats;
+    ASSERT_EQ(app_hash_files(conf, db, stats, [&](const app_file& file, uint64_t hv) {
+        std::lock_guard<std::mutex> guard(lock);
+        first[file.path] = hv;
+    }, known, app_tier::CHEAP), 0);
+    EXPECT_EQ(first[dir + "/0.jpg"], 0u);
+
+    app_stats cached_stats;
+    ASSERT_EQ(app_hash_files(conf, db, cached_stats, [&](const app_file& file, uint64_t hv) {
+        std::lock_guard<std::mutex> guard(lock);
+        second[file.path] = hv;
+    }, known, app_tier::CHEAP), 0);
+    EXPECT_EQ(cached_stats.cached.load(), 2);
+    EXPECT_EQ(second, first);
+    system(("rm -rf " + dir).c_str());
+    std::remove(cache.c_str());
+}
@@ -15,6 +15,7 @@
 // THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <gtest/gtest.h>
+#include <cstdio>
 #include "internal/cache.h"
 
 using namespace vhash;
@@ -53,6 +54,44 @@ TEST(cache, db)
     ASSERT_EQ(v.size(), 1);
     EXPECT_EQ(v[0].file_size, 2048);
 
+    // cheap tier
+    item.cheap_hash = 0x9abc;
+    item.cheap_only = true;
+    rtn = db.set(item);
+    ASSERT_EQ(rtn, 0);
+    v = db.get(key);
+    ASSERT_EQ(v.size(), 1);
+    EXPECT_EQ(v[0].cheap_hash, 0x9abc);
+    EXPECT_FALSE(v[0].has_cheap);
+    EXPECT_TRUE(v[0].cheap_only);
+
+    // a cheap hash of 0 is flagged apart from a missing one
+    item.cheap_hash = 0;
+    item.has_cheap = true;
+    rtn = db.set(item);
+    ASSERT_EQ(rtn, 0);
+    v = db.get(key);
+    ASSERT_EQ(v.size(), 1);
+    EXPECT_EQ(v[0].cheap_hash, 0u);
+    EXPECT_TRUE(v[0].has_cheap);
+
+    // dihedral file hash
+    item.dihedral = true;
+    rtn = db.set(item);
+    ASSERT_EQ(rtn, 0);
+    v = db.get(key);
+    ASSERT_EQ(v.size(), 1);
+    EXPECT_TRUE(v[0].dihedral);
+
+    // timeout is flagged apart from file hash
+    item.timeout = true;
+    rtn = db.set(item);
+    ASSERT_EQ(rtn, 0);
+    v = db.get(key);
+    ASSERT_EQ(v.size(), 1);
+    EXPECT_TRUE(v[0].timeout);
+    EXPECT_EQ(v[0].file_hash, 0x12345678);
+
     // delete
     rtn = db.del(key);
     ASSERT_EQ(rtn, 0);
@@ -68,6 +107,36 @@ TEST(cache, db)
     ASSERT_EQ(v.size(), 0);
 }
 
+TEST(cache, merge)
+{
+    std::remove("/tmp/test_vhash_db_shard0.sqlite");
+    std::remove("/tmp/test_vhash_db_shard1.sqlite");
+    db_cache db0("/tmp/test_vhash_db_shard0.sqlite");
+    db_cache db1("/tmp/test_vhash_db_shard1.sqlite");
+    ASSERT_EQ(db0.init(), 0);
+    ASSERT_EQ(db1.init(), 0);
+
+    for (int i = 0; i < 1000; i++) {
+        auto item = cache_item {
+            .parent="/data/shard" + std::to_string(i % 2),
+            .file="file_" + std::to_string(i) + ".jpg",
+            .file_size=i,
+            .file_update_ts=1652849680,
+            .file_hash=static_cast<uint64_t>(i),
+        };
+        ASSERT_EQ((i % 2 ? db1 : db0).set(item), 0);
+    }
+
+    // rows of shard 1 are added, rows of shard 0 are kept
+    EXPECT_EQ(db0.merge(db1), 500);
+    auto v = db0.get(cache_item{.parent="/data/shard1", .file="file_999.jpg"});
+    ASSERT_EQ(v.size(), 1);
+    EXPECT_EQ(v[0].file_hash, 999);
+    v = db0.get(cache_item{.parent="/data/shard0", .file="file_998.jpg"});
+    ASSERT_EQ(v.size(), 1);
+    EXPECT_EQ(v[0].file_size, 998);
+}
+
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
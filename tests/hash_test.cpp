@@ -35,6 +35,17 @@ TEST(hash, video)
     EXPECT_NE(hv, 0);
 }
 
+TEST(hash, reduced)
+{
+    hasher h(FileType::TP_IMAGE, HashType::TP_DHASH, true);
+    h.load("tests/testdata/lena.png");
+    EXPECT_NE(h.hash(), 0);
+
+    hasher v(FileType::TP_VIDEO, HashType::TP_DHASH, true);
+    v.load("tests/testdata/video.mp4");
+    EXPECT_NE(v.hash(), 0);
+}
+
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
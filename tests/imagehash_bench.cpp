@@ -51,4 +51,20 @@ static void BM_whash(benchmark::State& state) {
 }
 BENCHMARK(BM_whash);
 
+static void BM_phash_dihedral(benchmark::State& state) {
+    phash<8> h(4, true);
+    h.load("tests/testdata/lena.png");
+    for (auto _ : state)
+        h.hash();
+}
+BENCHMARK(BM_phash_dihedral);
+
+static void BM_whash_dihedral(benchmark::State& state) {
+    whash<8> h("haar", 0, true, true);
+    h.load("tests/testdata/lena.png");
+    for (auto _ : state)
+        h.hash();
+}
+BENCHMARK(BM_whash_dihedral);
+
 BENCHMARK_MAIN();
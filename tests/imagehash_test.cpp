@@ -155,6 +155,30 @@ TEST(imagehash, whash)
     EXPECT_NE(hv.uint64(), 0);
 }
 
+TEST(imagehash, dihedral)
+{
+    cv::Mat image = cv::imread("tests/testdata/lena.png");
+    ASSERT_FALSE(image.empty());
+    std::vector<cv::Mat> variants(4);
+    cv::flip(image, variants[0], 1);
+    cv::flip(image, variants[1], -1);
+    cv::rotate(image, variants[2], cv::ROTATE_90_CLOCKWISE);
+    cv::transpose(image, variants[3]);
+
+    phash<8> ph(4, true);
+    whash<8> wh("haar", 0, true, true);
+    ph.load(image);
+    wh.load(image);
+    auto phv = ph.hash();
+    auto whv = wh.hash();
+    for (auto& variant : variants) {
+        ph.load(variant);
+        wh.load(variant);
+        EXPECT_EQ(ph.hash(), phv);
+        EXPECT_EQ(wh.hash(), whv);
+    }
+}
+
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,389 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+#include <unordered_map>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "internal/index.h"
+#include "internal/store.h"
+#include "vhash_index.h"
+
+using namespace vhash;
+
+static const int QUERY_RADIUS = 4;
+
+// random hashes around centers, as near duplicates cluster in real collections
+static const std::vector<uint64_t>& bench_hashes(size_t n) {
+    static std::map<size_t, std::vector<uint64_t>> cache;
+    auto& hashes = cache[n];
+    if (hashes.empty()) {
+        std::mt19937_64 rng(42);
+        std::vector<uint64_t> centers(n / 100 + 1);
+        for (auto& c : centers)
+            c = rng();
+        hashes.resize(n);
+        for (auto& hv : hashes) {
+            hv = centers[rng() % centers.size()];
+            for (int k = 0; k < 12; k++)
+                hv ^= 1ULL << (rng() % 64);
+        }
+    }
+    return hashes;
+}
+
+static void BM_bktree_build(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    for (auto _ : state) {
+        BKTree tree(hashes);
+        benchmark::DoNotOptimize(tree.size());
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+}
+BENCHMARK(BM_bktree_build)->Arg(1000000)->Arg(10000000)->Unit(benchmark::kMillisecond);
+
+static void BM_bktree_query(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    BKTree tree(hashes);
+    size_t q = 0, hits = 0;
+    for (auto _ : state) {
+        tree.radius(hashes[q], QUERY_RADIUS, [&hits](uint32_t, int) { hits++; });
+        q = (q + 7919) % hashes.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+    benchmark::DoNotOptimize(hits);
+}
+BENCHMARK(BM_bktree_query)->Arg(1000000)->Arg(10000000)->Unit(benchmark::kMicrosecond);
+
+static void BM_brute_force_query(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    size_t q = 0, hits = 0;
+    for (auto _ : state) {
+        uint64_t hv = hashes[q];
+        for (auto h : hashes)
+            hits += hamming_distance(hv, h) <= QUERY_RADIUS;
+        q = (q + 7919) % hashes.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+    benchmark::DoNotOptimize(hits);
+}
+BENCHMARK(BM_brute_force_query)->Arg(1000000)->Arg(10000000)->Unit(benchmark::kMicrosecond);
+
+static void BM_mih_build(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    for (auto _ : state) {
+        MIHIndex index(hashes, QUERY_RADIUS);
+        benchmark::DoNotOptimize(index.size());
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+}
+BENCHMARK(BM_mih_build)->Arg(1000000)->Arg(10000000)->Arg(100000000)->Unit(benchmark::kMillisecond)->Iterations(1);
+
+static void BM_mih_query(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    MIHIndex index(hashes, QUERY_RADIUS);
+    size_t q = 0, hits = 0;
+    for (auto _ : state) {
+        index.radius(hashes[q], QUERY_RADIUS, [&hits](uint32_t, int) { hits++; });
+        q = (q + 7919) % hashes.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["substrings"] = index.substrings();
+    benchmark::DoNotOptimize(hits);
+}
+BENCHMARK(BM_mih_query)->Arg(1000000)->Arg(10000000)->Arg(100000000)->Unit(benchmark::kMicrosecond);
+
+// index directory with a base segment of n bench hashes, kept across runs as large ones take minutes to write
+static const std::string& bench_store(size_t n) {
+    static std::map<size_t, std::string> cache;
+    auto& dir = cache[n];
+    if (dir.empty()) {
+        dir = "/tmp/vhash_bench_store_" + std::to_string(n);
+        IndexSegment written(dir + "/base.vhi");
+        if (written.is_open() && written.size() == n && written.tables_num() > 0)
+            return dir;
+        system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+        auto& hashes = bench_hashes(n);
+        // fixed width paths sort as their ids
+        std::vector<uint32_t> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::sort(ids.begin(), ids.end(), [&hashes](uint32_t a, uint32_t b) {
+            return hashes[a] != hashes[b] ? hashes[a] < hashes[b] : a < b;
+        });
+        IndexSegmentWriter writer(dir + "/base.vhi", 0, true);
+        char path[32];
+        for (auto id : ids) {
+            snprintf(path, sizeof(path), "/bench/%010u", id);
+            writer.append(hashes[id], 0, 0, path, 0);
+        }
+        writer.close();
+    }
+    return dir;
+}
+
+// near duplicates of indexed files queried one at a time, k nearest or all within radius if k is 0
+static void BM_store_query(benchmark::State& state) {
+    auto n = static_cast<size_t>(state.range(0));
+    auto k = static_cast<size_t>(state.range(1));
+    auto& hashes = bench_hashes(n);
+    hash_index index(bench_store(n));
+    std::mt19937_64 rng(7);
+    std::vector<index_match> matches;
+    std::vector<double> latency;
+    size_t hits = 0;
+    // a serving index is warm, queries before timing fault in the mapped pages they touch
+    auto warm = std::chrono::steady_clock::now() + std::chrono::seconds(2 + n / 5000000);
+    while (std::chrono::steady_clock::now() < warm)
+        index.query(hashes[rng() % n], k, k > 0 ? 64 : QUERY_RADIUS, matches);
+    for (auto _ : state) {
+        uint64_t hv = hashes[rng() % n] ^ (1ULL << (rng() % 64)) ^ (1ULL << (rng() % 64));
+        auto start = std::chrono::steady_clock::now();
+        index.query(hv, k, k > 0 ? 64 : QUERY_RADIUS, matches);
+        latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        hits += matches.size();
+    }
+    std::sort(latency.begin(), latency.end());
+    state.SetItemsProcessed(state.iterations());
+    state.counters["p50_us"] = latency[latency.size() / 2];
+    state.counters["p99_us"] = latency[latency.size() * 99 / 100];
+    state.counters["matches"] = static_cast<double>(hits) / latency.size();
+}
+BENCHMARK(BM_store_query)->Args({10000000, 0})->Args({10000000, 1})->Args({10000000, 10})
+    ->Args({100000000, 0})->Args({100000000, 1})->Args({100000000, 10})->Unit(benchmark::kMicrosecond);
+
+// parallel self join throughput in queries per second
+static void BM_join_match(benchmark::State& state) {
+    auto& hashes = bench_hashes(JOIN_BLOCK_SIZE);
+    std::vector<uint32_t> out(hashes.size());
+    size_t q = 0, hits = 0;
+    for (auto _ : state) {
+        hits += join_match(hashes[q], hashes.data(), hashes.size(), QUERY_RADIUS, out.data());
+        q = (q + 1) % hashes.size();
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+    state.SetLabel(join_kernel());
+    benchmark::DoNotOptimize(hits);
+}
+BENCHMARK(BM_join_match);
+
+// self joins take set size and radius, joins beat indexes on mid-size sets and larger radius
+static void BM_block_join(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    auto r = static_cast<int>(state.range(1));
+    ThreadPool pool;
+    for (auto _ : state) {
+        std::atomic<size_t> pairs(0);
+        index_block_join(hashes, r, pool, [&pairs](uint32_t, uint32_t) { pairs++; });
+        benchmark::DoNotOptimize(pairs.load());
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+    state.SetLabel(join_kernel());
+}
+BENCHMARK(BM_block_join)->Args({100000, 4})->Args({100000, 8})->Args({1000000, 8})
+    ->Unit(benchmark::kSecond)->Iterations(1)->UseRealTime();
+
+static void BM_bktree_self_join(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    auto r = static_cast<int>(state.range(1));
+    BKTree tree(hashes);
+    ThreadPool pool;
+    for (auto _ : state) {
+        std::atomic<size_t> pairs(0);
+        index_self_join(tree, hashes, r, pool, [&pairs](uint32_t, uint32_t) { pairs++; });
+        benchmark::DoNotOptimize(pairs.load());
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+}
+BENCHMARK(BM_bktree_self_join)->Args({100000, 4})->Args({100000, 8})
+    ->Unit(benchmark::kSecond)->Iterations(1)->UseRealTime();
+
+static void BM_mih_self_join(benchmark::State& state) {
+    auto& hashes = bench_hashes(state.range(0));
+    auto r = static_cast<int>(state.range(1));
+    MIHIndex index(hashes, r);
+    ThreadPool pool;
+    for (auto _ : state) {
+        std::atomic<size_t> pairs(0);
+        index_self_join(index, hashes, r, pool, [&pairs](uint32_t, uint32_t) { pairs++; });
+        benchmark::DoNotOptimize(pairs.load());
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+}
+BENCHMARK(BM_mih_self_join)->Args({100000, 4})->Args({100000, 8})->Args({1000000, 4})->Args({1000000, 8})
+    ->Unit(benchmark::kSecond)->Iterations(1)->UseRealTime();
+
+// a dense cluster of near identical frames links O(n^2) pairs into groups of O(n) memory
+static void BM_near_groups_dense(benchmark::State& state) {
+    std::mt19937_64 rng(7);
+    uint64_t center = rng();
+    std::vector<uint64_t> hashes(state.range(0));
+    for (auto& hv : hashes)
+        hv = center ^ 1ULL << (rng() % 64) ^ 1ULL << (rng() % 64);
+    ThreadPool pool;
+    for (auto _ : state) {
+        NearGroups groups(hashes, 0);
+        size_t members = 0;
+        index_block_join(hashes, QUERY_RADIUS, pool, [&groups](uint32_t i, uint32_t j) {
+            groups.link(i, j);
+        }, [&](size_t end) {
+            groups.flush(end, [&members](const std::vector<uint32_t>& g) { members += g.size(); });
+        });
+        benchmark::DoNotOptimize(members);
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+}
+BENCHMARK(BM_near_groups_dense)->Arg(20000)->Unit(benchmark::kSecond)->Iterations(1)->UseRealTime();
+
+// resident memory of process in bytes, 0 if unknown
+static uint64_t bench_current_rss() {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return static_cast<uint64_t>(resident) * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+// f fills results in a child process, peak rss of the process is the highest of all cases run before, a child
+// starts its peak anew, so the peak grown over its starting rss is of this case alone, returned in MB
+static double bench_in_child(const std::function<void(uint64_t *results)>& f, uint64_t *results, size_t n) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::vector<uint64_t> out(n + 1);
+        uint64_t base = bench_current_rss();
+        f(out.data());
+        uint64_t peak = memory_peak_rss();
+        out[n] = peak > base ? peak - base : 0;
+        ssize_t size = static_cast<ssize_t>(out.size() * sizeof(uint64_t));
+        _exit(write(fds[1], out.data(), out.size() * sizeof(uint64_t)) == size ? 0 : 1);
+    }
+    close(fds[1]);
+    std::vector<uint64_t> out(n + 1);
+    ssize_t size = static_cast<ssize_t>(out.size() * sizeof(uint64_t));
+    bool ok = pid > 0 && read(fds[0], out.data(), out.size() * sizeof(uint64_t)) == size;
+    close(fds[0]);
+    int status = 0;
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    std::copy(out.begin(), out.begin() + n, results);
+    return out[n] / (1024.0 * 1024.0);
+}
+
+// exact grouping of synthetic files, 1 of 4 files duplicates another, 0: map of path strings, 1: HashGroups
+// each case runs in a child process, so its peak rss is not hidden by larger cases run before it
+static void BM_dup_groups(benchmark::State& state) {
+    auto n = static_cast<size_t>(state.range(0));
+    auto kind = state.range(1);
+    auto run = [n, kind](uint64_t *results) {
+        ThreadPool pool;
+        std::mt19937_64 rng(5);
+        char path[64];
+        auto file_path = [&path](size_t i) {
+            return snprintf(path, sizeof(path), "/data/library/%04zu/IMG_%08zu.jpg", i / 10000, i);
+    };
+    uint64_t groups_num = 0;
+    if (kind == 0) {
+        std::unordered_map<uint64_t, std::vector<std::string>> map;
+        uint64_t hv = 0;
+        for (size_t i = 0; i < n; i++) {
+            hv = i % 4 == 3 ? hv : rng();
+            map[hv].emplace_back(path, file_path(i));
+        }
+        for (auto& m : map)
+            groups_num += m.second.size() > 1;
+    } else {
+        HashGroups groups;
+        uint64_t hv = 0;
+        for (size_t i = 0; i < n; i++) {
+            hv = i % 4 == 3 ? hv : rng();
+            groups.add(0, hv, path, file_path(i));
+        }
+        groups.sort(pool);
+        groups.for_each_run([&groups_num](uint64_t, const HashGroups::entry *begin, const HashGroups::entry *end) {
+            groups_num += end - begin > 1;
+        });
+    }
+    results[0] = groups_num;
+    };
+    uint64_t groups_num = 0;
+    double rss_mb = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto _ : state)
+        rss_mb = bench_in_child(run, &groups_num, 1);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    state.counters["groups"] = static_cast<double>(groups_num);
+    state.counters["seconds"] = seconds / state.iterations();
+    state.counters["peak_rss_mb"] = rss_mb;
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_dup_groups)->Args({1000000, 0})->Args({1000000, 1})->Args({10000000, 0})->Args({10000000, 1})
+    ->Args({50000000, 1})->Unit(benchmark::kSecond)->Iterations(1)->UseRealTime();
+
+// directory groups of synthetic albums of 100 files, 1 of 10 albums copies the one before it, 1 of 10 shares 90 of
+// its files with the one before it, similarity 0 finds exact copies only, each case runs in a child process
+static void BM_dir_groups(benchmark::State& state) {
+    auto n = static_cast<size_t>(state.range(0));
+    double similarity = state.range(1) / 100.0;
+    std::vector<std::pair<uint64_t, std::string>> files;
+    std::mt19937_64 rng(9);
+    char path[64];
+    for (size_t i = 0; i < n; i++) {
+        size_t album = i / 100, kind = album % 10;
+        bool copied = kind == 1 || (kind == 2 && i % 100 < 90);
+        uint64_t hv = copied ? files[i - 100].first : rng();
+        snprintf(path, sizeof(path), "/data/library/%03zu/%06zu/IMG_%08zu.jpg", album / 1000, album, i);
+        files.emplace_back(hv, path);
+    }
+    // files are built before the child starts, its rss grows by groups only
+    auto run = [&files, similarity](uint64_t *results) {
+        DirGroups dirs(similarity);
+        for (auto& f : files)
+            dirs.add(f.first, f.second.c_str());
+        dirs.build();
+        results[0] = dirs.exact().size();
+        results[1] = dirs.similar().size();
+        results[2] = 0;
+        for (size_t i = 0; i < files.size(); i++)
+            results[2] += dirs.covered(i);
+    };
+    uint64_t results[3] = {};
+    double rss_mb = 0;
+    for (auto _ : state)
+        rss_mb = bench_in_child(run, results, 3);
+    state.counters["exact"] = static_cast<double>(results[0]);
+    state.counters["similar"] = static_cast<double>(results[1]);
+    state.counters["covered"] = static_cast<double>(results[2]);
+    state.counters["peak_rss_mb"] = rss_mb;
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_dir_groups)->Args({1000000, 0})->Args({1000000, 80})->Unit(benchmark::kSecond)->Iterations(1)->UseRealTime();
+
+BENCHMARK_MAIN();
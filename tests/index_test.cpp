@@ -0,0 +1,767 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include "internal/external.h"
+#include "internal/index.h"
+#include "internal/scan.h"
+#include "internal/store.h"
+#include "vhash_index.h"
+
+using namespace vhash;
+
+// hashes with near duplicates of a few flipped bits
+static std::vector<uint64_t> make_hashes(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++) {
+        if (i % 4 == 3) {
+            uint64_t hv = hashes[i - 1];
+            for (int k = 0; k < 3; k++)
+                hv ^= 1ULL << (rng() % 64);
+            hashes[i] = hv;
+        } else {
+            hashes[i] = rng();
+        }
+    }
+    return hashes;
+}
+
+TEST(index, bktree_radius)
+{
+    auto hashes = make_hashes(20000, 1);
+    BKTree tree(hashes);
+    EXPECT_EQ(tree.size(), hashes.size());
+
+    for (int r : {0, 3, 8}) {
+        for (size_t q = 0; q < hashes.size(); q += 997) {
+            std::vector<uint32_t> found, expected;
+            tree.radius(hashes[q], r, [&](uint32_t id, int d) {
+                EXPECT_EQ(d, hamming_distance(hashes[q], hashes[id]));
+                found.push_back(id);
+            });
+            for (uint32_t i = 0; i < hashes.size(); i++) {
+                if (hamming_distance(hashes[q], hashes[i]) <= r)
+                    expected.push_back(i);
+            }
+            std::sort(found.begin(), found.end());
+            EXPECT_EQ(found, expected);
+        }
+    }
+
+    // many copies of a hash sit in one duplicate list instead of a chain of nodes
+    std::vector<uint64_t> copies(5000, 0xABCDULL);
+    copies.push_back(0xABCEULL);
+    BKTree dup_tree(copies);
+    EXPECT_EQ(dup_tree.size(), copies.size());
+    size_t n = 0;
+    dup_tree.radius(0xABCDULL, 0, [&](uint32_t id, int d) {
+        EXPECT_EQ(copies[id], 0xABCDULL);
+        EXPECT_EQ(d, 0);
+        n++;
+    });
+    EXPECT_EQ(n, 5000u);
+    n = 0;
+    dup_tree.radius(0xABCFULL, 1, [&](uint32_t, int) { n++; });
+    EXPECT_EQ(n, 5001u);
+}
+
+TEST(index, mih_radius)
+{
+    for (size_t n : {0, 1000, 50000}) {
+        auto hashes = make_hashes(n, 3);
+        for (int r : {0, 2, 5, 9}) {
+            MIHIndex index(hashes, r);
+            EXPECT_EQ(index.size(), n);
+            EXPECT_GE(index.substrings(), 1);
+            for (size_t q = 0; q < n; q += 1009) {
+                // query near but not equal to an indexed hash
+                uint64_t hv = hashes[q] ^ (1ULL << (q % 64));
+                std::vector<uint32_t> found, expected;
+                index.radius(hv, r, [&](uint32_t id, int d) {
+                    EXPECT_EQ(d, hamming_distance(hv, hashes[id]));
+                    found.push_back(id);
+                });
+                for (uint32_t i = 0; i < n; i++) {
+                    if (hamming_distance(hv, hashes[i]) <= r)
+                        expected.push_back(i);
+                }
+                std::sort(found.begin(), found.end());
+                EXPECT_EQ(found, expected);
+            }
+        }
+    }
+}
+
+TEST(index, mih_choose_substrings)
+{
+    // larger sets take longer substrings for the same radius
+    EXPECT_GE(MIHIndex::choose_substrings(1000000, 4), 2);
+    EXPECT_LE(MIHIndex::choose_substrings(100000000, 4), MIHIndex::choose_substrings(1000, 4));
+    EXPECT_EQ(index_choose_strategy("auto", 1000, 4), "join");
+    EXPECT_EQ(index_choose_strategy("auto", 10000000, 4), "mih");
+    EXPECT_EQ(index_choose_strategy("auto", 100000, 12), "join");
+    EXPECT_EQ(index_choose_strategy("auto", 10000000, 12), "bktree");
+    EXPECT_EQ(index_choose_strategy("bktree", 1000, 4), "bktree");
+}
+
+TEST(index, self_join_groups)
+{
+    auto hashes = make_hashes(10000, 2);
+    BKTree tree(hashes);
+    ThreadPool pool(4);
+    DisjointSet set(hashes.size());
+    std::atomic<size_t> pairs(0);
+    index_self_join(tree, hashes, 3, pool, [&](uint32_t i, uint32_t j) {
+        EXPECT_LT(i, j);
+        EXPECT_LE(hamming_distance(hashes[i], hashes[j]), 3);
+        set.unite(i, j);
+        pairs++;
+    });
+    EXPECT_GE(pairs, hashes.size() / 4);
+    for (size_t i = 3; i < hashes.size(); i += 4)
+        EXPECT_EQ(set.find(i), set.find(i - 1));
+}
+
+TEST(index, join_match)
+{
+    auto hashes = make_hashes(1000, 4);
+    std::vector<uint32_t> out(hashes.size());
+    // lengths cover the tails of every kernel width
+    for (size_t n : {0, 1, 7, 8, 15, 16, 17, 31, 1000}) {
+        for (int r : {0, 3, 32, 64}) {
+            uint64_t x = hashes[n / 2];
+            std::vector<uint32_t> expected;
+            for (uint32_t j = 0; j < n; j++) {
+                if (hamming_distance(x, hashes[j]) <= r)
+                    expected.push_back(j);
+            }
+            size_t m = join_match(x, hashes.data(), n, r, out.data());
+            EXPECT_EQ(std::vector<uint32_t>(out.begin(), out.begin() + m), expected) << join_kernel();
+        }
+    }
+}
+
+TEST(index, block_join_pairs)
+{
+    // blocks are not full and the diagonal block pairs are half compared
+    auto hashes = make_hashes(JOIN_BLOCK_SIZE * 3 + 123, 5);
+    ThreadPool pool(4);
+    for (int r : {0, 3, 10}) {
+        std::vector<std::pair<uint32_t, uint32_t>> found, expected;
+        std::mutex lock;
+        index_block_join(hashes, r, pool, [&](uint32_t i, uint32_t j) {
+            std::lock_guard<std::mutex> guard(lock);
+            found.emplace_back(i, j);
+        });
+        MIHIndex index(hashes, r);
+        index_self_join(index, hashes, r, pool, [&](uint32_t i, uint32_t j) {
+            std::lock_guard<std::mutex> guard(lock);
+            expected.emplace_back(i, j);
+        });
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        EXPECT_EQ(found, expected);
+        EXPECT_EQ(found.empty(), r == 0);
+    }
+}
+
+TEST(index, disjoint_set_concurrent)
+{
+    // threads unite overlapping ranges of a chain in different orders
+    const uint32_t n = 100000;
+    DisjointSet set(n);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+        threads.emplace_back([&set, t] {
+            for (uint32_t k = 1; k < n; k++) {
+                uint32_t i = t % 2 ? k : n - k;
+                EXPECT_TRUE(set.unite(i - 1, i));
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (uint32_t i = 0; i < n; i++)
+        EXPECT_EQ(set.find(i), 0u);
+
+    // sets of distant hashes are kept apart
+    std::vector<uint64_t> hashes = {0x0, 0x1, 0x3, 0xff};
+    DisjointSet bounded(hashes.size());
+    EXPECT_TRUE(bounded.unite_within(0, 1, hashes.data(), 4));
+    EXPECT_TRUE(bounded.unite_within(1, 2, hashes.data(), 4));
+    EXPECT_FALSE(bounded.unite_within(2, 3, hashes.data(), 4));
+    EXPECT_EQ(bounded.find(2), 0u);
+    EXPECT_EQ(bounded.find(3), 3u);
+}
+
+// index whose queries after the first chunk wait for the gate, with one worker the first chunk is then complete
+struct GatedIndex {
+    const MIHIndex& index;
+    std::shared_future<void> gate;
+    mutable size_t queries;
+
+    template<typename F>
+    void radius(uint64_t hv, int r, F f) const {
+        if (queries++ >= INDEX_QUERY_CHUNK)
+            gate.wait();
+        index.radius(hv, r, f);
+    }
+};
+
+TEST(index, near_groups_stream)
+{
+    // chains of near duplicates across chunks, groups complete before the join ends
+    auto hashes = make_hashes(INDEX_QUERY_CHUNK * 8, 6);
+    for (size_t i = 0; i + 1 < hashes.size(); i += 100)
+        hashes[i + 1] = hashes[i] ^ 1;
+    MIHIndex index(hashes, 3);
+    ThreadPool pool(1);
+    for (int diameter : {0, 4}) {
+        NearGroups groups(hashes, diameter);
+        DisjointSet expected(hashes.size());
+        std::vector<uint32_t> group_of(hashes.size(), UINT32_MAX);
+        size_t flushed = 0, early = 0, first_end = 0;
+        uint32_t group = 0;
+        // the rest of the join waits until groups of the first chunk are handed out
+        std::promise<void> gate;
+        GatedIndex gated{index, gate.get_future().share(), 0};
+        auto flush = [&](size_t end) {
+            groups.flush(end, [&](const std::vector<uint32_t>& members) {
+                EXPECT_TRUE(std::is_sorted(members.begin(), members.end()));
+                for (auto i : members) {
+                    EXPECT_LT(i, end);
+                    EXPECT_EQ(group_of[i], UINT32_MAX);
+                    group_of[i] = group;
+                    if (diameter > 0) {
+                        for (auto j : members)
+                            EXPECT_LE(hamming_distance(hashes[i], hashes[j]), diameter);
+                    }
+                }
+                group++;
+                flushed += members.size();
+                early += first_end == 0 ? members.size() : 0;
+            });
+            if (first_end == 0) {
+                first_end = end;
+                gate.set_value();
+            }
+        };
+        index_self_join(gated, hashes, 3, pool, [&](uint32_t i, uint32_t j) {
+            groups.link(i, j);
+        }, flush);
+        EXPECT_EQ(first_end, INDEX_QUERY_CHUNK);
+        EXPECT_EQ(flushed, hashes.size());
+        // groups of the first chunk are handed out while the join is still running
+        EXPECT_GT(early, 0u);
+        if (diameter > 0)
+            continue;
+        // unbounded groups are the connected components
+        for (uint32_t i = 0; i < hashes.size(); i++) {
+            index.radius(hashes[i], 3, [&](uint32_t j, int) {
+                expected.unite(i, j);
+            });
+        }
+        std::vector<uint32_t> roots(group, UINT32_MAX), groups_of_root(hashes.size(), UINT32_MAX);
+        for (uint32_t i = 0; i < hashes.size(); i++) {
+            uint32_t root = expected.find(i);
+            if (roots[group_of[i]] == UINT32_MAX)
+                roots[group_of[i]] = root;
+            if (groups_of_root[root] == UINT32_MAX)
+                groups_of_root[root] = group_of[i];
+            EXPECT_EQ(roots[group_of[i]], root);
+            EXPECT_EQ(groups_of_root[root], group_of[i]);
+        }
+    }
+}
+
+TEST(index, store_segments)
+{
+    std::string dir = "/tmp/test_vhash_index";
+    system(("rm -rf " + dir).c_str());
+    {
+        IndexStore store(dir);
+        ASSERT_TRUE(store.is_open());
+        // a second run can not open a locked index
+        EXPECT_FALSE(IndexStore(dir).is_open());
+        std::vector<store_entry> entries = {
+            {0x2, 10, 100, "/data/b.png", 0},
+            {0x1, 10, 100, "/data/a.png", 0},
+            {0x2, 10, 100, "/data/c.png", 0},
+            {0x3, 10, 100, "/data/d.png", 0},
+        };
+        EXPECT_EQ(store.append(entries), 0);
+        EXPECT_TRUE(store.needs_compaction());
+        EXPECT_EQ(store.compact(), 0);
+    }
+    {
+        IndexStore store(dir);
+        ASSERT_TRUE(store.is_open());
+        EXPECT_EQ(store.size(), 4u);
+        EXPECT_FALSE(store.needs_compaction());
+        uint64_t pos = 0;
+        const store_record *record = store.find("/data/c.png", &pos);
+        ASSERT_NE(record, nullptr);
+        EXPECT_EQ(record->hash, 0x2u);
+        EXPECT_EQ(pos, 2u);
+        EXPECT_EQ(store.find("/data/e.png"), nullptr);
+
+        // delta changes c, removes d and adds e
+        std::vector<store_entry> entries = {
+            {0x1, 20, 200, "/data/c.png", 0},
+            {0x3, 10, 100, "/data/d.png", STORE_REMOVED},
+            {0x2, 10, 100, "/data/e.png", 0},
+        };
+        EXPECT_EQ(store.append(entries), 0);
+        EXPECT_EQ(store.find("/data/c.png")->hash, 0x1u);
+        EXPECT_EQ(store.find("/data/d.png"), nullptr);
+
+        std::vector<std::pair<uint64_t, std::vector<std::string>>> groups;
+        store.for_each_group([&](uint64_t hv, const std::vector<const char *>& paths) {
+            groups.emplace_back(hv, std::vector<std::string>(paths.begin(), paths.end()));
+        });
+        std::vector<std::pair<uint64_t, std::vector<std::string>>> expected = {
+            {0x1, {"/data/a.png", "/data/c.png"}},
+            {0x2, {"/data/b.png", "/data/e.png"}},
+        };
+        EXPECT_EQ(groups, expected);
+
+        size_t live = 0;
+        store.for_each_live([&](uint64_t, const char *, const store_record&) { live++; });
+        EXPECT_EQ(live, 4u);
+        EXPECT_EQ(store.compact(), 0);
+    }
+    {
+        // compacted base holds only live records
+        IndexStore store(dir);
+        ASSERT_TRUE(store.is_open());
+        EXPECT_EQ(store.size(), 4u);
+        EXPECT_EQ(store.find("/data/c.png")->size, 20u);
+        EXPECT_EQ(store.find("/data/d.png"), nullptr);
+    }
+    EXPECT_TRUE(store_check(dir));
+    EXPECT_FALSE(store_check("/tmp"));
+    EXPECT_EQ(store_remove(dir), 0);
+    EXPECT_FALSE(scanner_check_exists(dir));
+}
+
+// overwrite bytes of file at offset
+static void patch_file(const std::string& path, uint64_t offset, const void *data, size_t n) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.write(static_cast<const char *>(data), static_cast<std::streamsize>(n));
+}
+
+TEST(index, store_validation)
+{
+    std::string path = "/tmp/test_vhash_segment.vhi";
+    auto write_segment = [&path]() {
+        IndexSegmentWriter writer(path, 1);
+        EXPECT_EQ(writer.append(0x1, 10, 100, "/data/a.png", 0), 0);
+        EXPECT_EQ(writer.append(0x1, 10, 100, "/data/b.png", 0), 0);
+        EXPECT_EQ(writer.append(0x2, 10, 100, "/data/c.png", 0), 0);
+        EXPECT_EQ(writer.close(), 0);
+        // spill files are gone once the segment is written
+        EXPECT_FALSE(scanner_check_exists(path + ".hashes.tmp"));
+    };
+    write_segment();
+    EXPECT_EQ(IndexSegment(path).size(), 3u);
+    store_header header = {};
+    std::ifstream(path, std::ios::binary).read(reinterpret_cast<char *>(&header), sizeof(header));
+
+    // posting list beyond records
+    uint64_t posting = 7;
+    patch_file(path, header.postings_offset + sizeof(uint64_t), &posting, sizeof(posting));
+    EXPECT_FALSE(IndexSegment(path).is_open());
+
+    // path id beyond records
+    write_segment();
+    uint32_t id = 3;
+    patch_file(path, header.paths_offset, &id, sizeof(id));
+    EXPECT_FALSE(IndexSegment(path).is_open());
+
+    // segment written on a machine of the other byte order
+    write_segment();
+    uint64_t order = __builtin_bswap64(STORE_BYTE_ORDER);
+    patch_file(path, offsetof(store_header, byte_order), &order, sizeof(order));
+    EXPECT_FALSE(IndexSegment(path).is_open());
+    unlink(path.c_str());
+
+    // spill files left by a crash are removed on open
+    std::string dir = "/tmp/test_vhash_index_spill";
+    system(("rm -rf " + dir).c_str());
+    ASSERT_EQ(mkdir(dir.c_str(), 0755), 0);
+    std::string leftover = dir + "/delta-0000000001.vhi.tmp.hashes.tmp";
+    std::ofstream(leftover) << "x";
+    {
+        IndexStore store(dir);
+        ASSERT_TRUE(store.is_open());
+    }
+    EXPECT_FALSE(scanner_check_exists(leftover));
+    EXPECT_EQ(store_remove(dir), 0);
+}
+
+TEST(index, store_query)
+{
+    std::string dir = "/tmp/test_vhash_query";
+    system(("rm -rf " + dir).c_str());
+    auto hashes = make_hashes(20000, 11);
+    std::map<std::string, uint64_t> live;
+    std::vector<store_entry> entries;
+    for (size_t i = 0; i < hashes.size(); i++) {
+        std::string path = "/data/" + std::to_string(i) + ".png";
+        entries.push_back({hashes[i], 10, 100, path, 0});
+        live[path] = hashes[i];
+    }
+    {
+        IndexStore store(dir);
+        ASSERT_TRUE(store.is_open());
+        ASSERT_EQ(store.append(entries), 0);
+        ASSERT_EQ(store.compact(), 0);
+    }
+
+    // base with substring tables and a delta changing and removing files of it
+    IndexStore store(dir);
+    ASSERT_TRUE(store.is_open());
+    entries.clear();
+    for (size_t i = 0; i < hashes.size(); i += 50) {
+        std::string path = "/data/" + std::to_string(i) + ".png";
+        if (i % 100 == 0) {
+            entries.push_back({hashes[i], 10, 100, path, STORE_REMOVED});
+            live.erase(path);
+        } else {
+            entries.push_back({hashes[i] ^ 0xff, 20, 200, path, 0});
+            live[path] = hashes[i] ^ 0xff;
+        }
+    }
+    ASSERT_EQ(store.append(entries), 0);
+
+    // read only views are opened while the index is locked
+    IndexStore reader(dir, true);
+    ASSERT_TRUE(reader.is_open());
+    hash_index index(dir);
+    ASSERT_TRUE(index.is_open());
+    EXPECT_EQ(index.size(), store.size());
+
+    auto expect = [&live](uint64_t hv, size_t k, int r) {
+        std::vector<std::pair<int, std::string>> found;
+        for (auto& it : live) {
+            int d = hamming_distance(hv, it.second);
+            if (d <= r)
+                found.emplace_back(d, it.first);
+        }
+        std::sort(found.begin(), found.end());
+        if (k > 0 && found.size() > k)
+            found.resize(k);
+        return found;
+    };
+
+    std::mt19937_64 rng(12);
+    std::vector<uint64_t> queries;
+    for (int q = 0; q < 40; q++) {
+        uint64_t hv = hashes[rng() % hashes.size()];
+        for (int k = 0; k < q % 5; k++)
+            hv ^= 1ULL << (rng() % 64);
+        queries.push_back(hv);
+    }
+    for (auto hv : queries) {
+        for (int r : {0, 4, 8, 12}) {
+            std::vector<store_match> out;
+            reader.radius(hv, r, out);
+            std::vector<std::pair<int, std::string>> found;
+            for (auto& m : out)
+                found.emplace_back(m.distance, m.path);
+            EXPECT_EQ(found, expect(hv, 0, r));
+        }
+        for (size_t k : {1, 5}) {
+            std::vector<index_match> matches;
+            ASSERT_EQ(index.query(hv, k, 64, matches), 0);
+            std::vector<std::pair<int, std::string>> found;
+            for (auto& m : matches)
+                found.emplace_back(m.distance, m.path);
+            EXPECT_EQ(found, expect(hv, k, 64));
+        }
+    }
+
+    // batch answers match single queries
+    std::vector<std::vector<index_match>> batch;
+    ASSERT_EQ(index.query(queries, 3, 10, batch, 2), 0);
+    ASSERT_EQ(batch.size(), queries.size());
+    for (size_t q = 0; q < queries.size(); q++) {
+        std::vector<index_match> matches;
+        index.query(queries[q], 3, 10, matches);
+        ASSERT_EQ(batch[q].size(), matches.size());
+        for (size_t i = 0; i < matches.size(); i++)
+            EXPECT_EQ(batch[q][i].path, matches[i].path);
+    }
+
+    // records hashed in the other dihedral mode are not matched
+    entries.clear();
+    std::map<std::string, uint64_t> dihedral;
+    for (size_t i = 25; i < hashes.size(); i += 50) {
+        std::string path = "/data/" + std::to_string(i) + ".png";
+        entries.push_back({hashes[i], 10, 100, path, STORE_DIHEDRAL});
+        dihedral[path] = hashes[i];
+        live.erase(path);
+    }
+    ASSERT_EQ(store.append(entries), 0);
+    IndexStore flipped(dir, true);
+    ASSERT_TRUE(flipped.is_open());
+    hash_index dihedral_index(dir, true);
+    ASSERT_TRUE(dihedral_index.is_open());
+    for (auto hv : queries) {
+        std::vector<store_match> out;
+        flipped.radius(hv, 12, out);
+        std::vector<std::pair<int, std::string>> found;
+        for (auto& m : out)
+            found.emplace_back(m.distance, m.path);
+        EXPECT_EQ(found, expect(hv, 0, 12));
+
+        std::vector<index_match> matches;
+        ASSERT_EQ(dihedral_index.query(hv, 0, 12, matches), 0);
+        for (auto& m : matches)
+            EXPECT_EQ(dihedral.count(m.path), 1u);
+    }
+    std::vector<index_match> matches;
+    ASSERT_EQ(dihedral_index.query(dihedral.begin()->second, 1, 0, matches), 0);
+    ASSERT_EQ(matches.size(), 1u);
+    EXPECT_EQ(matches[0].path, dihedral.begin()->first);
+    system(("rm -rf " + dir).c_str());
+}
+
+TEST(index, hash_groups)
+{
+    // threads fill their own slots, hashes repeat across slots
+    const size_t slots = 4, n = 50000;
+    HashGroups groups(slots);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < slots; t++) {
+        threads.emplace_back([&groups, t] {
+            std::mt19937_64 rng(t);
+            for (size_t i = 0; i < n; i++) {
+                uint64_t hv = rng() % 20000 * 0x9E3779B97F4A7C15ULL;
+                groups.add(t, hv, std::to_string(t) + "/" + std::to_string(i));
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    std::string longest(GROUP_ARENA_BLOCK + 10, 'x');
+    groups.add(0, 1, longest);
+    groups.add(0, 1, "short");
+    EXPECT_EQ(groups.size(), slots * n + 2);
+
+    std::map<uint64_t, std::vector<std::string>> expected;
+    for (size_t t = 0; t < slots; t++) {
+        std::mt19937_64 rng(t);
+        for (size_t i = 0; i < n; i++)
+            expected[rng() % 20000 * 0x9E3779B97F4A7C15ULL].push_back(std::to_string(t) + "/" + std::to_string(i));
+    }
+    expected[1] = {longest, "short"};
+
+    ThreadPool pool(4);
+    groups.sort(pool);
+    EXPECT_EQ(groups.entries().size(), slots * n + 2);
+    auto it = expected.begin();
+    groups.for_each_run([&](uint64_t hv, const HashGroups::entry *begin, const HashGroups::entry *end) {
+        ASSERT_NE(it, expected.end());
+        EXPECT_EQ(hv, it->first);
+        // paths keep the order of slots and of addition
+        std::vector<std::string> paths;
+        for (auto e = begin; e != end; e++)
+            paths.emplace_back(e->path);
+        EXPECT_EQ(paths, it->second);
+        ++it;
+    });
+    EXPECT_EQ(it, expected.end());
+}
+
+TEST(index, external_groups)
+{
+    // synthetic files far beyond the memory cap, a quarter are near or exact copies
+    const size_t n = 300000;
+    const int distance = 3;
+    auto hashes = make_hashes(n, 11);
+    for (size_t i = 5; i < n; i += 7)
+        hashes[i] = hashes[i - 5];
+    std::string dir = "/tmp/test_vhash_external";
+    scanner_mkdir(dir, 0755);
+
+    ExternalGroups external(dir, EXTERNAL_MIN_MEMORY);
+    ASSERT_TRUE(external.is_open());
+    HashGroups groups;
+    for (size_t i = 0; i < n; i++) {
+        std::string path = "/some/dir/" + std::to_string(i) + ".jpg";
+        ASSERT_EQ(external.add(hashes[i], path), 0);
+        groups.add(0, hashes[i], path);
+    }
+    EXPECT_EQ(external.size(), n);
+
+    // exact groups equal sorted runs of memory
+    ThreadPool pool;
+    groups.sort(pool);
+    std::vector<std::pair<uint64_t, std::vector<std::string>>> expected, found;
+    groups.for_each_run([&](uint64_t hv, const HashGroups::entry *begin, const HashGroups::entry *end) {
+        if (end - begin < 2)
+            return;
+        expected.emplace_back(hv, std::vector<std::string>());
+        for (auto e = begin; e != end; e++)
+            expected.back().second.emplace_back(e->path);
+    });
+    ASSERT_EQ(external.for_each_group(0, 0, [&](uint64_t hv, const std::vector<std::string>& paths) {
+        found.emplace_back(hv, paths);
+    }), 0);
+    EXPECT_GT(external.runs(), 16u);
+    EXPECT_GT(external.passes(), 1u);
+    EXPECT_EQ(found, expected);
+
+    // every pair within distance is found in a group of its first equal band
+    auto file_of = [](const std::string& path) {
+        return std::stoul(path.substr(path.find_last_of('/') + 1));
+    };
+    std::vector<std::vector<uint32_t>> groups_of(n);
+    uint32_t g = 0;
+    ASSERT_EQ(external.for_each_group(distance, 0, [&](uint64_t hv, const std::vector<std::string>& paths) {
+        for (auto& path : paths) {
+            size_t i = file_of(path);
+            EXPECT_LE(hv, hashes[i]);
+            groups_of[i].push_back(g);
+        }
+        g++;
+    }), 0);
+    MIHIndex index(hashes, distance);
+    size_t pairs = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        index.radius(hashes[i], distance, [&](uint32_t j, int) {
+            if (j <= i)
+                return;
+            pairs++;
+            bool shared = false;
+            for (auto a : groups_of[i])
+                shared = shared || std::find(groups_of[j].begin(), groups_of[j].end(), a) != groups_of[j].end();
+            EXPECT_TRUE(shared) << i << " " << j;
+        });
+    }
+    EXPECT_GT(pairs, n / 4);
+}
+
+TEST(index, external_exact)
+{
+    // one hash shared by more files than memory holds records of, streamed as one group
+    const size_t n = 60000;
+    std::string dir = "/tmp/test_vhash_external";
+    scanner_mkdir(dir, 0755);
+    ExternalGroups external(dir, EXTERNAL_MIN_MEMORY);
+    ASSERT_TRUE(external.is_open());
+    for (size_t i = 0; i < n; i++)
+        ASSERT_EQ(external.add(i % 3 == 0 ? 0x1234 : 0x5678 + i, "/d/" + std::to_string(i)), 0);
+
+    size_t groups = 0, files = 0;
+    std::vector<bool> seen(n);
+    ASSERT_EQ(external.for_each_exact([&](uint64_t hv, const std::string& path, bool first) {
+        EXPECT_EQ(hv, 0x1234u);
+        groups += first;
+        files++;
+        size_t i = std::stoul(path.substr(3));
+        EXPECT_EQ(i % 3, 0u);
+        seen[i] = true;
+    }), 0);
+    EXPECT_EQ(groups, 1u);
+    EXPECT_EQ(files, n / 3);
+    EXPECT_EQ(std::count(seen.begin(), seen.end(), true), static_cast<long>(n / 3));
+
+    // groups of vectors are not capped either
+    ASSERT_EQ(external.for_each_group(0, 0, [&](uint64_t hv, const std::vector<std::string>& paths) {
+        EXPECT_EQ(hv, 0x1234u);
+        EXPECT_EQ(paths.size(), n / 3);
+    }), 0);
+}
+
+TEST(index, dir_groups)
+{
+    DirGroups dirs(0.5);
+    std::vector<std::pair<uint64_t, std::string>> files;
+    // B copies A under other names, C only wraps a third copy, sub directories of copies are implied
+    for (std::string dir : {"/r/A", "/r/B", "/r/C/inner"}) {
+        for (uint64_t i = 1; i <= 6; i++)
+            files.emplace_back(i * 0x9E3779B97F4A7C15ULL, dir + "/" + dir.substr(3, 1) + std::to_string(i) + ".jpg");
+        files.emplace_back(11, dir + "/sub/s1.jpg");
+        files.emplace_back(12, dir + "/sub/s2.jpg");
+    }
+    // D shares 7 of 9 hashes with A, E shares one file with A
+    for (uint64_t i = 1; i <= 6; i++)
+        files.emplace_back(i * 0x9E3779B97F4A7C15ULL, "/r/D/d" + std::to_string(i) + ".jpg");
+    files.emplace_back(11, "/r/D/d11.jpg");
+    files.emplace_back(99, "/r/D/d99.jpg");
+    files.emplace_back(0x9E3779B97F4A7C15ULL, "/r/E/e1.jpg");
+    files.emplace_back(77, "/r/E/e2.jpg");
+    for (auto& f : files)
+        dirs.add(f.first, f.second.c_str());
+    dirs.build();
+
+    ASSERT_EQ(dirs.exact().size(), 1);
+    auto& group = dirs.exact()[0];
+    ASSERT_EQ(group.dirs.size(), 3);
+    EXPECT_EQ(dirs.path(group.dirs[0]), "/r/A");
+    EXPECT_EQ(dirs.path(group.dirs[1]), "/r/B");
+    EXPECT_EQ(dirs.path(group.dirs[2]), "/r/C/inner");
+    EXPECT_EQ(dirs.files(group.dirs[0]), 8);
+
+    // copies stand for each other, a directory is not paired with its own sub directory
+    ASSERT_EQ(dirs.similar().size(), 1);
+    auto& pair = dirs.similar()[0];
+    EXPECT_EQ(dirs.path(pair.a), "/r/A");
+    EXPECT_EQ(dirs.path(pair.b), "/r/D");
+    EXPECT_GT(pair.similarity, 0.5);
+
+    for (size_t i = 0; i < files.size(); i++)
+        EXPECT_EQ(dirs.covered(i), i < 24) << files[i].second;
+    // copies of A are owned by its group, their sub directories by the group implied by it
+    EXPECT_EQ(dirs.owner(0), dirs.owner(8));
+    EXPECT_EQ(dirs.owner(6), dirs.owner(14));
+    EXPECT_NE(dirs.owner(0), dirs.owner(6));
+    EXPECT_EQ(dirs.owner(24), DirGroups::DIR_NONE);
+}
+
+TEST(index, dir_groups_failed)
+{
+    // F and H hold the same failed file, G lacks it
+    DirGroups dirs;
+    for (std::string dir : {"/r/F", "/r/G", "/r/H"}) {
+        dirs.add(5, (dir + "/a.jpg").c_str());
+        dirs.add(6, (dir + "/b.jpg").c_str());
+    }
+    dirs.add_failed("/r/F/broken.jpg");
+    dirs.add_failed("/r/H/broken.jpg");
+    dirs.build();
+
+    ASSERT_EQ(dirs.exact().size(), 1);
+    auto& group = dirs.exact()[0];
+    ASSERT_EQ(group.dirs.size(), 2);
+    EXPECT_EQ(dirs.path(group.dirs[0]), "/r/F");
+    EXPECT_EQ(dirs.path(group.dirs[1]), "/r/H");
+    EXPECT_EQ(dirs.files(group.dirs[0]), 3);
+    EXPECT_FALSE(dirs.covered(2));
+    EXPECT_FALSE(dirs.covered(3));
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <benchmark/benchmark.h>
+#include "internal/util.h"
+
+using namespace vhash;
+
+static const int64_t BATCH_TASKS = 10000;
+
+// submit and execute tasks one by one from an external thread
+static void BM_pool_post(benchmark::State& state) {
+    ThreadPool pool(state.range(0));
+    for (auto _ : state) {
+        Latch latch(BATCH_TASKS);
+        for (int64_t i = 0; i < BATCH_TASKS; i++)
+            pool.post([&latch] { latch.count_down(); });
+        latch.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * BATCH_TASKS);
+}
+BENCHMARK(BM_pool_post)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+// submit and execute tasks in batch from an external thread
+static void BM_pool_post_batch(benchmark::State& state) {
+    ThreadPool pool(state.range(0));
+    for (auto _ : state) {
+        Latch latch(BATCH_TASKS);
+        pool.post_batch(BATCH_TASKS, [&latch](size_t i) {
+            return [&latch] { latch.count_down(); };
+        });
+        latch.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * BATCH_TASKS);
+}
+BENCHMARK(BM_pool_post_batch)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+// submit tasks with future and wait all
+static void BM_pool_commit(benchmark::State& state) {
+    ThreadPool pool(state.range(0));
+    std::vector<std::future<int64_t>> futures(BATCH_TASKS);
+    for (auto _ : state) {
+        for (int64_t i = 0; i < BATCH_TASKS; i++)
+            futures[i] = pool.commit([i] { return i; });
+        for (auto& future: futures)
+            benchmark::DoNotOptimize(future.get());
+    }
+    state.SetItemsProcessed(state.iterations() * BATCH_TASKS);
+}
+BENCHMARK(BM_pool_commit)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+// latency of fanning out one task per thread and waiting for all of them
+static void BM_pool_fan_out_in(benchmark::State& state) {
+    ThreadPool pool(state.range(0));
+    size_t n = pool.pool_size();
+    for (auto _ : state) {
+        Latch latch(n);
+        pool.post_batch(n, [&latch](size_t i) {
+            return [&latch] { latch.count_down(); };
+        });
+        latch.wait();
+    }
+}
+BENCHMARK(BM_pool_fan_out_in)->RangeMultiplier(2)->Range(1, 256)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// tasks spawned by workers go to their own deque and are stolen by idle workers
+static void BM_pool_nested(benchmark::State& state) {
+    ThreadPool pool(state.range(0));
+    const int64_t fan_out = 100;
+    for (auto _ : state) {
+        Latch latch(fan_out * fan_out);
+        pool.post_batch(fan_out, [&](size_t i) {
+            return [&] {
+                pool.post_batch(fan_out, [&latch](size_t j) {
+                    return [&latch] { latch.count_down(); };
+                });
+            };
+        });
+        latch.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * fan_out * fan_out);
+}
+BENCHMARK(BM_pool_nested)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -85,6 +85,28 @@ TEST(scan, for_each_bg)
     }
 }
 
+TEST(scan, file_id)
+{
+    std::string file = "/tmp/test_vhash_scan_file";
+    std::string link = "/tmp/test_vhash_scan_link";
+    unlink(file.c_str());
+    unlink(link.c_str());
+    FILE *fp = fopen(file.c_str(), "w");
+    ASSERT_NE(fp, nullptr);
+    fclose(fp);
+    ASSERT_EQ(::link(file.c_str(), link.c_str()), 0);
+
+    struct stat st1 = {0}, st2 = {0};
+    ASSERT_EQ(stat(file.c_str(), &st1), 0);
+    ASSERT_EQ(stat(link.c_str(), &st2), 0);
+    EXPECT_EQ(st1.st_nlink, 2);
+    EXPECT_TRUE(scanner_file_id(st1) == scanner_file_id(st2));
+    EXPECT_EQ(file_id_hash()(scanner_file_id(st1)), file_id_hash()(scanner_file_id(st2)));
+
+    unlink(file.c_str());
+    unlink(link.c_str());
+}
+
 TEST(scan, path_split)
 {
     auto v = scanner_path_split("./tests/scan_test.cpp");
@@ -0,0 +1,369 @@
+// Copyright (c) 2022 Leo
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of
+// the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+// THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <gtest/gtest.h>
+#include <fstream>
+#include "internal/hashfile.h"
+#include "internal/journal.h"
+#include "internal/util.h"
+
+using namespace vhash;
+
+TEST(util, image_probe)
+{
+    int rows, cols;
+    FileLoader loader("tests/testdata/lena.png", "rb");
+    std::vector<uint8_t> data;
+    ASSERT_GT(loader.read(data), 0);
+    ASSERT_EQ(image_probe(data, rows, cols), 0);
+    EXPECT_EQ(rows, 512);
+    EXPECT_EQ(cols, 512);
+
+    cv::Mat image(300, 400, CV_8UC3);
+    cv::randu(image, 0, 255);
+    for (auto ext : {".png", ".jpg", ".bmp", ".webp"}) {
+        std::vector<uint8_t> buf;
+        ASSERT_TRUE(cv::imencode(ext, image, buf));
+        ASSERT_EQ(image_probe(buf, rows, cols), 0) << ext;
+        EXPECT_EQ(rows, 300) << ext;
+        EXPECT_EQ(cols, 400) << ext;
+    }
+
+    std::vector<uint8_t> text = {'n', 'o', 't', ' ', 'a', 'n', ' ', 'i', 'm', 'a', 'g', 'e'};
+    EXPECT_LT(image_probe(text, rows, cols), 0);
+}
+
+TEST(util, memory_budget)
+{
+    MemoryBudget budget(100);
+    budget.acquire(60);
+    EXPECT_EQ(budget.used(), 60);
+
+    // blocks until the first reservation is released
+    std::atomic<bool> admitted{false};
+    std::thread th([&] {
+        budget.acquire(60);
+        admitted = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(admitted.load());
+    budget.release(60);
+    th.join();
+    EXPECT_TRUE(admitted.load());
+    EXPECT_EQ(budget.waits(), 1);
+    budget.release(60);
+
+    // request larger than budget runs alone
+    budget.acquire(500);
+    EXPECT_EQ(budget.peak(), 500);
+    budget.release(500);
+    EXPECT_EQ(budget.used(), 0);
+
+    // a small request arriving after a waiting large one is admitted after it
+    budget.acquire(30);
+    std::vector<int> order;
+    std::mutex order_lock;
+    std::thread large([&] {
+        budget.acquire(90);
+        std::lock_guard<std::mutex> lock(order_lock);
+        order.push_back(90);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::thread small([&] {
+        budget.acquire(10);
+        std::lock_guard<std::mutex> lock(order_lock);
+        order.push_back(10);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    {
+        std::lock_guard<std::mutex> lock(order_lock);
+        EXPECT_TRUE(order.empty());
+    }
+    budget.release(30);
+    large.join();
+    budget.release(90);
+    small.join();
+    budget.release(10);
+    EXPECT_EQ(order, std::vector<int>({90, 10}));
+    EXPECT_EQ(budget.used(), 0);
+}
+
+TEST(util, thread_budget)
+{
+    EXPECT_GE(thread_budget_cpus(), 1);
+
+    auto budget = thread_budget_make(16);
+    EXPECT_EQ(budget.hash_jobs, 4);
+    EXPECT_EQ(budget.decode_jobs, 12);
+    EXPECT_EQ(budget.inner_threads, 1);
+
+    // fewer decode jobs leave cpus not taken by hash jobs to threads inside each decode
+    budget = thread_budget_make(16, 2);
+    EXPECT_EQ(budget.decode_jobs, 2);
+    EXPECT_EQ(budget.hash_jobs, 4);
+    EXPECT_EQ(budget.inner_threads, 6);
+
+    // hash jobs taking all cpus still leave one thread to each decode
+    budget = thread_budget_make(4, 2, 8);
+    EXPECT_EQ(budget.inner_threads, 1);
+
+    budget = thread_budget_make(1);
+    EXPECT_EQ(budget.decode_jobs, 1);
+    EXPECT_EQ(budget.hash_jobs, 1);
+}
+
+TEST(util, lock_free_queue)
+{
+    LockFreeQueue<int> queue(4);
+    EXPECT_EQ(queue.capacity(), 4);
+    for (int i = 0; i < 4; i++) {
+        int v = i;
+        EXPECT_TRUE(queue.try_push(v));
+    }
+    int v = 4;
+    EXPECT_FALSE(queue.try_push(v));
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.try_pop(v));
+        EXPECT_EQ(v, i);
+    }
+    EXPECT_FALSE(queue.try_pop(v));
+}
+
+TEST(util, async_writer_ordered)
+{
+    std::string path = "/tmp/test_vhash_async_writer.txt";
+    {
+        auto format = [](const int& item, std::string& buf) {
+            buf += std::to_string(item) + "\n";
+        };
+        AsyncWriter<int> writer(path, format, 16);
+        ASSERT_TRUE(writer.is_open());
+        // seq 3 has no record, the records after it are written at close
+        for (int seq : {1, 0, 4, 2, 6, 5}) {
+            writer.write(seq, seq * 10);
+        }
+        EXPECT_EQ(writer.close(), 0);
+    }
+
+    std::ifstream in(path);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(content, "0\n10\n20\n40\n50\n60\n");
+}
+
+TEST(util, async_writer_full_queue)
+{
+    // more records than the queue holds, producers block until the writer catches up
+    std::atomic<int64_t> sum{0};
+    AsyncWriter<int> writer([&](const int& item) {
+        sum += item;
+    });
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; ++t) {
+        producers.emplace_back([&writer, t] {
+            for (int i = 0; i < 20000; ++i)
+                writer.write(t * 20000 + i, 1);
+        });
+    }
+    for (auto& p : producers)
+        p.join();
+    EXPECT_EQ(writer.close(), 0);
+    EXPECT_EQ(sum.load(), 80000);
+}
+
+TEST(util, hashfile_roundtrip)
+{
+    std::string path = "/tmp/test_vhash_hashfile.bin";
+    {
+        HashFileWriter writer(path);
+        ASSERT_TRUE(writer.is_open());
+        for (int i = 0; i < 1000; ++i) {
+            EXPECT_EQ(writer.append(0xF0000000ULL + i, i * 10, 1650000000 + i, "dir/file_" + std::to_string(i) + ".mp4"), 0);
+        }
+        // a failed file is flagged, its zero hash is not a hash value
+        EXPECT_EQ(writer.append(0, 5, 1650000000, "dir/broken.mp4", HASHFILE_FAILED | HASHFILE_TIMEOUT), 0);
+        writer.set_shard(3, 8);
+        writer.set_dihedral(true);
+        EXPECT_EQ(writer.close(), 0);
+    }
+
+    EXPECT_TRUE(hashfile_check(path));
+    HashFileReader reader(path);
+    ASSERT_TRUE(reader.is_open());
+    ASSERT_EQ(reader.size(), 1001);
+    EXPECT_EQ(reader[7].hash, 0xF0000007ULL);
+    EXPECT_EQ(reader[7].flags, 0u);
+    EXPECT_EQ(reader[1000].flags, HASHFILE_FAILED | HASHFILE_TIMEOUT);
+    EXPECT_STREQ(reader.path(reader[1000]), "dir/broken.mp4");
+    EXPECT_EQ(reader[7].size, 70);
+    EXPECT_EQ(reader[7].mtime, 1650000007);
+    EXPECT_STREQ(reader.path(reader[999]), "dir/file_999.mp4");
+    EXPECT_EQ(reader.shard_index(), 3);
+    EXPECT_EQ(reader.shard_count(), 8);
+    EXPECT_TRUE(reader.dihedral());
+    EXPECT_FALSE(hashfile_check("/tmp/test_vhash_async_writer.txt"));
+}
+
+TEST(util, hashfile_byte_order)
+{
+    std::string path = "/tmp/test_vhash_hashfile_order.bin";
+    {
+        HashFileWriter writer(path);
+        ASSERT_TRUE(writer.is_open());
+        EXPECT_EQ(writer.append(1, 2, 3, "a.mp4"), 0);
+        EXPECT_EQ(writer.close(), 0);
+    }
+    EXPECT_TRUE(HashFileReader(path).is_open());
+
+    // file written on a machine of the other byte order
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    uint32_t swapped = __builtin_bswap32(HASHFILE_BYTE_ORDER);
+    file.seekp(offsetof(hashfile_header, byte_order));
+    file.write(reinterpret_cast<const char *>(&swapped), sizeof(swapped));
+    file.close();
+    EXPECT_FALSE(HashFileReader(path).is_open());
+}
+
+TEST(util, journal_resume)
+{
+    std::string path = "/tmp/test_vhash_journal.txt";
+    {
+        Journal journal(path, false);
+        ASSERT_TRUE(journal.is_open());
+        EXPECT_EQ(journal.append(0xABCDEF, 100, 1650000000, "/data/a.mp4"), 0);
+        EXPECT_EQ(journal.append(0x123456, 200, 1650000001, "/data/b c.png"), 0);
+        EXPECT_EQ(journal.close(), 0);
+    }
+    // torn line of a killed run
+    {
+        std::ofstream out(path, std::ios::app);
+        out << "fedcba\t300";
+    }
+
+    {
+        Journal journal(path, true);
+        ASSERT_TRUE(journal.is_open());
+        EXPECT_EQ(journal.size(), 2);
+        uint64_t hv = 0;
+        EXPECT_TRUE(journal.find("/data/a.mp4", 100, 1650000000, hv));
+        EXPECT_EQ(hv, 0xABCDEF);
+        EXPECT_TRUE(journal.find("/data/b c.png", 200, 1650000001, hv));
+        EXPECT_EQ(hv, 0x123456);
+        // changed file is not resumed
+        EXPECT_FALSE(journal.find("/data/a.mp4", 101, 1650000000, hv));
+        EXPECT_FALSE(journal.find("/data/c.mp4", 100, 1650000000, hv));
+        EXPECT_EQ(journal.append(0x42, 400, 1650000002, "/data/d.gif"), 0);
+        EXPECT_EQ(journal.close(), 0);
+    }
+
+    Journal journal(path, true);
+    EXPECT_EQ(journal.size(), 3);
+    uint64_t hv = 0;
+    EXPECT_TRUE(journal.find("/data/d.gif", 400, 1650000002, hv));
+    EXPECT_EQ(hv, 0x42);
+}
+
+TEST(util, journal_sync)
+{
+    std::string path = "/tmp/test_vhash_journal_sync.txt";
+    Journal journal(path, false);
+    ASSERT_TRUE(journal.is_open());
+    EXPECT_EQ(journal.append(0xABCDEF, 100, 1650000000, "/data/a.mp4"), 0);
+
+    // lines reach the file within the sync interval, though no more lines are appended
+    std::string content;
+    auto start = std::chrono::steady_clock::now();
+    while (content.find("/data/a.mp4\n") == std::string::npos &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::ifstream in(path);
+        content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    EXPECT_EQ(content, "#mode\t0\nabcdef\t100\t1650000000\t/data/a.mp4\n");
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(3));
+    EXPECT_EQ(journal.close(), 0);
+    std::remove(path.c_str());
+}
+
+TEST(util, journal_mode)
+{
+    std::string path = "/tmp/test_vhash_journal_mode.txt";
+    {
+        Journal journal(path, false, JOURNAL_DIHEDRAL);
+        ASSERT_TRUE(journal.is_open());
+        EXPECT_EQ(journal.append(0xABCDEF, 100, 1650000000, "/data/a.mp4"), 0);
+        EXPECT_EQ(journal.close(), 0);
+    }
+
+    // hashes of another mode are not resumed
+    {
+        Journal journal(path, true);
+        EXPECT_FALSE(journal.is_open());
+        EXPECT_EQ(journal.mode(), JOURNAL_DIHEDRAL);
+        EXPECT_EQ(journal.size(), 1);
+    }
+    {
+        Journal journal(path, true, JOURNAL_DIHEDRAL);
+        ASSERT_TRUE(journal.is_open());
+        uint64_t hv = 0;
+        EXPECT_TRUE(journal.find("/data/a.mp4", 100, 1650000000, hv));
+        EXPECT_EQ(hv, 0xABCDEF);
+    }
+
+    // journal without header is of mode 0
+    {
+        std::ofstream out(path, std::ios::trunc);
+        out << "42\t400\t1650000002\t/data/d.gif\n";
+    }
+    Journal journal(path, true, JOURNAL_DIHEDRAL);
+    EXPECT_FALSE(journal.is_open());
+    EXPECT_EQ(journal.mode(), 0);
+    Journal legacy(path, true);
+    ASSERT_TRUE(legacy.is_open());
+    EXPECT_EQ(legacy.size(), 1);
+}
+
+TEST(util, decode_budget)
+{
+    EXPECT_EQ(DecodeBudget::current(), nullptr);
+    Watchdog watchdog(0.05);
+    {
+        DecodeScope scope(&watchdog, "slow", 0);
+        ASSERT_NE(DecodeBudget::current(), nullptr);
+        auto start = std::chrono::steady_clock::now();
+        while (!scope.expired() && std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        EXPECT_TRUE(scope.expired());
+        EXPECT_TRUE(DecodeBudget::current()->expired());
+    }
+    EXPECT_EQ(DecodeBudget::current(), nullptr);
+    EXPECT_EQ(watchdog.expired(), 1);
+
+    // steps without watchdog
+    {
+        DecodeScope scope(nullptr, "steps", 10);
+        EXPECT_FALSE(DecodeBudget::current()->spent(10));
+        EXPECT_TRUE(DecodeBudget::current()->spent(11));
+        EXPECT_TRUE(scope.expired());
+    }
+
+    // finished decoding is not expired
+    {
+        DecodeScope scope(&watchdog, "fast", 0);
+        EXPECT_FALSE(scope.expired());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(watchdog.expired(), 1);
+}